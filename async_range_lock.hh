@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include "range_lock.hh"
+#include <mutex>
+#include <future>
+#include <utility>
+#include <type_traits>
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define RANGE_LOCK_HAS_COROUTINES 1
+#endif
+
+class async_range_lock;
+
+namespace range_lock_detail {
+
+/// State of an asynchronous lock request. It's queued on the region it waits
+/// for, and handed the region by whoever releases it, who also locks the
+/// remaining regions on its behalf.
+struct async_lock_request {
+    async_range_lock* owner;
+    uint64_t next_id;  // first region not acquired yet
+    uint64_t last_id;
+    bool shared;
+    async_lock_request* next = nullptr;
+    void (*on_locked)(async_lock_request*);
+};
+
+}
+
+/// \brief Asynchronous region mutex
+///
+/// Region mutex which never blocks: a request that cannot be granted
+/// immediately is queued, and granted by unlock(). Requests are granted in
+/// arrival order, consecutive shared requests at once.
+class async_region_mutex {
+    typedef range_lock_detail::async_lock_request request;
+
+    std::mutex _lock;
+    uint32_t _readers = 0;
+    bool _writer = false;
+    request* _head = nullptr;
+    request* _tail = nullptr;
+
+    bool compatible(bool shared) const {
+        return !_writer && (shared || !_readers);
+    }
+
+    void take(bool shared) {
+        if (shared) {
+            _readers++;
+        } else {
+            _writer = true;
+        }
+    }
+public:
+    // Acquires ownership on behalf of req, unless it's queued on a busy mutex.
+    // Returns true if ownership was acquired.
+    bool lock_or_enqueue(request& req) {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (!_head && compatible(req.shared)) {
+            take(req.shared);
+            return true;
+        }
+        req.next = nullptr;
+        if (_tail) {
+            _tail->next = &req;
+        } else {
+            _head = &req;
+        }
+        _tail = &req;
+        return false;
+    }
+
+    // Waiters are taken into account, so that try_lock() doesn't jump the queue.
+    bool try_lock(bool shared) {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (_head || !compatible(shared)) {
+            return false;
+        }
+        take(shared);
+        return true;
+    }
+
+    // Releases ownership, and pushes the requests granted ownership in turn
+    // onto granted.
+    void unlock(bool shared, request*& granted) {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (shared) {
+            assert(_readers > 0); // assert mutex is held for shared ownership
+            _readers--;
+        } else {
+            assert(_writer); // assert mutex is held for exclusive ownership
+            _writer = false;
+        }
+        while (_head && compatible(_head->shared)) {
+            request* req = _head;
+            _head = req->next;
+            if (!_head) {
+                _tail = nullptr;
+            }
+            take(req->shared);
+            req->next = granted;
+            granted = req;
+        }
+    }
+};
+
+/// \brief Asynchronous range lock class
+///
+/// Same locking scheme as range_lock, but requests never block the calling
+/// thread. A request that meets a busy region is queued on it, and when the
+/// region is released, the releasing thread hands the region over and locks
+/// the following regions on behalf of the request, which completes once the
+/// whole range is held. So a few threads can serve thousands of in-flight
+/// requests, each one costing a small request object rather than a blocked
+/// thread.
+///
+/// Completion runs either in the thread that requested the lock, if the
+/// range was acquired right away, or in the thread that released the last
+/// region it waited for. Completions run from unlock() are deferred until the
+/// outermost unlock() of that thread is about to return, so stack depth is
+/// bounded however long the chain of waiters is. Completions are expected
+/// to be short, or to hand the work over to an executor, and must not throw:
+/// one run from unlock() would throw into an unrelated thread, with requests
+/// still pending in it, so std::terminate() is called instead.
+///
+/// Three flavors of acquisition are available:
+/// - lock_async(offset, length, callback): callback is called once the range
+///   is held.
+/// - lock_async(offset, length): returns a std::future<void> which becomes
+///   ready once the range is held.
+/// - co_await lock(offset, length) with C++20 coroutines: the coroutine is
+///   resumed once the range is held.
+/// All of them have a counterpart for shared ownership. Ranges are released
+/// synchronously with unlock() and unlock_shared().
+class async_range_lock {
+    typedef sharded_region_table<async_region_mutex> region_table;
+    typedef region_table::region region;
+    typedef range_lock_detail::async_lock_request request;
+
+    static constexpr unsigned region_batch_size = region_table::batch_size;
+
+    region_table _table;
+    const uint64_t _region_size;
+
+    template <typename Callback>
+    struct callback_request : public request {
+        Callback callback;
+
+        explicit callback_request(Callback&& callback) : callback(std::move(callback)) {
+            on_locked = run;
+        }
+
+        static void run(request* req) {
+            callback_request* self = static_cast<callback_request*>(req);
+            Callback callback = std::move(self->callback);
+            delete self;
+            callback();
+        }
+    };
+
+    struct promise_callback {
+        std::promise<void> promise;
+
+        void operator()() {
+            promise.set_value();
+        }
+    };
+
+    // Requests granted by unlock() whose completion is pending in this thread.
+    struct granted_queue {
+        request* head = nullptr;
+        request* tail = nullptr;
+        bool draining = false;
+    };
+public:
+    async_range_lock() = delete;
+    async_range_lock& operator=(const async_range_lock&) = delete;
+    async_range_lock(const async_range_lock&) = delete;
+
+    // NOTE: Please make sure that region_size is greater than or equal to 64
+    // and power of two. Use std::pow(2, exp) to generate a proper region size.
+    explicit async_range_lock(uint64_t region_size) : _region_size(region_size) {
+        assert(region_size >= 64);
+        assert((region_size & (region_size - 1)) == 0);
+    }
+
+    // Create an async_range_lock with the region size range_lock would choose
+    // for a resource of the given size.
+    static std::unique_ptr<async_range_lock> create_range_lock(uint64_t resource_size) {
+        uint64_t region_size = range_lock::region_size_for(resource_size);
+        return std::unique_ptr<async_range_lock>(new async_range_lock(region_size));
+    }
+
+    uint64_t region_size() const { return _region_size; }
+private:
+    static inline void validate_parameters(uint64_t offset, uint64_t length) {
+        assert(length > 0);
+        assert(offset < (offset + length)); // check for overflow
+    }
+
+    void init_request(request& req, uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        req.owner = this;
+        req.next_id = offset / _region_size;
+        req.last_id = (offset + length - 1) / _region_size;
+        req.shared = shared;
+    }
+
+    // Lock the regions of req from req.next_id on, in ascending order.
+    // Returns true once all of them are held, or false once req is queued on
+    // a busy region. In the latter case req must not be touched anymore, as
+    // another thread may complete it at any time.
+    bool acquire(request& req) {
+        uint64_t id = req.next_id;
+        const uint64_t last_id = req.last_id;
+        while (id <= last_id) {
+            unsigned count = unsigned(std::min(uint64_t(region_batch_size - (id & (region_batch_size - 1))),
+                last_id - id + 1));
+            region* regions[region_batch_size];
+            _table.pin(id, count, regions);
+            for (unsigned i = 0; i < count; i++) {
+                req.next_id = id + i + 1;
+                if (!regions[i]->mutex.lock_or_enqueue(req)) {
+                    // The region req is queued on stays pinned on its behalf.
+                    if (i + 1 < count) {
+                        _table.unpin(id + i + 1, count - i - 1, [] (region&) {});
+                    }
+                    return false;
+                }
+            }
+            id += count;
+        }
+        return true;
+    }
+
+    static granted_queue& local_granted_queue() {
+        static thread_local granted_queue queue;
+        return queue;
+    }
+
+    // Lock the remaining regions of a granted request, and complete it once
+    // it got them all. Neither may throw, see the class comment.
+    static void resume_one(request* req) noexcept {
+        if (req->owner->acquire(*req)) {
+            req->on_locked(req);
+        }
+    }
+
+    // Resume the requests granted ownership of a region, so that they lock
+    // their remaining regions, and complete the ones that got them all.
+    static void resume(request* granted) {
+        granted_queue& queue = local_granted_queue();
+        while (granted) {
+            request* req = granted;
+            granted = req->next;
+            req->next = nullptr;
+            if (queue.tail) {
+                queue.tail->next = req;
+            } else {
+                queue.head = req;
+            }
+            queue.tail = req;
+        }
+        if (queue.draining) {
+            return;
+        }
+        queue.draining = true;
+        while (queue.head) {
+            request* req = queue.head;
+            queue.head = req->next;
+            if (!queue.head) {
+                queue.tail = nullptr;
+            }
+            resume_one(req);
+        }
+        queue.draining = false;
+    }
+
+    void unlock_regions(uint64_t first_id, uint64_t last_id, bool shared) {
+        request* granted = nullptr;
+        uint64_t id = first_id;
+        while (id <= last_id) {
+            unsigned count = unsigned(std::min(uint64_t(region_batch_size - (id & (region_batch_size - 1))),
+                last_id - id + 1));
+            _table.unpin(id, count, [shared, &granted] (region& r) { r.mutex.unlock(shared, granted); });
+            id += count;
+        }
+        resume(granted);
+    }
+
+    template <typename Callback>
+    void generic_lock_async(uint64_t offset, uint64_t length, bool shared, Callback&& callback) {
+        typedef callback_request<typename std::decay<Callback>::type> callback_request_type;
+        auto req = new callback_request_type(typename std::decay<Callback>::type(std::forward<Callback>(callback)));
+        init_request(*req, offset, length, shared);
+        if (acquire(*req)) {
+            req->on_locked(req);
+        }
+    }
+
+    std::future<void> generic_lock_async(uint64_t offset, uint64_t length, bool shared) {
+        promise_callback callback;
+        std::future<void> f = callback.promise.get_future();
+        generic_lock_async(offset, length, shared, std::move(callback));
+        return f;
+    }
+
+    bool generic_try_lock(uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        uint64_t first_id = offset / _region_size;
+        uint64_t last_id = (offset + length - 1) / _region_size;
+        for (uint64_t id = first_id; id <= last_id; id++) {
+            region* r;
+            _table.pin(id, 1, &r);
+            if (!r->mutex.try_lock(shared)) {
+                _table.unpin(id, 1, [] (region&) {});
+                if (id > first_id) {
+                    unlock_regions(first_id, id - 1, shared);
+                }
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void generic_unlock(uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        unlock_regions(offset / _region_size, (offset + length - 1) / _region_size, shared);
+    }
+
+#ifdef RANGE_LOCK_HAS_COROUTINES
+    class lock_awaitable : private request {
+        async_range_lock& _lock;
+        std::coroutine_handle<> _handle;
+
+        static void resume_coroutine(request* req) {
+            static_cast<lock_awaitable*>(req)->_handle.resume();
+        }
+    public:
+        lock_awaitable(async_range_lock& lock, uint64_t offset, uint64_t length, bool shared) : _lock(lock) {
+            on_locked = resume_coroutine;
+            lock.init_request(*this, offset, length, shared);
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        // Don't suspend if the range was acquired right away.
+        bool await_suspend(std::coroutine_handle<> handle) {
+            _handle = handle;
+            return !_lock.acquire(*this);
+        }
+
+        void await_resume() const noexcept {}
+    };
+#endif
+public:
+    // Lock range [offset, offset+length) for exclusive ownership, and call
+    // callback() once it's held.
+    template <typename Callback>
+    void lock_async(uint64_t offset, uint64_t length, Callback&& callback) {
+        generic_lock_async(offset, length, false, std::forward<Callback>(callback));
+    }
+
+    // Lock range [offset, offset+length) for exclusive ownership. The returned
+    // future becomes ready once it's held.
+    std::future<void> lock_async(uint64_t offset, uint64_t length) {
+        return generic_lock_async(offset, length, false);
+    }
+
+    // Tries to lock the range [offset, offset+length) for exclusive ownership.
+    // This function returns immediately.
+    // On successful range acquisition returns true, otherwise returns false.
+    bool try_lock(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, false);
+    }
+
+    // Unlock range [offset, offset+length) from exclusive ownership.
+    void unlock(uint64_t offset, uint64_t length) {
+        generic_unlock(offset, length, false);
+    }
+
+    // Lock range [offset, offset+length) for shared ownership, and call
+    // callback() once it's held.
+    template <typename Callback>
+    void lock_shared_async(uint64_t offset, uint64_t length, Callback&& callback) {
+        generic_lock_async(offset, length, true, std::forward<Callback>(callback));
+    }
+
+    // Lock range [offset, offset+length) for shared ownership. The returned
+    // future becomes ready once it's held.
+    std::future<void> lock_shared_async(uint64_t offset, uint64_t length) {
+        return generic_lock_async(offset, length, true);
+    }
+
+    // Tries to lock the range [offset, offset+length) for shared ownership.
+    // This function returns immediately.
+    // On successful range acquisition returns true, otherwise returns false.
+    bool try_lock_shared(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, true);
+    }
+
+    // Unlock range [offset, offset+length) from shared ownership.
+    void unlock_shared(uint64_t offset, uint64_t length) {
+        generic_unlock(offset, length, true);
+    }
+
+#ifdef RANGE_LOCK_HAS_COROUTINES
+    // co_await lock(offset, length) locks range [offset, offset+length) for
+    // exclusive ownership, suspending the coroutine until it's held.
+    lock_awaitable lock(uint64_t offset, uint64_t length) {
+        return lock_awaitable(*this, offset, length, false);
+    }
+
+    // co_await lock_shared(offset, length) locks range [offset, offset+length)
+    // for shared ownership, suspending the coroutine until it's held.
+    lock_awaitable lock_shared(uint64_t offset, uint64_t length) {
+        return lock_awaitable(*this, offset, length, true);
+    }
+#endif
+};
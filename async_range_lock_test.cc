@@ -0,0 +1,199 @@
+///
+/// Purpose of this program is to test async_range_lock implementation.
+///
+
+#include "async_range_lock.hh"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <assert.h>
+
+#define print_test_name() \
+    std::cout << "\nRunning " << __FUNCTION__ << "...\n";
+
+static void callback_test(async_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    bool first = false;
+    bool second = false;
+    std::cout << "Checking that a free range is acquired right away\n";
+    range_lock.lock_async(0, 2 * size, [&] { first = true; });
+    assert(first);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that an overlapping request is queued and completed on release\n";
+    range_lock.lock_async(size, 2 * size, [&] { second = true; });
+    assert(!second);
+    std::cout << "Checking that a queued request doesn't hold the regions after the busy one\n";
+    assert(range_lock.try_lock(2 * size, size));
+    range_lock.unlock(0, 2 * size);
+    assert(!second);
+    range_lock.unlock(2 * size, size);
+    assert(second);
+    range_lock.unlock(size, 2 * size);
+    assert(range_lock.try_lock(0, 3 * size));
+    range_lock.unlock(0, 3 * size);
+    std::cout << "Succeeded\n";
+}
+
+static void fifo_test(async_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::vector<int> order;
+    std::cout << "Checking that waiters are granted in arrival order, readers together\n";
+    range_lock.lock_async(0, size, [&] { order.push_back(0); });
+    range_lock.lock_shared_async(0, size, [&] { order.push_back(1); });
+    range_lock.lock_shared_async(0, size, [&] { order.push_back(2); });
+    range_lock.lock_async(0, size, [&] { order.push_back(3); });
+    range_lock.lock_shared_async(0, size, [&] { order.push_back(4); });
+    assert(order.size() == 1);
+    assert(!range_lock.try_lock_shared(0, size));
+
+    range_lock.unlock(0, size);
+    assert(order.size() == 3);
+    range_lock.unlock_shared(0, size);
+    assert(order.size() == 3);
+    range_lock.unlock_shared(0, size);
+    assert(order.size() == 4 && order[3] == 3);
+    range_lock.unlock(0, size);
+    assert(order.size() == 5 && order[4] == 4);
+    range_lock.unlock_shared(0, size);
+    std::cout << "Succeeded\n";
+}
+
+static void chain_test(async_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    const unsigned requests = 100000;
+    unsigned completed = 0;
+    std::cout << "Checking that a long chain of waiters completes on a single thread\n";
+    assert(range_lock.try_lock(0, size));
+    for (unsigned i = 0; i < requests; i++) {
+        // Each completion releases the range, which grants the next waiter.
+        range_lock.lock_async(0, size, [&] {
+            completed++;
+            range_lock.unlock(0, size);
+        });
+    }
+    assert(completed == 0);
+    range_lock.unlock(0, size);
+    assert(completed == requests);
+    std::cout << "Succeeded\n";
+}
+
+static void mutual_exclusion_test(async_range_lock& range_lock) {
+    print_test_name();
+
+    const unsigned threads = 8;
+    const unsigned iterations = 3000;
+    const uint64_t regions = 1024;
+    auto size = range_lock.region_size();
+    std::vector<uint64_t> counters(regions, 0);
+    std::vector<std::thread> ts;
+    std::atomic<uint64_t> expected(0);
+    std::atomic<uint64_t> torn_reads(0);
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % regions;
+                uint64_t count = 1 + (state >> 20) % std::min(regions - first, uint64_t(16));
+                auto sum = [&] {
+                    uint64_t total = 0;
+                    for (uint64_t k = first; k < first + count; k++) {
+                        total += counters[k];
+                    }
+                    return total;
+                };
+                if (j % 4 == 0) {
+                    range_lock.lock_shared_async(first * size, count * size).wait();
+                    uint64_t before = sum();
+                    std::this_thread::yield();
+                    if (sum() != before) {
+                        torn_reads++;
+                    }
+                    range_lock.unlock_shared(first * size, count * size);
+                } else {
+                    range_lock.lock_async(first * size, count * size).wait();
+                    for (uint64_t k = first; k < first + count; k++) {
+                        counters[k]++;
+                    }
+                    range_lock.unlock(first * size, count * size);
+                    expected += count;
+                }
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    uint64_t total = 0;
+    for (auto c : counters) {
+        total += c;
+    }
+    assert(total == expected);
+    assert(torn_reads == 0);
+    std::cout << "Checked " << total << " increments under concurrent overlapping locks\n";
+}
+
+#ifdef RANGE_LOCK_HAS_COROUTINES
+struct detached_task {
+    struct promise_type {
+        detached_task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static detached_task increment(async_range_lock& range_lock, uint64_t offset, uint64_t length,
+        uint64_t& counter, unsigned& done) {
+    co_await range_lock.lock(offset, length);
+    counter++;
+    range_lock.unlock(offset, length);
+    co_await range_lock.lock_shared(offset, length);
+    done++;
+    range_lock.unlock_shared(offset, length);
+}
+
+static void coroutine_test(async_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    const unsigned coroutines = 10000;
+    uint64_t counter = 0;
+    unsigned done = 0;
+    std::cout << "Checking that coroutines suspended on a held range are resumed on release\n";
+    assert(range_lock.try_lock(0, 4 * size));
+    for (unsigned i = 0; i < coroutines; i++) {
+        increment(range_lock, (i % 4) * size, size, counter, done);
+    }
+    assert(counter == 0);
+    range_lock.unlock(0, 4 * size);
+    assert(counter == coroutines);
+    assert(done == coroutines);
+    std::cout << "Succeeded\n";
+}
+#endif
+
+int main(void) {
+    auto range_lock = async_range_lock::create_range_lock(uint64_t(1) << 30);
+    std::cout << "Range lock granularity (a.k.a. region size): " << range_lock->region_size() << std::endl;
+
+    callback_test(*range_lock);
+    fifo_test(*range_lock);
+    chain_test(*range_lock);
+    mutual_exclusion_test(*range_lock);
+#ifdef RANGE_LOCK_HAS_COROUTINES
+    coroutine_test(*range_lock);
+#endif
+
+    return 0;
+}
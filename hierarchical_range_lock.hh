@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include "range_lock.hh"
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+
+/// \brief Intention mutex
+///
+/// Mutex of a node in the hierarchy of hierarchical_range_lock, supporting
+/// the four classic multi-granularity modes: intention shared (IS),
+/// intention exclusive (IX), shared (S) and exclusive (X).
+/// IS and IX are taken on the ancestors of the nodes locked in S and X,
+/// and conflict as follows:
+///
+///          IS   IX   S    X
+///     IS   -    -    -    x
+///     IX   -    -    x    x
+///     S    -    x    -    x
+///     X    x    x    x    x
+class intention_mutex {
+public:
+    enum class mode { intention_shared, intention_exclusive, shared, exclusive };
+private:
+    std::mutex _lock;
+    std::condition_variable _cv;
+    uint32_t _holders[4] = { 0, 0, 0, 0 };
+
+    uint32_t holders(mode m) const {
+        return _holders[unsigned(m)];
+    }
+
+    bool compatible(mode m) const {
+        switch (m) {
+        case mode::intention_shared:
+            return !holders(mode::exclusive);
+        case mode::intention_exclusive:
+            return !holders(mode::shared) && !holders(mode::exclusive);
+        case mode::shared:
+            return !holders(mode::intention_exclusive) && !holders(mode::exclusive);
+        case mode::exclusive:
+            return !holders(mode::intention_shared) && !holders(mode::intention_exclusive)
+                && !holders(mode::shared) && !holders(mode::exclusive);
+        }
+        return false;
+    }
+public:
+    void lock(mode m) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _cv.wait(lock, [this, m] { return this->compatible(m); });
+        _holders[unsigned(m)]++;
+    }
+
+    bool try_lock(mode m) {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (!compatible(m)) {
+            return false;
+        }
+        _holders[unsigned(m)]++;
+        return true;
+    }
+
+    void unlock(mode m) {
+        std::lock_guard<std::mutex> lock(_lock);
+        assert(_holders[unsigned(m)] > 0); // assert mode is held
+        if (--_holders[unsigned(m)] == 0) {
+            _cv.notify_all();
+        }
+    }
+};
+
+/// \brief Hierarchical range lock class
+///
+/// Alternative to range_lock for workloads mixing small ranges with very
+/// large ones, like whole-file locks. Regions are the leaves of a tree in
+/// which every node groups fanout consecutive nodes of the level below, up
+/// to a configurable number of levels.
+///
+/// A range is decomposed into the fewest aligned nodes covering it, which
+/// are locked in S or X mode, and all their ancestors are locked in IS or IX
+/// mode. So a large range only locks a few coarse nodes instead of every
+/// region, while small ranges still only conflict at the
+/// region level: intention modes are compatible with each other.
+/// Deadlock is avoided by always locking nodes from the top level down, and
+/// in ascending order within a level.
+///
+/// Choosing the number of levels:
+/// Every lock takes one node per level, so more levels make small locks more
+/// expensive, while ranges larger than a top level node need one node per
+/// top level node they cover. By default, levels_for() picks enough levels
+/// for fanout top level nodes to cover every offset, so any range locks at
+/// most 2 * fanout nodes per level: O(fanout * levels). With fewer levels,
+/// that bound only holds for ranges up to fanout top level nodes, e.g. with
+/// 6 levels a top level node covers 2^20 regions.
+///
+/// Nodes are kept alive only while in use, by a sharded_region_table of
+/// intention mutexes, keyed by level and index. Region ids must fit in 58
+/// bits, which holds for any region size of at least 64 bytes.
+class hierarchical_range_lock {
+public:
+    static constexpr unsigned fanout_bits = 4;
+    static constexpr uint64_t fanout = uint64_t(1) << fanout_bits;
+    static constexpr unsigned max_levels = 58 / fanout_bits + 1;
+private:
+    typedef sharded_region_table<intention_mutex> node_table;
+    typedef node_table::region node;
+    typedef intention_mutex::mode mode;
+
+    static constexpr unsigned level_shift = 58;
+
+    struct node_request {
+        unsigned level;
+        uint64_t index;
+        mode m;
+
+        uint64_t key() const {
+            return (uint64_t(level) << level_shift) | index;
+        }
+
+        // Top level first, then ascending index.
+        bool operator<(const node_request& other) const {
+            return level > other.level || (level == other.level && index < other.index);
+        }
+
+        bool operator==(const node_request& other) const {
+            return level == other.level && index == other.index;
+        }
+    };
+
+    node_table _nodes;
+    const uint64_t _region_size;
+    const unsigned _levels;
+public:
+    hierarchical_range_lock() = delete;
+    hierarchical_range_lock& operator=(const hierarchical_range_lock&) = delete;
+    hierarchical_range_lock(const hierarchical_range_lock&) = delete;
+
+    // NOTE: Please make sure that region_size is greater than or equal to 64
+    // and power of two. Use std::pow(2, exp) to generate a proper region size.
+    explicit hierarchical_range_lock(uint64_t region_size)
+        : hierarchical_range_lock(region_size, levels_for(region_size)) {}
+
+    hierarchical_range_lock(uint64_t region_size, unsigned levels)
+        : _region_size(region_size)
+        , _levels(levels) {
+        assert(region_size >= 64);
+        assert((region_size & (region_size - 1)) == 0);
+        assert(levels > 0 && levels <= max_levels);
+    }
+
+    // Create a hierarchical_range_lock with the region size range_lock would
+    // choose for a resource of the given size.
+    static std::unique_ptr<hierarchical_range_lock> create_range_lock(uint64_t resource_size) {
+        uint64_t region_size = range_lock::region_size_for(resource_size);
+        return std::unique_ptr<hierarchical_range_lock>(new hierarchical_range_lock(region_size));
+    }
+
+    static std::unique_ptr<hierarchical_range_lock> create_range_lock(uint64_t resource_size, unsigned levels) {
+        uint64_t region_size = range_lock::region_size_for(resource_size);
+        return std::unique_ptr<hierarchical_range_lock>(new hierarchical_range_lock(region_size, levels));
+    }
+
+    // Fewest levels whose top level nodes, fanout of them at most, cover
+    // every offset with the given region size.
+    static unsigned levels_for(uint64_t region_size) {
+        unsigned region_bits = 64;
+        while (region_size > 1) {
+            region_size >>= 1;
+            region_bits--;
+        }
+        unsigned levels = (region_bits + fanout_bits - 1) / fanout_bits;
+        return levels < max_levels ? levels : max_levels;
+    }
+
+    uint64_t region_size() const { return _region_size; }
+    unsigned levels() const { return _levels; }
+
+    // Number of nodes locking [offset, offset+length) takes.
+    size_t node_count(uint64_t offset, uint64_t length) const {
+        return plan(offset, length, false).size();
+    }
+private:
+    static inline void validate_parameters(uint64_t offset, uint64_t length) {
+        assert(length > 0);
+        assert(offset < (offset + length)); // check for overflow
+    }
+
+    // Decompose the regions covered by [offset, offset+length) into aligned
+    // nodes, plus their ancestors, sorted in locking order.
+    std::vector<node_request> plan(uint64_t offset, uint64_t length, bool shared) const {
+        validate_parameters(offset, length);
+        uint64_t lo = offset / _region_size;
+        uint64_t hi = (offset + length - 1) / _region_size + 1;
+        assert(hi <= (uint64_t(1) << level_shift)); // assert region ids fit
+
+        mode covered_mode = shared ? mode::shared : mode::exclusive;
+        mode ancestor_mode = shared ? mode::intention_shared : mode::intention_exclusive;
+        std::vector<node_request> nodes;
+        auto cover = [&] (unsigned level, uint64_t first, uint64_t end) {
+            for (uint64_t i = first; i < end; i++) {
+                nodes.push_back(node_request{level, i, covered_mode});
+                uint64_t index = i;
+                for (unsigned l = level + 1; l < _levels; l++) {
+                    index >>= fanout_bits;
+                    nodes.push_back(node_request{l, index, ancestor_mode});
+                }
+            }
+        };
+        for (unsigned level = 0; lo < hi; level++) {
+            uint64_t lo_up = (lo + fanout - 1) & ~(fanout - 1);
+            uint64_t hi_down = hi & ~(fanout - 1);
+            if (level == _levels - 1 || lo_up >= hi_down) {
+                cover(level, lo, hi);
+                break;
+            }
+            cover(level, lo, lo_up);
+            cover(level, hi_down, hi);
+            lo = lo_up >> fanout_bits;
+            hi = hi_down >> fanout_bits;
+        }
+        // A node is either covered or an ancestor, never both, because
+        // covered nodes are disjoint.
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        return nodes;
+    }
+
+    void unlock_nodes(const node_request* nodes, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            mode m = nodes[i].m;
+            _nodes.unpin(nodes[i].key(), 1, [m] (node& n) { n.mutex.unlock(m); });
+        }
+    }
+
+    void generic_lock(uint64_t offset, uint64_t length, bool shared) {
+        std::vector<node_request> nodes = plan(offset, length, shared);
+        for (auto& req : nodes) {
+            node* n;
+            _nodes.pin(req.key(), 1, &n);
+            n->mutex.lock(req.m);
+        }
+    }
+
+    bool generic_try_lock(uint64_t offset, uint64_t length, bool shared) {
+        std::vector<node_request> nodes = plan(offset, length, shared);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            node* n;
+            _nodes.pin(nodes[i].key(), 1, &n);
+            if (!n->mutex.try_lock(nodes[i].m)) {
+                _nodes.unpin(nodes[i].key(), 1, [] (node&) {});
+                unlock_nodes(nodes.data(), i);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void generic_unlock(uint64_t offset, uint64_t length, bool shared) {
+        std::vector<node_request> nodes = plan(offset, length, shared);
+        unlock_nodes(nodes.data(), nodes.size());
+    }
+public:
+    // Lock range [offset, offset+length) for exclusive ownership.
+    void lock(uint64_t offset, uint64_t length) {
+        generic_lock(offset, length, false);
+    }
+
+    // Tries to lock the range [offset, offset+length) for exclusive ownership.
+    // This function returns immediately.
+    // On successful range acquisition returns true, otherwise returns false.
+    bool try_lock(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, false);
+    }
+
+    // Unlock range [offset, offset+length) from exclusive ownership.
+    void unlock(uint64_t offset, uint64_t length) {
+        generic_unlock(offset, length, false);
+    }
+
+    // Execute an operation with range [offset, offset+length) locked for exclusive ownership.
+    template <typename Func>
+    void with_lock(uint64_t offset, uint64_t length, Func&& func) {
+        lock(offset, length);
+        func();
+        unlock(offset, length);
+    }
+
+    // Lock range [offset, offset+length) for shared ownership.
+    void lock_shared(uint64_t offset, uint64_t length) {
+        generic_lock(offset, length, true);
+    }
+
+    // Tries to lock the range [offset, offset+length) for shared ownership.
+    // This function returns immediately.
+    // On successful range acquisition returns true, otherwise returns false.
+    bool try_lock_shared(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, true);
+    }
+
+    // Unlock range [offset, offset+length) from shared ownership.
+    void unlock_shared(uint64_t offset, uint64_t length) {
+        generic_unlock(offset, length, true);
+    }
+
+    // Execute an operation with range [offset, offset+length) locked for shared ownership.
+    template <typename Func>
+    void with_lock_shared(uint64_t offset, uint64_t length, Func&& func) {
+        lock_shared(offset, length);
+        func();
+        unlock_shared(offset, length);
+    }
+};
@@ -0,0 +1,143 @@
+///
+/// Purpose of this program is to test hierarchical_range_lock implementation.
+///
+
+#include "hierarchical_range_lock.hh"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <assert.h>
+
+#define print_test_name() \
+    std::cout << "\nRunning " << __FUNCTION__ << "...\n";
+
+static bool try_lock_from_another_thread(hierarchical_range_lock& range_lock, uint64_t offset, uint64_t length,
+        bool shared = false) {
+    bool acquired = false;
+    auto t = std::thread([&] {
+        if (shared) {
+            acquired = range_lock.try_lock_shared(offset, length);
+            if (acquired) {
+                range_lock.unlock_shared(offset, length);
+            }
+        } else {
+            acquired = range_lock.try_lock(offset, length);
+            if (acquired) {
+                range_lock.unlock(offset, length);
+            }
+        }
+    });
+    t.join();
+    return acquired;
+}
+
+static void fine_grained_test(hierarchical_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that small ranges only conflict at the region level\n";
+    range_lock.lock(5 * size, size);
+    assert(!try_lock_from_another_thread(range_lock, 5 * size, 1));
+    assert(!try_lock_from_another_thread(range_lock, 5 * size, 1, true));
+    assert(try_lock_from_another_thread(range_lock, 4 * size, size));
+    assert(try_lock_from_another_thread(range_lock, 6 * size, size, true));
+    range_lock.unlock(5 * size, size);
+    std::cout << "Succeeded\n";
+}
+
+static void coarse_test(hierarchical_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    const uint64_t huge = uint64_t(1) << 50;
+    std::cout << "Checking that a huge range is locked through coarse nodes\n";
+    auto start = std::chrono::steady_clock::now();
+    range_lock.lock(0, huge);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    assert(elapsed < std::chrono::seconds(1));
+    assert(!try_lock_from_another_thread(range_lock, 0, 1));
+    assert(!try_lock_from_another_thread(range_lock, huge / 3, size, true));
+    assert(!try_lock_from_another_thread(range_lock, huge - 1, 1));
+    assert(try_lock_from_another_thread(range_lock, huge, 1));
+    range_lock.unlock(0, huge);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a coarse shared range coexists with shared regions inside it\n";
+    range_lock.lock_shared(size, 1000 * size);
+    assert(try_lock_from_another_thread(range_lock, 500 * size, size, true));
+    assert(!try_lock_from_another_thread(range_lock, 500 * size, size));
+    assert(try_lock_from_another_thread(range_lock, 1001 * size, size));
+    assert(try_lock_from_another_thread(range_lock, 0, size));
+    range_lock.unlock_shared(size, 1000 * size);
+    std::cout << "Succeeded\n";
+}
+
+static void bounded_nodes_test() {
+    print_test_name();
+
+    std::cout << "Checking that a huge range locks O(fanout * levels) nodes with the smallest regions\n";
+    hierarchical_range_lock range_lock(64);
+    assert(range_lock.levels() == hierarchical_range_lock::max_levels);
+    const uint64_t bound = 2 * hierarchical_range_lock::fanout * range_lock.levels();
+    assert(range_lock.node_count(0, uint64_t(1) << 40) <= bound);
+    assert(range_lock.node_count(64, (uint64_t(1) << 40) - 128) <= bound);
+    assert(range_lock.node_count(1, ~uint64_t(0) - 1) <= bound);
+    range_lock.lock(0, uint64_t(1) << 40);
+    assert(!try_lock_from_another_thread(range_lock, (uint64_t(1) << 40) - 1, 1, true));
+    assert(try_lock_from_another_thread(range_lock, uint64_t(1) << 40, 1));
+    range_lock.unlock(0, uint64_t(1) << 40);
+    std::cout << "Succeeded\n";
+}
+
+static void mutual_exclusion_test(hierarchical_range_lock& range_lock) {
+    print_test_name();
+
+    const unsigned threads = 8;
+    const unsigned iterations = 3000;
+    const uint64_t regions = 4096;
+    auto size = range_lock.region_size();
+    std::vector<uint64_t> counters(regions, 0);
+    std::vector<std::thread> ts;
+    std::atomic<uint64_t> expected(0);
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % regions;
+                // Mostly small ranges, with some spanning whole coarse nodes.
+                uint64_t max_count = j % 16 == 0 ? regions : 20;
+                uint64_t count = 1 + (state >> 20) % std::min(regions - first, max_count);
+                range_lock.with_lock(first * size, count * size, [&] {
+                    for (uint64_t k = first; k < first + count; k++) {
+                        counters[k]++;
+                    }
+                });
+                expected += count;
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    uint64_t total = 0;
+    for (auto c : counters) {
+        total += c;
+    }
+    assert(total == expected);
+    std::cout << "Checked " << total << " increments under concurrent overlapping locks\n";
+}
+
+int main(void) {
+    auto range_lock = hierarchical_range_lock::create_range_lock(uint64_t(1) << 30);
+    std::cout << "Range lock granularity (a.k.a. region size): " << range_lock->region_size() << std::endl;
+
+    fine_grained_test(*range_lock);
+    coarse_test(*range_lock);
+    mutual_exclusion_test(*range_lock);
+    bounded_nodes_test();
+
+    return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#if __cplusplus < 201103L
+#error This file requires compiler and library support for the \
+ISO C++ 2011 standard. This support is currently experimental, and must be \
+enabled with the -std=c++11 or -std=gnu++11 compiler options.
+#endif
+
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+#include <assert.h>
+
+/// \brief Interval range lock class
+///
+/// Alternative to range_lock which doesn't divide the shared resource into
+/// regions. Instead, every lock request, either held or waiting, is tracked
+/// as an interval [offset, offset+length) in an interval tree, so the cost
+/// of acquiring a range is O(log n + overlaps), where n is the number of
+/// requests in the tree, regardless of the length of the range.
+/// Also, there are no false conflicts: two requests only conflict if their
+/// ranges actually overlap.
+///
+/// How locking does work with interval_range_lock?
+/// A new request counts the conflicting requests that overlap it and that
+/// are already in the tree, then it's inserted and waits until that count
+/// drops to zero. When a request is unlocked, it decrements the count of the
+/// conflicting requests that overlap it and that arrived after it. That means
+/// requests are granted in arrival order, so writers cannot be starved by
+/// a continuous flow of readers, and deadlock is impossible because a
+/// request can only wait for requests older than itself.
+///
+/// Shared ownership is supported from C++11 on, given that this engine
+/// doesn't rely on std::shared_timed_mutex.
+struct interval_range_lock {
+private:
+    struct range_node {
+        uint64_t start;
+        uint64_t end;
+        uint64_t max_end; // maximum end in the subtree rooted at this node
+        uint64_t seq;     // arrival order, used as a tie breaker for start
+        uint64_t priority;
+        bool shared;
+        unsigned blocking = 0; // number of older conflicting requests
+        bool waiting = false;  // the requester may still be waiting on cv
+        range_node* left = nullptr;
+        range_node* right = nullptr;
+        std::condition_variable cv;
+
+        range_node(uint64_t start, uint64_t end, uint64_t seq, uint64_t priority, bool shared)
+            : start(start), end(end), max_end(end), seq(seq), priority(priority), shared(shared) {}
+
+        bool less_than(const range_node& other) const {
+            return start < other.start || (start == other.start && seq < other.seq);
+        }
+
+        bool conflicts_with(const range_node& other) const {
+            return !(shared && other.shared);
+        }
+    };
+    // Root of a treap ordered by (start, seq), and heap ordered by priority.
+    range_node* _root = nullptr;
+    uint64_t _next_seq = 0;
+    uint64_t _random_state = UINT64_C(0x9E3779B97F4A7C15);
+    std::mutex _lock;
+public:
+    interval_range_lock() = default;
+    interval_range_lock& operator=(const interval_range_lock&) = delete;
+    interval_range_lock(const interval_range_lock&) = delete;
+
+    ~interval_range_lock() {
+        destroy(_root);
+    }
+private:
+    static void destroy(range_node* n) {
+        if (n) {
+            destroy(n->left);
+            destroy(n->right);
+            delete n;
+        }
+    }
+
+    // xorshift64*, good enough to keep the treap balanced.
+    uint64_t next_priority() {
+        _random_state ^= _random_state >> 12;
+        _random_state ^= _random_state << 25;
+        _random_state ^= _random_state >> 27;
+        return _random_state * UINT64_C(2685821657736338717);
+    }
+
+    static void update(range_node* n) {
+        n->max_end = n->end;
+        if (n->left) {
+            n->max_end = std::max(n->max_end, n->left->max_end);
+        }
+        if (n->right) {
+            n->max_end = std::max(n->max_end, n->right->max_end);
+        }
+    }
+
+    static range_node* rotate_right(range_node* n) {
+        range_node* l = n->left;
+        n->left = l->right;
+        l->right = n;
+        update(n);
+        update(l);
+        return l;
+    }
+
+    static range_node* rotate_left(range_node* n) {
+        range_node* r = n->right;
+        n->right = r->left;
+        r->left = n;
+        update(n);
+        update(r);
+        return r;
+    }
+
+    static range_node* insert(range_node* root, range_node* n) {
+        if (!root) {
+            return n;
+        }
+        if (n->less_than(*root)) {
+            root->left = insert(root->left, n);
+            if (root->left->priority > root->priority) {
+                return rotate_right(root);
+            }
+        } else {
+            root->right = insert(root->right, n);
+            if (root->right->priority > root->priority) {
+                return rotate_left(root);
+            }
+        }
+        update(root);
+        return root;
+    }
+
+    static range_node* erase(range_node* root, range_node* n) {
+        assert(root); // assert node is in the tree
+        if (root == n) {
+            if (!root->left || !root->right) {
+                return root->left ? root->left : root->right;
+            }
+            if (root->left->priority > root->right->priority) {
+                root = rotate_right(root);
+                root->right = erase(root->right, n);
+            } else {
+                root = rotate_left(root);
+                root->left = erase(root->left, n);
+            }
+        } else if (n->less_than(*root)) {
+            root->left = erase(root->left, n);
+        } else {
+            root->right = erase(root->right, n);
+        }
+        update(root);
+        return root;
+    }
+
+    // Call f for each node whose range overlaps [start, end).
+    template <typename Func>
+    static void for_each_overlap(range_node* n, uint64_t start, uint64_t end, Func&& f) {
+        if (!n || n->max_end <= start) {
+            return;
+        }
+        for_each_overlap(n->left, start, end, f);
+        if (n->start < end) {
+            if (n->end > start) {
+                f(*n);
+            }
+            for_each_overlap(n->right, start, end, f);
+        }
+    }
+
+    static inline void validate_parameters(uint64_t offset, uint64_t length) {
+        assert(length > 0);
+        assert(offset < (offset + length)); // check for overflow
+    }
+
+    unsigned count_conflicts(const range_node& n) {
+        unsigned conflicts = 0;
+        for_each_overlap(_root, n.start, n.end, [&n, &conflicts] (range_node& other) {
+            if (n.conflicts_with(other)) {
+                conflicts++;
+            }
+        });
+        return conflicts;
+    }
+
+    void generic_lock(uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        std::unique_lock<std::mutex> lock(_lock);
+        range_node* n = new range_node(offset, offset + length, _next_seq++, next_priority(), shared);
+        n->blocking = count_conflicts(*n);
+        _root = insert(_root, n);
+        n->waiting = true;
+        while (n->blocking > 0) {
+            n->cv.wait(lock);
+        }
+        n->waiting = false;
+    }
+
+    // Requests waiting for a conflicting range are taken into account, so
+    // try_lock() doesn't jump the queue.
+    bool generic_try_lock(uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        std::lock_guard<std::mutex> lock(_lock);
+        range_node n(offset, offset + length, 0, 0, shared);
+        if (count_conflicts(n) > 0) {
+            return false;
+        }
+        _root = insert(_root, new range_node(offset, offset + length, _next_seq++, next_priority(), shared));
+        return true;
+    }
+
+    void generic_unlock(uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        std::lock_guard<std::mutex> lock(_lock);
+        // Identical shared ranges may be held by several requests, and any of
+        // them can be released, except for one whose requester is yet to wake
+        // up, as it still uses the node.
+        range_node* held = nullptr;
+        for_each_overlap(_root, offset, offset + 1, [&] (range_node& n) {
+            if (!held && n.start == offset && n.end == offset + length && n.shared == shared && n.blocking == 0
+                    && !n.waiting) {
+                held = &n;
+            }
+        });
+        assert(held); // assert range is locked
+        _root = erase(_root, held);
+        for_each_overlap(_root, held->start, held->end, [held] (range_node& n) {
+            if (n.seq > held->seq && n.conflicts_with(*held)) {
+                assert(n.blocking > 0);
+                if (--n.blocking == 0) {
+                    n.cv.notify_one();
+                }
+            }
+        });
+        delete held;
+    }
+public:
+    // Lock range [offset, offset+length) for exclusive ownership.
+    void lock(uint64_t offset, uint64_t length) {
+        generic_lock(offset, length, false);
+    }
+
+    // Tries to lock the range [offset, offset+length) for exclusive ownership.
+    // This function returns immediately.
+    // On successful range acquisition returns true, otherwise returns false.
+    bool try_lock(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, false);
+    }
+
+    // Unlock range [offset, offset+length) from exclusive ownership.
+    void unlock(uint64_t offset, uint64_t length) {
+        generic_unlock(offset, length, false);
+    }
+
+    // Execute an operation with range [offset, offset+length) locked for exclusive ownership.
+    template <typename Func>
+    void with_lock(uint64_t offset, uint64_t length, Func&& func) {
+        lock(offset, length);
+        func();
+        unlock(offset, length);
+    }
+
+    // Lock range [offset, offset+length) for shared ownership.
+    void lock_shared(uint64_t offset, uint64_t length) {
+        generic_lock(offset, length, true);
+    }
+
+    // Tries to lock the range [offset, offset+length) for shared ownership.
+    // This function returns immediately.
+    // On successful range acquisition returns true, otherwise returns false.
+    bool try_lock_shared(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, true);
+    }
+
+    // Unlock range [offset, offset+length) from shared ownership.
+    void unlock_shared(uint64_t offset, uint64_t length) {
+        generic_unlock(offset, length, true);
+    }
+
+    // Execute an operation with range [offset, offset+length) locked for shared ownership.
+    template <typename Func>
+    void with_lock_shared(uint64_t offset, uint64_t length, Func&& func) {
+        lock_shared(offset, length);
+        func();
+        unlock_shared(offset, length);
+    }
+};
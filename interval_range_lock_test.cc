@@ -0,0 +1,176 @@
+///
+/// Purpose of this program is to test interval_range_lock implementation.
+///
+
+#include "interval_range_lock.hh"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <assert.h>
+
+#define print_test_name() \
+    std::cout << "\nRunning " << __FUNCTION__ << "...\n";
+
+static bool try_lock_from_another_thread(interval_range_lock& range_lock, uint64_t offset, uint64_t length,
+        bool shared = false) {
+    bool acquired = false;
+    auto t = std::thread([&] {
+        if (shared) {
+            acquired = range_lock.try_lock_shared(offset, length);
+            if (acquired) {
+                range_lock.unlock_shared(offset, length);
+            }
+        } else {
+            acquired = range_lock.try_lock(offset, length);
+            if (acquired) {
+                range_lock.unlock(offset, length);
+            }
+        }
+    });
+    t.join();
+    return acquired;
+}
+
+static void exact_conflicts_test(interval_range_lock& range_lock) {
+    print_test_name();
+
+    std::cout << "Checking that only overlapping ranges conflict\n";
+    range_lock.lock(100, 10);
+    assert(!try_lock_from_another_thread(range_lock, 109, 1));
+    assert(!try_lock_from_another_thread(range_lock, 0, 101));
+    assert(!try_lock_from_another_thread(range_lock, 105, 1, true));
+    assert(try_lock_from_another_thread(range_lock, 110, 1));
+    assert(try_lock_from_another_thread(range_lock, 0, 100));
+    range_lock.unlock(100, 10);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a huge range is locked as a single interval\n";
+    range_lock.lock(0, uint64_t(1) << 62);
+    assert(!try_lock_from_another_thread(range_lock, (uint64_t(1) << 62) - 1, 1));
+    assert(try_lock_from_another_thread(range_lock, uint64_t(1) << 62, 1));
+    range_lock.unlock(0, uint64_t(1) << 62);
+    std::cout << "Succeeded\n";
+}
+
+static void shared_test(interval_range_lock& range_lock) {
+    print_test_name();
+
+    std::cout << "Checking that shared owners coexist and exclude exclusive owners\n";
+    range_lock.lock_shared(0, 4096);
+    range_lock.lock_shared(1024, 4096);
+    assert(try_lock_from_another_thread(range_lock, 2048, 1, true));
+    assert(!try_lock_from_another_thread(range_lock, 4096, 1));
+    range_lock.unlock_shared(0, 4096);
+    assert(!try_lock_from_another_thread(range_lock, 4096, 1));
+    range_lock.unlock_shared(1024, 4096);
+    assert(try_lock_from_another_thread(range_lock, 0, 8192));
+    std::cout << "Succeeded\n";
+}
+
+static void fifo_test(interval_range_lock& range_lock) {
+    print_test_name();
+
+    std::cout << "Checking that a waiting writer isn't overtaken by new readers\n";
+    range_lock.lock_shared(0, 1024);
+    std::atomic<bool> writer_done(false);
+    auto t = std::thread([&] {
+        range_lock.with_lock(512, 1024, [&] {
+            writer_done = true;
+        });
+    });
+    while (try_lock_from_another_thread(range_lock, 512, 1, true)) {
+        std::this_thread::yield();
+    }
+    assert(!writer_done);
+    assert(try_lock_from_another_thread(range_lock, 0, 512, true));
+    range_lock.unlock_shared(0, 1024);
+    t.join();
+    assert(writer_done);
+    std::cout << "Succeeded\n";
+}
+
+static void mutual_exclusion_test(interval_range_lock& range_lock) {
+    print_test_name();
+
+    const unsigned threads = 8;
+    const unsigned iterations = 20000;
+    std::vector<uint64_t> counters(64, 0);
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t offset = (state >> 33) % counters.size();
+                uint64_t length = 1 + (state >> 50) % (counters.size() - offset);
+                range_lock.with_lock(offset, length, [&] {
+                    for (uint64_t k = offset; k < offset + length; k++) {
+                        counters[k]++;
+                    }
+                });
+            }
+        }));
+    }
+    uint64_t expected = 0;
+    for (auto& t : ts) {
+        t.join();
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        uint64_t state = i + 1;
+        for (unsigned j = 0; j < iterations; j++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            uint64_t offset = (state >> 33) % counters.size();
+            expected += 1 + (state >> 50) % (counters.size() - offset);
+        }
+    }
+    uint64_t total = 0;
+    for (auto c : counters) {
+        total += c;
+    }
+    assert(total == expected);
+    std::cout << "Checked " << total << " increments under concurrent overlapping locks\n";
+}
+
+// Identical shared ranges are interchangeable on release, but not the node
+// of a request whose thread hasn't woken up yet.
+static void identical_ranges_test(interval_range_lock& range_lock) {
+    print_test_name();
+
+    const unsigned threads = 4;
+    const unsigned iterations = 200000;
+    std::vector<std::thread> ts;
+    std::cout << "Checking that identical ranges can be locked and released concurrently\n";
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t offset = (state >> 33) % 4 * 4096;
+                if ((state >> 40) % 10 == 0) {
+                    range_lock.with_lock(offset, 4096, [] {});
+                } else {
+                    range_lock.with_lock_shared(offset, 4096, [] {});
+                }
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    assert(range_lock.try_lock(0, 4 * 4096));
+    range_lock.unlock(0, 4 * 4096);
+    std::cout << "Succeeded\n";
+}
+
+int main(void) {
+    interval_range_lock range_lock;
+
+    exact_conflicts_test(range_lock);
+    shared_test(range_lock);
+    fifo_test(range_lock);
+    mutual_exclusion_test(range_lock);
+    identical_ranges_test(range_lock);
+
+    return 0;
+}
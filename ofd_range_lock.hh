@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#if !defined(__linux__)
+#error "ofd_range_lock.hh requires Linux open file description locks"
+#endif
+
+#include "range_lock.hh"
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <system_error>
+#include <cerrno>
+#include <fcntl.h>
+
+/// \brief Range lock backed by open file description locks
+///
+/// Range lock for a file shared with other processes or tools using advisory
+/// locks: threads of this process are serialized by a range_lock, and the
+/// process as a whole holds open file description locks (F_OFD_SETLKW) on
+/// the file, so other processes see the ranges as locked.
+///
+/// The kernel is only asked to lock the union of the ranges held by the
+/// process, rounded to whole regions. Every region counts its holders in the
+/// process: the first one locks the region in the kernel and the last one
+/// unlocks it, and consecutive regions changing state together are covered
+/// by a single fcntl(). So threads reading overlapping ranges cost a single
+/// kernel lock, instead of one each. A region held for exclusive ownership
+/// has a single holder, so exclusive ranges are locked in the kernel with
+/// one fcntl() each, without any bookkeeping.
+///
+/// All threads must use the same open file description, the fd given to the
+/// constructor, since OFD locks belong to it and never conflict with each
+/// other. Failures of the kernel, like EDEADLK, are thrown as
+/// std::system_error, and a try_lock*() meeting a conflicting lock of another
+/// process, or a region another thread is locking in the kernel, returns
+/// false. Either way, nothing is left locked.
+class ofd_range_lock {
+    enum class kernel_state { unlocked, locking, locked };
+
+    struct coverage {
+        uint32_t holders = 0;
+        kernel_state state = kernel_state::unlocked;
+    };
+
+    struct kernel_span {
+        uint64_t first_id;
+        uint64_t count;
+    };
+
+    range_lock _lock;
+    int _fd;
+    uint64_t _region_size;
+    // Regions held for shared ownership by this process.
+    std::mutex _coverage_lock;
+    std::condition_variable _coverage_changed;
+    std::unordered_map<uint64_t, coverage> _coverage;
+    std::atomic<uint64_t> _kernel_requests;
+public:
+    ofd_range_lock(const ofd_range_lock&) = delete;
+    ofd_range_lock& operator=(const ofd_range_lock&) = delete;
+
+    // Lock ranges of the file open as fd, which must stay open for the
+    // lifetime of the range lock. Same region size requirements as range_lock.
+    ofd_range_lock(int fd, uint64_t region_size)
+        : _lock(region_size)
+        , _fd(fd)
+        , _region_size(region_size)
+        , _kernel_requests(0) {
+        assert(fd >= 0);
+    }
+
+    // Create a range lock for the file open as fd, with the region size
+    // range_lock would choose for a file of resource_size bytes.
+    static std::unique_ptr<ofd_range_lock> create_range_lock(int fd, uint64_t resource_size) {
+        uint64_t region_size = range_lock::region_size_for(resource_size);
+        return std::unique_ptr<ofd_range_lock>(new ofd_range_lock(fd, region_size));
+    }
+
+    uint64_t region_size() const { return _region_size; }
+
+    // Number of fcntl() calls issued so far, locks and unlocks.
+    uint64_t kernel_requests() const {
+        return _kernel_requests.load(std::memory_order_relaxed);
+    }
+private:
+    static inline void validate_parameters(uint64_t offset, uint64_t length) {
+        assert(length > 0);
+        assert(offset + length > offset); // assert range doesn't wrap around
+    }
+
+    uint64_t first_region(uint64_t offset) const { return offset / _region_size; }
+    uint64_t last_region(uint64_t offset, uint64_t length) const { return (offset + length - 1) / _region_size; }
+
+    [[noreturn]] static void throw_kernel_error(int error) {
+        throw std::system_error(error, std::generic_category(), "fcntl(F_OFD_SETLK)");
+    }
+
+    // Returns the errno of the kernel if it fails to change the lock of the
+    // regions, zero otherwise.
+    int kernel_lock(short type, kernel_span span, bool wait) {
+        struct flock fl = {};
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = off_t(span.first_id * _region_size);
+        fl.l_len = off_t(span.count * _region_size);
+        _kernel_requests.fetch_add(1, std::memory_order_relaxed);
+        while (::fcntl(_fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl) < 0) {
+            if (errno != EINTR) {
+                return errno;
+            }
+        }
+        return 0;
+    }
+
+    // Unlocking never blocks, and only fails if the kernel runs out of memory
+    // splitting a lock, in which case the regions stay locked.
+    void kernel_unlock(kernel_span span) {
+        kernel_lock(F_UNLCK, span, false);
+    }
+
+    static bool would_block(int error) {
+        return error == EAGAIN || error == EACCES;
+    }
+
+    // Add a region to the spans, extending the last one if it's adjacent.
+    static void add_region(std::vector<kernel_span>& spans, uint64_t region_id) {
+        if (!spans.empty() && spans.back().first_id + spans.back().count == region_id) {
+            spans.back().count++;
+        } else {
+            spans.push_back(kernel_span{region_id, 1});
+        }
+    }
+
+    // Drop the holders of the regions, unlocking in the kernel those which
+    // aren't held anymore. Called with the coverage lock held, so no thread
+    // locks a region again in the kernel before it's unlocked.
+    void release_coverage(uint64_t first_id, uint64_t last_id) {
+        std::vector<kernel_span> unlocked;
+        for (uint64_t id = first_id; id <= last_id; id++) {
+            auto it = _coverage.find(id);
+            assert(it != _coverage.end() && it->second.holders > 0); // assert region is held
+            if (--it->second.holders) {
+                continue;
+            }
+            if (it->second.state == kernel_state::locked) {
+                add_region(unlocked, id);
+            }
+            _coverage.erase(it);
+        }
+        for (auto& span : unlocked) {
+            kernel_unlock(span);
+        }
+    }
+
+    // Lock in the kernel, for shared ownership, the regions held in the
+    // process which aren't locked yet, waiting for other threads locking some
+    // of them. Returns the errno of the kernel, after dropping the holders,
+    // if it fails.
+    int acquire_coverage(uint64_t first_id, uint64_t last_id, bool wait) {
+        std::unique_lock<std::mutex> lock(_coverage_lock);
+        for (uint64_t id = first_id; id <= last_id; id++) {
+            _coverage[id].holders++;
+        }
+        std::vector<kernel_span> spans;
+        for (;;) {
+            bool locking = false;
+            spans.clear();
+            for (uint64_t id = first_id; id <= last_id; id++) {
+                auto& c = _coverage[id];
+                if (c.state == kernel_state::unlocked) {
+                    c.state = kernel_state::locking;
+                    add_region(spans, id);
+                } else if (c.state == kernel_state::locking) {
+                    locking = true;
+                }
+            }
+            if (spans.empty()) {
+                if (!locking) {
+                    return 0;
+                }
+                if (!wait) {
+                    release_coverage(first_id, last_id);
+                    return EAGAIN;
+                }
+                _coverage_changed.wait(lock);
+                continue;
+            }
+            int error = 0;
+            size_t done = 0;
+            lock.unlock();
+            while (done < spans.size() && !(error = kernel_lock(F_RDLCK, spans[done], wait))) {
+                done++;
+            }
+            lock.lock();
+            for (size_t i = 0; i < spans.size(); i++) {
+                for (uint64_t id = spans[i].first_id; id < spans[i].first_id + spans[i].count; id++) {
+                    _coverage[id].state = i < done ? kernel_state::locked : kernel_state::unlocked;
+                }
+            }
+            _coverage_changed.notify_all();
+            if (error) {
+                release_coverage(first_id, last_id);
+                return error;
+            }
+        }
+    }
+
+    void generic_lock(uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        uint64_t first_id = first_region(offset);
+        uint64_t last_id = last_region(offset, length);
+        int error;
+        if (shared) {
+            _lock.lock_shared(offset, length);
+            error = acquire_coverage(first_id, last_id, true);
+        } else {
+            _lock.lock(offset, length);
+            error = kernel_lock(F_WRLCK, kernel_span{first_id, last_id - first_id + 1}, true);
+        }
+        if (error) {
+            shared ? _lock.unlock_shared(offset, length) : _lock.unlock(offset, length);
+            throw_kernel_error(error);
+        }
+    }
+
+    bool generic_try_lock(uint64_t offset, uint64_t length, bool shared) {
+        validate_parameters(offset, length);
+        uint64_t first_id = first_region(offset);
+        uint64_t last_id = last_region(offset, length);
+        int error;
+        if (shared) {
+            if (!_lock.try_lock_shared(offset, length)) {
+                return false;
+            }
+            error = acquire_coverage(first_id, last_id, false);
+        } else {
+            if (!_lock.try_lock(offset, length)) {
+                return false;
+            }
+            error = kernel_lock(F_WRLCK, kernel_span{first_id, last_id - first_id + 1}, false);
+        }
+        if (error) {
+            shared ? _lock.unlock_shared(offset, length) : _lock.unlock(offset, length);
+            if (!would_block(error)) {
+                throw_kernel_error(error);
+            }
+            return false;
+        }
+        return true;
+    }
+public:
+    void lock(uint64_t offset, uint64_t length) {
+        generic_lock(offset, length, false);
+    }
+
+    bool try_lock(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, false);
+    }
+
+    // The kernel lock is dropped before the range is released in the
+    // process, so no other thread can lock it in the meantime.
+    void unlock(uint64_t offset, uint64_t length) {
+        validate_parameters(offset, length);
+        uint64_t first_id = first_region(offset);
+        kernel_unlock(kernel_span{first_id, last_region(offset, length) - first_id + 1});
+        _lock.unlock(offset, length);
+    }
+
+    void lock_shared(uint64_t offset, uint64_t length) {
+        generic_lock(offset, length, true);
+    }
+
+    bool try_lock_shared(uint64_t offset, uint64_t length) {
+        return generic_try_lock(offset, length, true);
+    }
+
+    void unlock_shared(uint64_t offset, uint64_t length) {
+        validate_parameters(offset, length);
+        {
+            std::lock_guard<std::mutex> lock(_coverage_lock);
+            release_coverage(first_region(offset), last_region(offset, length));
+        }
+        _lock.unlock_shared(offset, length);
+    }
+};
@@ -0,0 +1,215 @@
+///
+/// Purpose of this program is to test ofd_range_lock implementation.
+///
+
+#include "ofd_range_lock.hh"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#define print_test_name() \
+    std::cout << "\nRunning " << __FUNCTION__ << "...\n";
+
+static const uint64_t resource_size = uint64_t(1) << 30;
+
+// Same as F_OFD_GETLK, from a new open file description of the file, which
+// is what another process would see. Returns the type of the conflicting
+// lock, or F_UNLCK.
+static short kernel_conflict(const char* path, uint64_t offset, uint64_t length, short type) {
+    int fd = open(path, O_RDWR);
+    assert(fd >= 0);
+    struct flock fl = {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = off_t(offset);
+    fl.l_len = off_t(length);
+    int ret = fcntl(fd, F_OFD_GETLK, &fl);
+    assert(ret == 0);
+    (void)ret;
+    close(fd);
+    return fl.l_type;
+}
+
+static void coalescing_test(ofd_range_lock& range_lock, const char* path) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that readers of overlapping ranges share a single kernel lock\n";
+    auto requests = range_lock.kernel_requests();
+    range_lock.lock_shared(0, 4 * size);
+    assert(range_lock.kernel_requests() == requests + 1);
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i < 8; i++) {
+        ts.push_back(std::thread([&, i] {
+            range_lock.lock_shared(i % 4 * size, size / 2);
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    assert(range_lock.kernel_requests() == requests + 1);
+    assert(kernel_conflict(path, 0, 4 * size, F_WRLCK) == F_RDLCK);
+    assert(kernel_conflict(path, 0, 4 * size, F_RDLCK) == F_UNLCK);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that only regions nobody else holds are locked in the kernel\n";
+    // Regions 4 and 6 are new, 5 is held, so two kernel locks are needed.
+    range_lock.lock_shared(5 * size, size);
+    requests = range_lock.kernel_requests();
+    range_lock.lock_shared(3 * size, 4 * size);
+    assert(range_lock.kernel_requests() == requests + 2);
+    range_lock.unlock_shared(3 * size, 4 * size);
+    range_lock.unlock_shared(5 * size, size);
+    assert(kernel_conflict(path, 4 * size, 3 * size, F_WRLCK) == F_UNLCK);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the kernel lock is dropped by the last reader\n";
+    for (unsigned i = 0; i < 8; i++) {
+        range_lock.unlock_shared(i % 4 * size, size / 2);
+        assert(kernel_conflict(path, 0, 4 * size, F_WRLCK) == F_RDLCK);
+    }
+    range_lock.unlock_shared(0, 4 * size);
+    assert(kernel_conflict(path, 0, 4 * size, F_WRLCK) == F_UNLCK);
+    std::cout << "Succeeded\n";
+}
+
+static void exclusive_test(ofd_range_lock& range_lock, const char* path) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that an exclusive range is locked in the kernel, rounded to regions\n";
+    range_lock.lock(size + 10, 10);
+    assert(kernel_conflict(path, size, 1, F_RDLCK) == F_WRLCK);
+    assert(kernel_conflict(path, 2 * size - 1, 1, F_RDLCK) == F_WRLCK);
+    assert(kernel_conflict(path, 0, size, F_WRLCK) == F_UNLCK);
+    assert(!range_lock.try_lock_shared(size, size));
+    range_lock.unlock(size + 10, 10);
+    assert(kernel_conflict(path, size, size, F_WRLCK) == F_UNLCK);
+    std::cout << "Succeeded\n";
+}
+
+static void interop_test(ofd_range_lock& range_lock, const char* path) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that ranges locked by another process are busy\n";
+    // The child reports it holds the range on ready, and exits on done.
+    int ready[2];
+    int done[2];
+    int ret = pipe(ready) | pipe(done);
+    assert(ret == 0);
+    (void)ret;
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        int fd = open(path, O_RDWR);
+        ofd_range_lock other(fd, size);
+        other.lock(2 * size, size);
+        char c = 0;
+        if (write(ready[1], &c, 1) != 1 || read(done[0], &c, 1) != 1) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    char c;
+    ret = int(read(ready[0], &c, 1));
+    assert(ret == 1);
+    assert(!range_lock.try_lock(0, 3 * size));
+    assert(!range_lock.try_lock_shared(2 * size, size));
+    std::cout << "Checking that a failed attempt leaves nothing locked\n";
+    assert(range_lock.try_lock(0, 2 * size));
+    range_lock.unlock(0, 2 * size);
+    assert(range_lock.try_lock_shared(0, 2 * size));
+    range_lock.unlock_shared(0, 2 * size);
+    assert(kernel_conflict(path, 0, 2 * size, F_WRLCK) == F_UNLCK);
+    ret = int(write(done[1], &c, 1));
+    assert(ret == 1);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    for (int p : { ready[0], ready[1], done[0], done[1] }) {
+        close(p);
+    }
+    std::cout << "Checking that the range is free once the other process exits\n";
+    range_lock.lock(2 * size, size);
+    range_lock.unlock(2 * size, size);
+    std::cout << "Succeeded\n";
+}
+
+static void mutual_exclusion_test(ofd_range_lock& range_lock) {
+    print_test_name();
+
+    const unsigned threads = 8;
+    const unsigned iterations = 2000;
+    const uint64_t regions = 64;
+    auto size = range_lock.region_size();
+    std::vector<uint64_t> counters(regions, 0);
+    std::vector<std::thread> ts;
+    std::atomic<uint64_t> expected(0);
+    std::atomic<uint64_t> torn_reads(0);
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % regions;
+                uint64_t count = 1 + (state >> 20) % std::min(regions - first, uint64_t(8));
+                auto sum = [&] {
+                    uint64_t total = 0;
+                    for (uint64_t k = first; k < first + count; k++) {
+                        total += counters[k];
+                    }
+                    return total;
+                };
+                if (j % 2 == 0) {
+                    range_lock.lock_shared(first * size, count * size);
+                    uint64_t before = sum();
+                    std::this_thread::yield();
+                    if (sum() != before) {
+                        torn_reads++;
+                    }
+                    range_lock.unlock_shared(first * size, count * size);
+                } else {
+                    range_lock.lock(first * size, count * size);
+                    for (uint64_t k = first; k < first + count; k++) {
+                        counters[k]++;
+                    }
+                    range_lock.unlock(first * size, count * size);
+                    expected += count;
+                }
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    uint64_t total = 0;
+    for (auto c : counters) {
+        total += c;
+    }
+    assert(total == expected);
+    assert(torn_reads == 0);
+    std::cout << "Checked " << total << " increments with " << range_lock.kernel_requests() << " kernel requests\n";
+}
+
+int main(void) {
+    char path[] = "/tmp/ofd_range_lock_test.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    auto range_lock = ofd_range_lock::create_range_lock(fd, resource_size);
+    std::cout << "Range lock granularity (a.k.a. region size): " << range_lock->region_size() << std::endl;
+
+    coalescing_test(*range_lock, path);
+    exclusive_test(*range_lock, path);
+    interop_test(*range_lock, path);
+    mutual_exclusion_test(*range_lock);
+
+    range_lock.reset();
+    close(fd);
+    unlink(path);
+    return 0;
+}
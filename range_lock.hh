@@ -15,287 +15,4434 @@ enabled with the -std=c++11 or -std=gnu++11 compiler options.
 
 #include <unordered_map>
 #include <memory>
+#include <new>
 #include <algorithm>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <ctime>
+#include <climits>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <utility>
 #include <assert.h>
 #if (__cplusplus >= 201402L)
 #include <shared_mutex>
+#endif
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace range_lock_detail {
+
+inline unsigned log2_of(uint64_t v) {
+    unsigned bits = 0;
+    while ((uint64_t(1) << bits) < v) {
+        bits++;
+    }
+    return bits;
+}
+
+// Fibonacci hashing: the top bits of the product are well distributed even
+// for consecutive keys.
+inline uint64_t hash_of(uint64_t key, unsigned bits) {
+    return bits ? (key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - bits) : 0;
+}
+
+// Index of the calling thread into an array of per-thread stripes.
+inline unsigned thread_stripe(unsigned stripes) {
+    static thread_local unsigned stripe =
+        unsigned(std::hash<std::thread::id>()(std::this_thread::get_id()) * UINT64_C(0x9E3779B97F4A7C15) >> 32);
+    return stripe & (stripes - 1);
+}
+
+/// Quiescence gate
+///
+/// Lets many threads run short operations concurrently, while a single thread
+/// can wait for all of them to quiesce, and keep new ones out, to do some
+/// work that requires exclusive access. Entering and exiting the gate is an
+/// atomic increment and decrement on a per-thread stripe, so threads don't
+/// bounce a shared cache line unless the gate is being closed.
+class quiescence_gate {
+    static constexpr unsigned stripes = 64;
+    struct stripe {
+        std::atomic<uint64_t> count;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    stripe _stripes[stripes];
+    std::atomic<bool> _closed;
+public:
+    quiescence_gate() : _closed(false) {
+        for (auto& s : _stripes) {
+            s.count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void enter() {
+        stripe& s = _stripes[thread_stripe(stripes)];
+        for (;;) {
+            s.count.fetch_add(1, std::memory_order_seq_cst);
+            if (!_closed.load(std::memory_order_seq_cst)) {
+                return;
+            }
+            s.count.fetch_sub(1, std::memory_order_seq_cst);
+            while (_closed.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void exit() {
+        _stripes[thread_stripe(stripes)].count.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    // NOTE: Only one thread may close the gate at a time, and it must not be
+    // inside the gate itself.
+    void close() {
+        _closed.store(true, std::memory_order_seq_cst);
+        for (auto& s : _stripes) {
+            while (s.count.load(std::memory_order_seq_cst) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void open() {
+        _closed.store(false, std::memory_order_release);
+    }
+};
+
+/// Node pool
+///
+/// Free list of fixed size blocks, used to recycle the nodes of a region map
+/// instead of returning them to the heap. Not thread safe, access must be
+/// serialized by the owner of the map. Blocks are only freed by trim() and on
+/// destruction, so the memory held by a pool is otherwise the high-water mark
+/// of its map.
+class node_pool {
+    struct free_block {
+        free_block* next;
+    };
+    free_block* _free = nullptr;
+    size_t _block_size = 0;
+    // Blocks taken from the heap and not freed yet, in use or not.
+    size_t _blocks = 0;
+public:
+    node_pool() = default;
+    node_pool(const node_pool&) = delete;
+    node_pool& operator=(const node_pool&) = delete;
+
+    ~node_pool() {
+        trim();
+    }
+
+    // Memory held by the pool, including the blocks in use.
+    size_t bytes() const {
+        return _blocks * _block_size;
+    }
+
+    // Return the free blocks to the heap.
+    void trim() {
+        while (_free) {
+            free_block* b = _free;
+            _free = b->next;
+            ::operator delete(b);
+            _blocks--;
+        }
+    }
+
+    void* allocate(size_t size) {
+        assert(size >= sizeof(free_block));
+        assert(!_block_size || _block_size == size);
+        _block_size = size;
+        if (_free) {
+            free_block* b = _free;
+            _free = b->next;
+            return b;
+        }
+        void* p = ::operator new(size);
+        _blocks++;
+        return p;
+    }
+
+    void deallocate(void* p, size_t size) {
+        assert(_block_size == size);
+        free_block* b = static_cast<free_block*>(p);
+        b->next = _free;
+        _free = b;
+    }
+};
+
+// Allocator which takes single objects, the nodes of a map, from a node_pool.
+// Arrays, like bucket arrays, go to the heap.
+template <typename T>
+class pool_allocator {
+    node_pool* _pool;
+
+    template <typename U>
+    friend class pool_allocator;
+public:
+    typedef T value_type;
+
+    explicit pool_allocator(node_pool* pool) : _pool(pool) {}
+
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& other) : _pool(other._pool) {}
+
+    T* allocate(size_t n) {
+        if (n == 1) {
+            return static_cast<T*>(_pool->allocate(sizeof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n == 1) {
+            _pool->deallocate(p, sizeof(T));
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>& other) const {
+        return _pool == other._pool;
+    }
+
+    template <typename U>
+    bool operator!=(const pool_allocator<U>& other) const {
+        return _pool != other._pool;
+    }
+};
+
+// Hint to the CPU that the thread is busy waiting.
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/// Adaptive spinning
+///
+/// Before parking, a contended acquisition spins for a while, which is much
+/// cheaper than a sleep and wake round trip when the holder is about to
+/// release. As with glibc's adaptive mutexes, a thread keeps an estimate of
+/// how long it recently had to spin before the lock was released, and spins
+/// up to twice that, bounded by max_spins(). Spinning that fails makes the
+/// estimate decay, so under long holds threads go back to parking almost
+/// right away.
+/// Spinning is disabled by default on single CPU machines, where the holder
+/// can't make progress while another thread spins.
+class adaptive_spin {
+    static constexpr unsigned min_spins = 16;
+
+    static std::atomic<unsigned>& max_spins_value() {
+        static std::atomic<unsigned> value(std::thread::hardware_concurrency() > 1 ? 1000 : 0);
+        return value;
+    }
+public:
+    // Upper bound of spin iterations for an acquisition. Zero disables spinning.
+    static unsigned max_spins() {
+        return max_spins_value().load(std::memory_order_relaxed);
+    }
+
+    static void set_max_spins(unsigned spins) {
+        max_spins_value().store(spins, std::memory_order_relaxed);
+    }
+
+    // Spin until ready() returns true, or the spin budget runs out.
+    // Returns whether ready() returned true.
+    template <typename Ready>
+    static bool spin_until(Ready&& ready) {
+        unsigned max = max_spins();
+        if (!max) {
+            return false;
+        }
+        static thread_local unsigned estimate = 0;
+        unsigned limit = std::min(max, estimate * 2 + min_spins);
+        for (unsigned i = 0; i < limit; i++) {
+            cpu_relax();
+            if (ready()) {
+                estimate = unsigned(int(estimate) + (int(i) - int(estimate)) / 8);
+                return true;
+            }
+        }
+        estimate -= estimate / 8;
+        return false;
+    }
+};
+
+/// Parking
+///
+/// Block a thread while a 32-bit word holds an expected value, and wake up
+/// the threads blocked on a word. Linux futexes are used when available,
+/// then C++20 atomic waiting, and otherwise a table of condition variables
+/// hashed by the address of the word.
+/// park_for() gives up after a timeout; spurious wake ups are allowed.
+#if defined(__linux__)
+inline void park(std::atomic<uint32_t>& word, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void park_for(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout) {
+    struct timespec ts;
+    ts.tv_sec = time_t(timeout.count() / 1000000000);
+    ts.tv_nsec = long(timeout.count() % 1000000000);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+}
+
+inline void unpark_all(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+#elif defined(__cpp_lib_atomic_wait)
+inline void park(std::atomic<uint32_t>& word, uint32_t expected) {
+    word.wait(expected, std::memory_order_relaxed);
+}
+
+// There's no timed atomic wait, so poll the word until the timeout expires.
+inline void park_for(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (word.load(std::memory_order_relaxed) == expected && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::min(timeout, std::chrono::nanoseconds(50000)));
+    }
+}
+
+inline void unpark_all(std::atomic<uint32_t>& word) {
+    word.notify_all();
+}
 #else
-#include <mutex>
+struct parking_bucket {
+    std::mutex lock;
+    std::condition_variable cv;
+};
+
+inline parking_bucket& parking_bucket_of(const void* address) {
+    static parking_bucket buckets[64];
+    return buckets[hash_of(reinterpret_cast<uintptr_t>(address), 6)];
+}
+
+inline void park(std::atomic<uint32_t>& word, uint32_t expected) {
+    parking_bucket& b = parking_bucket_of(&word);
+    std::unique_lock<std::mutex> lock(b.lock);
+    if (word.load(std::memory_order_relaxed) == expected) {
+        b.cv.wait(lock);
+    }
+}
+
+inline void park_for(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout) {
+    parking_bucket& b = parking_bucket_of(&word);
+    std::unique_lock<std::mutex> lock(b.lock);
+    if (word.load(std::memory_order_relaxed) == expected) {
+        b.cv.wait_for(lock, timeout);
+    }
+}
+
+inline void unpark_all(std::atomic<uint32_t>& word) {
+    parking_bucket& b = parking_bucket_of(&word);
+    std::lock_guard<std::mutex> lock(b.lock);
+    b.cv.notify_all();
+}
+#endif
+
+}
+
+/// \brief Compact region mutex
+///
+/// Default mutex of a region. It's a single 32-bit word holding the writer
+/// bit, a parked flag and the reader count, versus 56 bytes of a
+/// std::shared_timed_mutex on glibc, so an uncontended acquisition is a
+/// single CAS. Contended acquisitions set the parked flag and park on the
+/// word, and releasing a word with the parked flag set wakes its waiters up.
+///
+/// Like glibc's rwlocks, readers are preferred: a new reader is only blocked
+/// by a writer holding the lock, not by one waiting for it.
+///
+/// Contended acquisitions spin adaptively before parking, see
+/// range_lock_detail::adaptive_spin, and set_max_spins() to tune it.
+///
+/// A third mode, upgradeable ownership, has its own bit in the word, see
+/// lock_upgrade().
+class compact_region_mutex {
+    static constexpr uint32_t writer = 1U << 31;
+    static constexpr uint32_t parked = 1U << 30;
+    static constexpr uint32_t upgrader = 1U << 29;
+    static constexpr uint32_t readers = upgrader - 1;
+
+    std::atomic<uint32_t> _word;
+
+    // Set the parked flag, unless the word changed from s already.
+    bool prepare_wait(uint32_t& s) {
+        if (!(s & parked) && !_word.compare_exchange_strong(s, s | parked, std::memory_order_relaxed)) {
+            return false;
+        }
+        s |= parked;
+        return true;
+    }
+
+    // Park until the word changes, unless it changed already.
+    bool wait(uint32_t s) {
+        if (prepare_wait(s)) {
+            range_lock_detail::park(_word, s);
+        }
+        return true;
+    }
+
+    // Same as wait(), but returns false once the deadline is reached.
+    template <typename Clock, typename Duration>
+    bool wait_until(uint32_t s, const std::chrono::time_point<Clock, Duration>& deadline) {
+        auto now = Clock::now();
+        if (now >= deadline) {
+            return false;
+        }
+        if (prepare_wait(s)) {
+            auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+            range_lock_detail::park_for(_word, s, std::max(timeout, std::chrono::nanoseconds(1)));
+        }
+        return true;
+    }
+
+    // Add own to the word once none of the busy bits are set, calling wait(s)
+    // whenever they are, until it returns false.
+    template <typename Wait>
+    bool acquire(uint32_t busy, uint32_t own, Wait&& wait) {
+        uint32_t s = 0;
+        while (!_word.compare_exchange_weak(s, s + own, std::memory_order_acquire, std::memory_order_relaxed)) {
+            if (s & busy) {
+                if (range_lock_detail::adaptive_spin::spin_until([this, &s, busy] {
+                        s = this->_word.load(std::memory_order_relaxed);
+                        return !(s & busy);
+                    })) {
+                    continue;
+                }
+                if (!wait(s)) {
+                    return false;
+                }
+                s = _word.load(std::memory_order_relaxed) & ~busy;
+            }
+        }
+        return true;
+    }
+
+    bool try_acquire(uint32_t busy, uint32_t own) {
+        uint32_t s = _word.load(std::memory_order_relaxed);
+        while (!(s & busy)) {
+            if (_word.compare_exchange_weak(s, s + own, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void release(uint32_t s) {
+        if (s & parked) {
+            range_lock_detail::unpark_all(_word);
+        }
+    }
+
+    // Clear the parked flag and wake waiters up, unless another thread did.
+    void wake_waiters(uint32_t s) {
+        while (s & parked) {
+            if (_word.compare_exchange_weak(s, s & ~parked, std::memory_order_relaxed)) {
+                range_lock_detail::unpark_all(_word);
+                return;
+            }
+        }
+    }
+public:
+    compact_region_mutex() : _word(0) {}
+    compact_region_mutex(const compact_region_mutex&) = delete;
+    compact_region_mutex& operator=(const compact_region_mutex&) = delete;
+
+    // Bound the spinning of contended acquisitions, for all compact region
+    // mutexes. Zero makes them park right away.
+    static void set_max_spins(unsigned spins) {
+        range_lock_detail::adaptive_spin::set_max_spins(spins);
+    }
+
+    // Whether lock(), or lock_shared() if shared, would wait right now. Only
+    // reads the word, so it can be checked within a hardware transaction, see
+    // basic_range_lock::enable_lock_elision().
+    bool would_block(bool shared) const {
+        return _word.load(std::memory_order_relaxed) & (shared ? writer : writer | upgrader | readers);
+    }
+
+    bool try_lock() {
+        return try_acquire(writer | upgrader | readers, writer);
+    }
+
+    void lock() {
+        acquire(writer | upgrader | readers, writer, [this] (uint32_t s) { return this->wait(s); });
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        return acquire(writer | upgrader | readers, writer, [this, &deadline] (uint32_t s) {
+            return this->wait_until(s, deadline);
+        });
+    }
+
+    template <typename Rep, typename Period>
+    bool try_lock_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    void unlock() {
+        release(_word.exchange(0, std::memory_order_release));
+    }
+
+    bool try_lock_shared() {
+        assert((_word.load(std::memory_order_relaxed) & readers) != readers); // assert reader count doesn't overflow
+        return try_acquire(writer, 1);
+    }
+
+    void lock_shared() {
+        acquire(writer, 1, [this] (uint32_t s) { return this->wait(s); });
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        return acquire(writer, 1, [this, &deadline] (uint32_t s) { return this->wait_until(s, deadline); });
+    }
+
+    template <typename Rep, typename Period>
+    bool try_lock_shared_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_shared_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    // The last reader clears the parked flag and wakes waiters up, unless
+    // they're only blocked by an upgradeable owner. Should the word change in
+    // between, it's up to the new owner to do so.
+    void unlock_shared() {
+        uint32_t s = _word.fetch_sub(1, std::memory_order_release) - 1;
+        if ((s & parked) && !(s & readers) && (s & (writer | upgrader)) != upgrader
+                && _word.compare_exchange_strong(s, s & ~parked, std::memory_order_relaxed)) {
+            release(parked);
+        }
+    }
+
+    // Upgradeable ownership is shared with readers, but exclusive of writers
+    // and of other upgradeable owners, so that it can be upgraded in place to
+    // exclusive ownership without deadlocking with another upgrade.
+    bool try_lock_upgrade() {
+        return try_acquire(writer | upgrader, upgrader);
+    }
+
+    void lock_upgrade() {
+        acquire(writer | upgrader, upgrader, [this] (uint32_t s) { return this->wait(s); });
+    }
+
+    void unlock_upgrade() {
+        wake_waiters(_word.fetch_sub(upgrader, std::memory_order_release) - upgrader);
+    }
+
+    // Upgrade from upgradeable to exclusive ownership. The writer bit is set
+    // right away, so that no new reader gets in, and then the readers already
+    // in are waited for.
+    void unlock_upgrade_and_lock() {
+        uint32_t s = _word.fetch_or(writer, std::memory_order_relaxed) | writer;
+        while (s & readers) {
+            if (!range_lock_detail::adaptive_spin::spin_until([this, &s] {
+                    s = this->_word.load(std::memory_order_relaxed);
+                    return !(s & readers);
+                })) {
+                wait(s);
+                s = _word.load(std::memory_order_relaxed);
+            }
+        }
+        _word.fetch_and(~upgrader, std::memory_order_acquire);
+    }
+
+    // Downgrade from exclusive to shared ownership, letting waiting readers in.
+    void unlock_and_lock_shared() {
+        release(_word.exchange(1, std::memory_order_release));
+    }
+};
+
+#if (__cplusplus >= 201402L)
+typedef std::shared_timed_mutex std_region_mutex;
+#else
+/// If __cplusplus < 201402L, std::shared_timed_mutex is not available, so
+/// lock functions for shared ownership of std_region_mutex will call the
+/// corresponding lock functions for exclusive ownership.
+struct std_region_mutex : public std::timed_mutex {
+    void lock_shared() { lock(); }
+    bool try_lock_shared() { return try_lock(); }
+    void unlock_shared() { unlock(); }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        return try_lock_until(deadline);
+    }
+};
+#endif
+
+/// \brief Fair region mutex
+///
+/// Region mutex granting ownership in arrival order, for workloads whose
+/// writers must not be starved by a continuous flow of readers. A request
+/// that cannot be granted right away is queued, MCS-style, as a waiter that
+/// lives on the stack of the blocked thread and has its own condition
+/// variable, so a release wakes up only the waiters it grants ownership to.
+///
+/// A reader arriving while a writer is queued waits behind it. When a writer
+/// releases the mutex, the readers queued consecutively at the head are
+/// granted ownership together as a batch.
+///
+/// Fairness has a price: every acquisition takes the internal mutex, so the
+/// uncontended case is slower than with compact_region_mutex.
+class fair_region_mutex {
+    struct waiter {
+        bool shared;
+        bool granted = false;
+        waiter* next = nullptr;
+        std::condition_variable cv;
+
+        explicit waiter(bool shared) : shared(shared) {}
+    };
+
+    std::mutex _lock;
+    uint32_t _readers = 0;
+    bool _writer = false;
+    waiter* _head = nullptr;
+    waiter* _tail = nullptr;
+
+    bool compatible(bool shared) const {
+        return !_writer && (shared || !_readers);
+    }
+
+    void take(bool shared) {
+        if (shared) {
+            _readers++;
+        } else {
+            _writer = true;
+        }
+    }
+
+    bool try_take(bool shared) {
+        if (_head || !compatible(shared)) {
+            return false;
+        }
+        take(shared);
+        return true;
+    }
+
+    void enqueue(waiter& w) {
+        if (_tail) {
+            _tail->next = &w;
+        } else {
+            _head = &w;
+        }
+        _tail = &w;
+    }
+
+    void dequeue(waiter& w) {
+        waiter* prev = nullptr;
+        for (waiter* it = _head; it != &w; it = it->next) {
+            prev = it;
+        }
+        (prev ? prev->next : _head) = w.next;
+        if (_tail == &w) {
+            _tail = prev;
+        }
+    }
+
+    // Grant ownership to the waiters at the head, as long as they're compatible.
+    void grant() {
+        while (_head && compatible(_head->shared)) {
+            waiter* w = _head;
+            _head = w->next;
+            if (!_head) {
+                _tail = nullptr;
+            }
+            take(w->shared);
+            w->granted = true;
+            w->cv.notify_one();
+        }
+    }
+
+    void generic_lock(bool shared) {
+        std::unique_lock<std::mutex> lock(_lock);
+        if (try_take(shared)) {
+            return;
+        }
+        waiter w(shared);
+        enqueue(w);
+        w.cv.wait(lock, [&w] { return w.granted; });
+    }
+
+    template <typename Clock, typename Duration>
+    bool generic_try_lock_until(bool shared, const std::chrono::time_point<Clock, Duration>& deadline) {
+        std::unique_lock<std::mutex> lock(_lock);
+        if (try_take(shared)) {
+            return true;
+        }
+        waiter w(shared);
+        enqueue(w);
+        if (w.cv.wait_until(lock, deadline, [&w] { return w.granted; })) {
+            return true;
+        }
+        // Requests queued behind this one may be grantable once it's gone.
+        dequeue(w);
+        grant();
+        return false;
+    }
+public:
+    fair_region_mutex() = default;
+    fair_region_mutex(const fair_region_mutex&) = delete;
+    fair_region_mutex& operator=(const fair_region_mutex&) = delete;
+
+    // Waiters are taken into account, so that try_lock() doesn't jump the queue.
+    bool try_lock() {
+        std::lock_guard<std::mutex> lock(_lock);
+        return try_take(false);
+    }
+
+    void lock() {
+        generic_lock(false);
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        return generic_try_lock_until(false, deadline);
+    }
+
+    template <typename Rep, typename Period>
+    bool try_lock_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    void unlock() {
+        std::lock_guard<std::mutex> lock(_lock);
+        assert(_writer); // assert mutex is held for exclusive ownership
+        _writer = false;
+        grant();
+    }
+
+    bool try_lock_shared() {
+        std::lock_guard<std::mutex> lock(_lock);
+        return try_take(true);
+    }
+
+    void lock_shared() {
+        generic_lock(true);
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        return generic_try_lock_until(true, deadline);
+    }
+
+    template <typename Rep, typename Period>
+    bool try_lock_shared_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_shared_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    void unlock_shared() {
+        std::lock_guard<std::mutex> lock(_lock);
+        assert(_readers > 0); // assert mutex is held for shared ownership
+        if (--_readers == 0) {
+            grant();
+        }
+    }
+};
+
+namespace range_lock_detail {
+
+/// Thread index
+///
+/// Small index of the calling thread, below max_threads, so per-thread state
+/// can be kept in plain arrays. Indexes are handed out on first use and
+/// recycled on thread exit, so a thread may inherit the state of one that
+/// exited; threads beyond max_threads get none.
+class thread_index {
+public:
+    static constexpr unsigned max_threads = 256;
+    static constexpr unsigned none = max_threads;
+private:
+    std::atomic<unsigned> _in_use;
+    std::mutex _lock;
+    std::vector<unsigned> _free;
+
+    thread_index() : _in_use(0) {}
+
+    static thread_index& instance() {
+        static thread_index indexes;
+        return indexes;
+    }
+
+    unsigned acquire() {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (!_free.empty()) {
+            unsigned i = _free.back();
+            _free.pop_back();
+            return i;
+        }
+        unsigned i = _in_use.load(std::memory_order_relaxed);
+        if (i == max_threads) {
+            return none;
+        }
+        _in_use.store(i + 1, std::memory_order_seq_cst);
+        return i;
+    }
+
+    void release(unsigned i) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _free.push_back(i);
+    }
+
+    struct lease {
+        unsigned index;
+
+        lease() : index(instance().acquire()) {}
+        ~lease() {
+            if (index != none) {
+                instance().release(index);
+            }
+        }
+    };
+public:
+    // Index of the calling thread, or none.
+    static unsigned local() {
+        static thread_local lease l;
+        return l.index;
+    }
+
+    // Bound of the indexes handed out so far.
+    static unsigned in_use() {
+        return instance()._in_use.load(std::memory_order_seq_cst);
+    }
+};
+
+/// Visible readers table
+///
+/// Slots in which reader_biased_region_mutex readers announce themselves
+/// instead of writing to the mutex. Each thread gets a row of its own, see
+/// thread_index, so a reader only writes to cache lines of its thread, and a
+/// mutex maps to one slot of every row, which is all a writer has to scan.
+/// Threads without an index always take the slow path.
+class visible_readers {
+public:
+    static constexpr unsigned slot_bits = 6;
+    static constexpr unsigned row_slots = 1U << slot_bits;
+    static constexpr unsigned max_rows = thread_index::max_threads;
+
+    struct alignas(64) row {
+        std::atomic<const void*> slots[row_slots];
+    };
+private:
+    row _rows[max_rows];
+
+    visible_readers() {
+        for (auto& r : _rows) {
+            for (auto& slot : r.slots) {
+                slot.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    }
+public:
+    static visible_readers& instance() {
+        static visible_readers table;
+        return table;
+    }
+
+    // Row of the calling thread, or nullptr if none is left.
+    static row* local_row() {
+        unsigned index = thread_index::local();
+        return index != thread_index::none ? &instance()._rows[index] : nullptr;
+    }
+
+    static unsigned slot_of(const void* owner) {
+        return unsigned(hash_of(reinterpret_cast<uintptr_t>(owner), slot_bits));
+    }
+
+    // Wait for every slot owner was announced in to be cleared, while wait()
+    // returns true. Returns false if wait() gave up.
+    template <typename Wait>
+    bool wait_for_readers(const void* owner, Wait&& wait) {
+        unsigned slot = slot_of(owner);
+        unsigned rows = thread_index::in_use();
+        for (unsigned r = 0; r < rows; r++) {
+            while (_rows[r].slots[slot].load(std::memory_order_seq_cst) == owner) {
+                if (!wait()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+}
+
+/// \brief Reader-biased region mutex
+///
+/// Wrapper of a region mutex for read-mostly regions, after BRAVO (Dice and
+/// Kogan, 2019). While the mutex is biased towards readers, a reader doesn't
+/// write to the mutex at all: it announces itself in its thread's slot of
+/// range_lock_detail::visible_readers, so readers of a hot region don't
+/// bounce its cache line between cores.
+///
+/// A writer revokes the bias after acquiring the underlying mutex, and waits
+/// for the readers announced in slots to leave. Readers arriving meanwhile
+/// take the underlying mutex, and the first reader to get it after the bias
+/// was revoked restores it, unless revocation is inhibited: for
+/// inhibit_factor times as long as the last revocation took, so that write
+/// heavy regions stay on the underlying mutex.
+///
+/// Regions of a sharded or lock-free table still take a reference on every
+/// acquisition, and lose their bias once unreferenced, so the mutex pays off
+/// in a dense table, see read_mostly_range_lock.
+template <typename Mutex = compact_region_mutex>
+class reader_biased_region_mutex {
+    typedef std::chrono::steady_clock clock;
+    static constexpr unsigned inhibit_factor = 9;
+
+    Mutex _mutex;
+    std::atomic<bool> _bias;
+    // Written with the underlying mutex held for exclusive ownership, read
+    // with it held for shared ownership.
+    clock::time_point _inhibit_until;
+    // Set while readers announced before the last revocation may be left,
+    // only accessed with the underlying mutex held for exclusive ownership.
+    bool _revoked = false;
+
+    std::atomic<const void*>* local_slot() {
+        range_lock_detail::visible_readers::row* r = range_lock_detail::visible_readers::local_row();
+        return r ? &r->slots[range_lock_detail::visible_readers::slot_of(this)] : nullptr;
+    }
+
+    // Announce the calling thread as a reader, if the mutex is biased.
+    bool try_lock_shared_fast() {
+        if (!_bias.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        std::atomic<const void*>* slot = local_slot();
+        const void* expected = nullptr;
+        if (!slot || !slot->compare_exchange_strong(expected, this, std::memory_order_seq_cst)) {
+            return false;
+        }
+        // Pairs with the store to _bias in revoke_bias(): either the writer
+        // sees the slot, or the bias is seen revoked here.
+        if (_bias.load(std::memory_order_seq_cst)) {
+            return true;
+        }
+        slot->store(nullptr, std::memory_order_release);
+        return false;
+    }
+
+    // Called with the underlying mutex held for shared ownership.
+    void restore_bias() {
+        if (!_bias.load(std::memory_order_relaxed) && clock::now() >= _inhibit_until) {
+            _bias.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // Revoke the bias, and wait for the readers announced in slots while
+    // wait() returns true. Called with the underlying mutex held for
+    // exclusive ownership. Returns false if wait() gave up, in which case
+    // the next writer waits for them.
+    template <typename Wait>
+    bool revoke_bias(Wait&& wait) {
+        if (_bias.load(std::memory_order_relaxed)) {
+            _bias.store(false, std::memory_order_seq_cst);
+            _revoked = true;
+        } else if (!_revoked) {
+            return true;
+        }
+        clock::time_point start = clock::now();
+        if (!range_lock_detail::visible_readers::instance().wait_for_readers(this, wait)) {
+            return false;
+        }
+        _revoked = false;
+        clock::time_point now = clock::now();
+        _inhibit_until = now + (now - start) * inhibit_factor;
+        return true;
+    }
+public:
+    reader_biased_region_mutex() : _bias(false) {}
+    reader_biased_region_mutex(const reader_biased_region_mutex&) = delete;
+    reader_biased_region_mutex& operator=(const reader_biased_region_mutex&) = delete;
+
+    bool biased() const {
+        return _bias.load(std::memory_order_relaxed);
+    }
+
+    void lock() {
+        _mutex.lock();
+        revoke_bias([] {
+            std::this_thread::yield();
+            return true;
+        });
+    }
+
+    // Fails if readers still hold the mutex through their slots, but the bias
+    // stays revoked, so they're gone by the next attempt.
+    bool try_lock() {
+        if (!_mutex.try_lock()) {
+            return false;
+        }
+        if (!revoke_bias([] { return false; })) {
+            _mutex.unlock();
+            return false;
+        }
+        return true;
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        if (!_mutex.try_lock_until(deadline)) {
+            return false;
+        }
+        if (!revoke_bias([&deadline] {
+                std::this_thread::yield();
+                return Clock::now() < deadline;
+            })) {
+            _mutex.unlock();
+            return false;
+        }
+        return true;
+    }
+
+    template <typename Rep, typename Period>
+    bool try_lock_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    void unlock() {
+        _mutex.unlock();
+    }
+
+    void lock_shared() {
+        if (try_lock_shared_fast()) {
+            return;
+        }
+        _mutex.lock_shared();
+        restore_bias();
+    }
+
+    bool try_lock_shared() {
+        if (try_lock_shared_fast()) {
+            return true;
+        }
+        if (!_mutex.try_lock_shared()) {
+            return false;
+        }
+        restore_bias();
+        return true;
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        if (try_lock_shared_fast()) {
+            return true;
+        }
+        if (!_mutex.try_lock_shared_until(deadline)) {
+            return false;
+        }
+        restore_bias();
+        return true;
+    }
+
+    template <typename Rep, typename Period>
+    bool try_lock_shared_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_shared_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    // Only the calling thread announces itself in its slot, so finding this
+    // mutex there means it was locked through the slot.
+    void unlock_shared() {
+        std::atomic<const void*>* slot = local_slot();
+        if (slot && slot->load(std::memory_order_relaxed) == this) {
+            slot->store(nullptr, std::memory_order_release);
+            return;
+        }
+        _mutex.unlock_shared();
+    }
+};
+
+/// Memory footprint of a region table, see basic_range_lock::footprint().
+/// Unlike region_table_stats, it's always available.
+struct region_table_footprint {
+    uint64_t live_regions = 0;
+    // Memory held by the table and its regions, and its high-water mark.
+    uint64_t bytes = 0;
+    uint64_t peak_bytes = 0;
+};
+
+namespace range_lock_detail {
+
+inline void update_peak(std::atomic<uint64_t>& peak, uint64_t value) {
+    uint64_t p = peak.load(std::memory_order_relaxed);
+    while (p < value && !peak.compare_exchange_weak(p, value, std::memory_order_relaxed)) {
+    }
+}
+
+}
+
+#ifdef RANGE_LOCK_STATS
+/// Statistics of a region table, only available when compiled with
+/// RANGE_LOCK_STATS defined.
+struct region_table_stats {
+    uint64_t live_regions = 0;
+    uint64_t peak_live_regions = 0;
+    // Table operations which found the table busy, see each table.
+    uint64_t contended_table_locks = 0;
+    // Unreferenced regions found still in the table when pinned again, see
+    // sharded_region_table.
+    uint64_t reused_regions = 0;
+    // Pins served by the handle cache of the thread, see sharded_region_table.
+    uint64_t cached_pins = 0;
+};
+#endif
+
+/// \brief Sharded region table
+///
+/// Default table of live regions used by range_lock. It is split into shards,
+/// each one with its own map and mutex. A region id is hashed to a shard, so
+/// threads locking disjoint ranges will most likely not serialize on the same
+/// table mutex.
+///
+/// Regions are grouped into batches of batch_size consecutive ids, and a whole
+/// batch lives in the same shard. That allows a lock request to pin or release
+/// all regions of a batch with a single critical section on the table, instead
+/// of one per region.
+///
+/// Regions are stored in place in the nodes of the shard's map, and the nodes
+/// of erased regions are recycled by a per-shard pool, so steady state locking
+/// doesn't allocate from the heap.
+///
+/// By default, a region is erased as soon as it's no longer referenced. With
+/// a retention cap, up to that many unreferenced regions are retained
+/// instead, so locking a hot region again only looks it up. Each shard keeps
+/// its share of the cap in a clock: a retained region released again is
+/// marked, and once the shard retains more than its share, the clock hand
+/// clears marks and erases unmarked regions until the shard is down to three
+/// quarters of its share, so the sweep is amortized over many releases.
+/// Regions released only once are unmarked, so a scan over many cold regions
+/// doesn't push the hot ones out.
+/// Workloads that rarely lock the same region twice pay for retention, as
+/// regions are erased later, when their nodes are no longer in cache.
+///
+/// Optionally, each thread caches handles of the regions it pinned last, see
+/// thread_index, and keeps them pinned. A pin of cached regions is then an
+/// atomic increment of their reference counts, which can't drop to zero
+/// meanwhile, without touching the shard: only the regions' own cache lines.
+/// Reference counts only drop to zero with the shard locked. Cached handles
+/// belong to an epoch of the table, and flush_handle_caches() starts a new
+/// one, so that each thread unpins its handles on its next pin. Pins missing
+/// the cache cost more, since they also replace handles, so the cache only
+/// pays off for threads which relock the same regions.
+///
+/// The memory of the regions is returned to the heap only by trim(), until
+/// then the pools keep the nodes of erased regions for reuse. footprint()
+/// reports it along with the live regions.
+template <typename Mutex = compact_region_mutex>
+class sharded_region_table {
+public:
+    struct region {
+        std::atomic<uint32_t> refcount{0};
+        Mutex mutex;
+        // Whether the region is in the clock of its shard, and was reused
+        // and released again since the hand last passed it.
+        bool retained = false;
+        bool recently_released = false;
+    };
+    static constexpr unsigned batch_bits = 6;
+    static constexpr unsigned batch_size = 1U << batch_bits;
+private:
+    // Shards are padded to avoid false sharing between the mutexes of
+    // neighbouring shards. Padding is used instead of alignas() because
+    // operator new[] only honors extended alignment from C++17 on.
+    typedef std::pair<const uint64_t, region> region_map_value;
+    typedef std::unordered_map<uint64_t, region, std::hash<uint64_t>, std::equal_to<uint64_t>,
+        range_lock_detail::pool_allocator<region_map_value>> region_map;
+    struct region_shard {
+        range_lock_detail::node_pool pool;
+        region_map regions{0, std::hash<uint64_t>(), std::equal_to<uint64_t>(),
+            range_lock_detail::pool_allocator<region_map_value>(&pool)};
+        // Retained regions and their ids, and the clock hand over them.
+        // Regions pinned again stay in the clock until the hand reaches them.
+        std::vector<std::pair<uint64_t, region*>> retained;
+        size_t hand = 0;
+        // Number of regions, read by footprint() without the lock, and the
+        // memory held by the pool, map and clock as last accounted for.
+        std::atomic<uint64_t> live{0};
+        uint64_t bytes = 0;
+        std::mutex lock;
+        char padding[64];
+    };
+    // Handles are direct mapped by region id, so the regions of a pin of up
+    // to handle_cache_size regions never evict each other.
+    static constexpr unsigned handle_cache_size = 16;
+    struct handle {
+        uint64_t region_id = 0;
+        region* r = nullptr;
+    };
+    struct handle_cache {
+        uint64_t epoch = 0;
+        handle handles[handle_cache_size];
+    };
+    std::unique_ptr<region_shard[]> _shards;
+    unsigned _shard_bits;
+    size_t _retained_per_shard;
+    // Indexed by thread index, each cache only used by its thread.
+    std::unique_ptr<std::unique_ptr<handle_cache>[]> _handle_caches;
+    std::atomic<uint64_t> _handle_epoch{0};
+    // Memory held by the table, only updated when the memory held by a shard
+    // changes, which steady state locking doesn't do.
+    std::atomic<uint64_t> _bytes{0};
+    std::atomic<uint64_t> _peak_bytes{0};
+#ifdef RANGE_LOCK_STATS
+    std::atomic<uint64_t> _live_regions{0};
+    std::atomic<uint64_t> _peak_live_regions{0};
+    std::atomic<uint64_t> _contended_table_locks{0};
+    std::atomic<uint64_t> _reused_regions{0};
+    std::atomic<uint64_t> _cached_pins{0};
+#endif
+public:
+    // Default number of shards: a power of two, proportional to the number of
+    // hardware threads, so that disjoint lockers rarely meet on the same shard.
+    static unsigned default_shard_count() {
+        unsigned threads = std::max(std::thread::hardware_concurrency(), 1U);
+        unsigned count = 1;
+        while (count < threads * 4 && count < 1024) {
+            count <<= 1;
+        }
+        return count;
+    }
+
+    // NOTE: Please make sure that shard_count is greater than zero and power
+    // of two.
+    // Up to retained_regions unreferenced regions are retained, split evenly
+    // between the shards, and threads cache region handles if cache_handles
+    // is set, see above.
+    explicit sharded_region_table(unsigned shard_count = default_shard_count(), uint64_t retained_regions = 0,
+            bool cache_handles = false)
+        : _shards(new region_shard[shard_count])
+        , _shard_bits(range_lock_detail::log2_of(shard_count))
+        , _retained_per_shard(size_t((retained_regions + shard_count - 1) / shard_count)) {
+        assert(shard_count > 0);
+        assert((shard_count & (shard_count - 1)) == 0);
+        uint64_t bytes = shard_count * sizeof(region_shard);
+        if (cache_handles) {
+            _handle_caches.reset(new std::unique_ptr<handle_cache>[range_lock_detail::thread_index::max_threads]);
+            bytes += range_lock_detail::thread_index::max_threads * sizeof(std::unique_ptr<handle_cache>);
+        }
+        add_bytes(bytes);
+    }
+
+    // Have every thread unpin its cached handles on its next pin. Regions
+    // cached by threads which don't use the table anymore stay pinned.
+    void flush_handle_caches() {
+        _handle_epoch.fetch_add(1, std::memory_order_release);
+    }
+
+    // live_regions counts retained regions and regions held by handle
+    // caches, and bytes the nodes recycled by the pools, see trim().
+    region_table_footprint footprint() const {
+        region_table_footprint fp;
+        for (size_t i = 0; i < (size_t(1) << _shard_bits); i++) {
+            fp.live_regions += _shards[i].live.load(std::memory_order_relaxed);
+        }
+        fp.bytes = _bytes.load(std::memory_order_relaxed);
+        fp.peak_bytes = _peak_bytes.load(std::memory_order_relaxed);
+        return fp;
+    }
+
+    // Erase the unreferenced regions retained, and return the memory of
+    // erased regions to the heap. Also flushes handle caches, whose regions
+    // are erased once unpinned by their threads.
+    void trim() {
+        flush_handle_caches();
+        for (size_t i = 0; i < (size_t(1) << _shard_bits); i++) {
+            region_shard& shard = _shards[i];
+            std::unique_lock<std::mutex> lock = lock_shard(shard);
+            for (auto& entry : shard.retained) {
+                region& r = *entry.second;
+                r.retained = false;
+                r.recently_released = false;
+                if (!r.refcount.load(std::memory_order_relaxed)) {
+                    erase(shard, shard.regions.find(entry.first));
+                }
+            }
+            shard.retained.clear();
+            shard.retained.shrink_to_fit();
+            shard.hand = 0;
+            shard.regions.rehash(0);
+            shard.pool.trim();
+            update_footprint(shard);
+        }
+    }
+private:
+    void add_bytes(uint64_t delta) {
+        range_lock_detail::update_peak(_peak_bytes, _bytes.fetch_add(delta, std::memory_order_relaxed) + delta);
+    }
+
+    // Account for the regions and memory of a shard, which must be locked,
+    // after regions were added or removed.
+    void update_footprint(region_shard& shard) {
+        shard.live.store(shard.regions.size(), std::memory_order_relaxed);
+        uint64_t bytes = shard.pool.bytes() + shard.regions.bucket_count() * sizeof(void*)
+            + shard.retained.capacity() * sizeof(shard.retained[0]);
+        if (bytes != shard.bytes) {
+            // Wraps around when the shard shrank.
+            add_bytes(bytes - shard.bytes);
+            shard.bytes = bytes;
+        }
+    }
+    void erase(region_shard& shard, typename region_map::iterator it) {
+        shard.regions.erase(it);
+#ifdef RANGE_LOCK_STATS
+        _live_regions.fetch_sub(1, std::memory_order_relaxed);
+#endif
+    }
+
+    // Drop the clock entry under the hand, which is then on the next entry.
+    static void drop_hand_entry(region_shard& shard) {
+        shard.retained[shard.hand] = shard.retained.back();
+        shard.retained.pop_back();
+    }
+
+    // Sweep the clock until the shard retains three quarters of its share.
+    // Entries of regions pinned again leave the clock, and enter it again
+    // when released.
+    void evict(region_shard& shard) {
+        size_t target = _retained_per_shard - _retained_per_shard / 4;
+        while (shard.retained.size() > target) {
+            if (shard.hand >= shard.retained.size()) {
+                shard.hand = 0;
+            }
+            auto entry = shard.retained[shard.hand];
+            region& r = *entry.second;
+            if (r.refcount.load(std::memory_order_relaxed)) {
+                r.retained = false;
+                drop_hand_entry(shard);
+            } else if (r.recently_released) {
+                r.recently_released = false;
+                shard.hand++;
+            } else {
+                drop_hand_entry(shard);
+                erase(shard, shard.regions.find(entry.first));
+            }
+        }
+    }
+
+    // Erase a region no longer referenced, or retain it.
+    void release(region_shard& shard, typename region_map::iterator it) {
+        if (!_retained_per_shard) {
+            erase(shard, it);
+            return;
+        }
+        region& r = it->second;
+        if (r.retained) {
+            r.recently_released = true;
+            return;
+        }
+        r.retained = true;
+        shard.retained.push_back(std::make_pair(it->first, &r));
+        if (shard.retained.size() > _retained_per_shard) {
+            evict(shard);
+        }
+    }
+
+    region_shard& get_shard(uint64_t region_id) const {
+        return _shards[range_lock_detail::hash_of(region_id >> batch_bits, _shard_bits)];
+    }
+
+    // Lock the shard, counting the times it's found busy.
+    std::unique_lock<std::mutex> lock_shard(region_shard& shard) {
+#ifdef RANGE_LOCK_STATS
+        std::unique_lock<std::mutex> lock(shard.lock, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            _contended_table_locks.fetch_add(1, std::memory_order_relaxed);
+            lock.lock();
+        }
+        return lock;
+#else
+        return std::unique_lock<std::mutex>(shard.lock);
+#endif
+    }
+
+    // Drop a reference of region r with the shard locked, erasing or
+    // retaining r if it was the last one.
+    void unpin_locked(region_shard& shard, uint64_t region_id, region& r) {
+        assert(r.refcount.load(std::memory_order_relaxed) > 0); // assert region is pinned
+        if (r.refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            release(shard, shard.regions.find(region_id));
+        }
+    }
+
+    // Drop a reference of region r without locking the shard, unless it's the
+    // last one. Returns false if it is.
+    static bool try_unpin_unlocked(region& r) {
+        uint32_t refcount = r.refcount.load(std::memory_order_relaxed);
+        while (refcount > 1) {
+            if (r.refcount.compare_exchange_weak(refcount, refcount - 1, std::memory_order_release,
+                    std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void unpin_one(uint64_t region_id, region& r) {
+        if (!try_unpin_unlocked(r)) {
+            region_shard& shard = get_shard(region_id);
+            std::unique_lock<std::mutex> lock = lock_shard(shard);
+            unpin_locked(shard, region_id, r);
+            update_footprint(shard);
+        }
+    }
+
+    void drop_handles(handle_cache& cache) {
+        for (auto& h : cache.handles) {
+            if (h.r) {
+                unpin_one(h.region_id, *h.r);
+                h.r = nullptr;
+            }
+        }
+    }
+
+    // Handle cache of the calling thread, if regions are cached and the
+    // thread has an index, with the handles of past epochs dropped.
+    handle_cache* local_handle_cache() {
+        if (!_handle_caches) {
+            return nullptr;
+        }
+        unsigned index = range_lock_detail::thread_index::local();
+        if (index == range_lock_detail::thread_index::none) {
+            return nullptr;
+        }
+        std::unique_ptr<handle_cache>& cache = _handle_caches[index];
+        uint64_t epoch = _handle_epoch.load(std::memory_order_acquire);
+        if (!cache) {
+            cache.reset(new handle_cache);
+            cache->epoch = epoch;
+            add_bytes(sizeof(handle_cache));
+        } else if (cache->epoch != epoch) {
+            drop_handles(*cache);
+            cache->epoch = epoch;
+        }
+        return cache.get();
+    }
+
+    static handle& handle_of(handle_cache& cache, uint64_t region_id) {
+        return cache.handles[region_id % handle_cache_size];
+    }
+
+    // Store into regions[] the cached handles of [first_id, first_id+count),
+    // if all of them are cached.
+    bool find_cached(handle_cache& cache, uint64_t first_id, unsigned count, region** regions) {
+        for (unsigned i = 0; i < count; i++) {
+            handle& h = handle_of(cache, first_id + i);
+            if (!h.r || h.region_id != first_id + i) {
+                return false;
+            }
+            regions[i] = h.r;
+        }
+        return true;
+    }
+
+    // Pin [first_id, first_id+count) with the shard locked. If cache is
+    // given, regions it doesn't hold are pinned once more and cached, and the
+    // handles they replace are unpinned, under the same shard lock when the
+    // replaced region belongs to it.
+    void pin_locked(uint64_t first_id, unsigned count, region** regions, handle_cache* cache) {
+        handle replaced[handle_cache_size];
+        unsigned replaced_count = 0;
+        region_shard& shard = get_shard(first_id);
+        {
+            std::unique_lock<std::mutex> lock = lock_shard(shard);
+            for (unsigned i = 0; i < count; i++) {
+                auto ret = shard.regions.emplace(std::piecewise_construct,
+                    std::forward_as_tuple(first_id + i), std::forward_as_tuple());
+                region& r = ret.first->second;
+#ifdef RANGE_LOCK_STATS
+                if (ret.second) {
+                    range_lock_detail::update_peak(_peak_live_regions,
+                        _live_regions.fetch_add(1, std::memory_order_relaxed) + 1);
+                } else if (!r.refcount.load(std::memory_order_relaxed)) {
+                    _reused_regions.fetch_add(1, std::memory_order_relaxed);
+                }
+#endif
+                regions[i] = &r;
+                handle* h = cache ? &handle_of(*cache, first_id + i) : nullptr;
+                if (!h || h->r == &r) {
+                    r.refcount.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                r.refcount.fetch_add(2, std::memory_order_relaxed);
+                handle old = *h;
+                h->region_id = first_id + i;
+                h->r = &r;
+                if (!old.r) {
+                    continue;
+                }
+                if (&get_shard(old.region_id) == &shard) {
+                    unpin_locked(shard, old.region_id, *old.r);
+                } else {
+                    replaced[replaced_count++] = old;
+                }
+            }
+            update_footprint(shard);
+        }
+        for (unsigned i = 0; i < replaced_count; i++) {
+            unpin_one(replaced[i].region_id, *replaced[i].r);
+        }
+    }
+public:
+#ifdef RANGE_LOCK_STATS
+    // contended_table_locks counts the shard acquisitions which found the
+    // shard mutex locked. live_regions counts retained regions too.
+    region_table_stats stats() const {
+        region_table_stats st;
+        st.live_regions = _live_regions.load(std::memory_order_relaxed);
+        st.peak_live_regions = _peak_live_regions.load(std::memory_order_relaxed);
+        st.contended_table_locks = _contended_table_locks.load(std::memory_order_relaxed);
+        st.reused_regions = _reused_regions.load(std::memory_order_relaxed);
+        st.cached_pins = _cached_pins.load(std::memory_order_relaxed);
+        return st;
+    }
+
+    void reset_stats() {
+        _peak_live_regions.store(_live_regions.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        _contended_table_locks.store(0, std::memory_order_relaxed);
+        _reused_regions.store(0, std::memory_order_relaxed);
+        _cached_pins.store(0, std::memory_order_relaxed);
+    }
+#endif
+
+    // Take a reference on each region of [first_id, first_id+count), creating
+    // the ones that don't exist yet. Regions are stored into regions[].
+    // All regions must belong to the same batch.
+    void pin(uint64_t first_id, unsigned count, region** regions) {
+        assert(count > 0 && count <= batch_size);
+        assert((first_id >> batch_bits) == ((first_id + count - 1) >> batch_bits));
+        handle_cache* cache = count <= handle_cache_size ? local_handle_cache() : nullptr;
+        if (cache && find_cached(*cache, first_id, count, regions)) {
+            for (unsigned i = 0; i < count; i++) {
+                regions[i]->refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+#ifdef RANGE_LOCK_STATS
+            _cached_pins.fetch_add(1, std::memory_order_relaxed);
+#endif
+            return;
+        }
+        pin_locked(first_id, count, regions, cache);
+    }
+
+    // Store into regions[] each region of [first_id, first_id+count), which
+    // must be pinned, without taking a reference. All regions must belong to
+    // the same batch.
+    void find_pinned(uint64_t first_id, unsigned count, region** regions) {
+        assert(count > 0 && count <= batch_size);
+        assert((first_id >> batch_bits) == ((first_id + count - 1) >> batch_bits));
+        handle_cache* cache = count <= handle_cache_size ? local_handle_cache() : nullptr;
+        if (cache && find_cached(*cache, first_id, count, regions)) {
+            return;
+        }
+        region_shard& shard = get_shard(first_id);
+        std::unique_lock<std::mutex> lock = lock_shard(shard);
+        for (unsigned i = 0; i < count; i++) {
+            auto it = shard.regions.find(first_id + i);
+            assert(it != shard.regions.end()); // assert region exists
+            assert(it->second.refcount > 0); // assert region is pinned
+            regions[i] = &it->second;
+        }
+    }
+
+    // Call f on each region of [first_id, first_id+count), which must be
+    // pinned, and drop its reference afterwards. Regions no longer referenced
+    // are erased, or retained. All regions must belong to the same batch.
+    template <typename Func>
+    void unpin(uint64_t first_id, unsigned count, Func&& f) {
+        assert(count > 0 && count <= batch_size);
+        assert((first_id >> batch_bits) == ((first_id + count - 1) >> batch_bits));
+        region* regions[batch_size];
+        handle_cache* cache = count <= handle_cache_size ? local_handle_cache() : nullptr;
+        if (cache && find_cached(*cache, first_id, count, regions)) {
+            // The cache holds a reference on each region.
+            for (unsigned i = 0; i < count; i++) {
+                f(*regions[i]);
+                bool unpinned = try_unpin_unlocked(*regions[i]);
+                assert(unpinned);
+                (void)unpinned;
+            }
+            return;
+        }
+        region_shard& shard = get_shard(first_id);
+        std::unique_lock<std::mutex> lock = lock_shard(shard);
+        for (unsigned i = 0; i < count; i++) {
+            auto it = shard.regions.find(first_id + i);
+            assert(it != shard.regions.end()); // assert region exists
+            f(it->second);
+            unpin_locked(shard, first_id + i, it->second);
+        }
+        update_footprint(shard);
+    }
+
+    // Same as unpin(), for regions [first_id, first_id+count) stored into
+    // regions[] by pin(). f is called without holding the shard, as the
+    // regions are pinned, and regions are only looked up again to release
+    // the ones no longer referenced.
+    template <typename Func>
+    void unpin_pinned(uint64_t first_id, unsigned count, region** regions, Func&& f) {
+        assert(count > 0 && count <= batch_size);
+        assert((first_id >> batch_bits) == ((first_id + count - 1) >> batch_bits));
+        // Indexes of the regions whose references must be dropped with the
+        // shard locked: all of them, unless handles are cached.
+        unsigned last_references[batch_size];
+        unsigned last_count = 0;
+        for (unsigned i = 0; i < count; i++) {
+            f(*regions[i]);
+            if (!_handle_caches || !try_unpin_unlocked(*regions[i])) {
+                last_references[last_count++] = i;
+            }
+        }
+        if (!last_count) {
+            return;
+        }
+        region_shard& shard = get_shard(first_id);
+        std::unique_lock<std::mutex> lock = lock_shard(shard);
+        for (unsigned i = 0; i < last_count; i++) {
+            unsigned index = last_references[i];
+            unpin_locked(shard, first_id + index, *regions[index]);
+        }
+        update_footprint(shard);
+    }
+};
+
+/// \brief Lock-free region table
+///
+/// Alternative table of live regions in which neither lookups nor reference
+/// counting take a mutex. Regions are stored in an open addressing array of
+/// atomic pointers, with linear probing. A missing region is inserted with a
+/// CAS on the first empty slot of its probe sequence, and its reference count
+/// is an atomic counter.
+///
+/// Slots are never emptied while threads may be looking at them, otherwise
+/// a probe sequence could be broken and the same region id inserted twice.
+/// Instead, regions that are no longer referenced stay in the array until
+/// it's compacted, which happens when the array is getting full. Compaction
+/// closes a quiescence gate, which all operations on the table enter, so it
+/// only runs once no thread can hold a pointer to an unreferenced region,
+/// and only then unreferenced regions are freed. That's a simple form of
+/// quiescent state based memory reclamation; threads only block on it while
+/// a compaction is in progress.
+///
+/// Freed regions are not returned to the heap, but kept in a free list from
+/// which new regions are taken. Regions are only pushed to the free list by
+/// compaction, while no other thread is inside the gate, so popping from it
+/// concurrently is not subject to the ABA problem.
+template <typename Mutex = compact_region_mutex>
+class lockfree_region_table {
+public:
+    struct region {
+        uint64_t id;
+        std::atomic<uint32_t> refcount;
+        Mutex mutex;
+        region* next_free = nullptr;
+
+        explicit region(uint64_t id) : id(id), refcount(1) {}
+    };
+    static constexpr unsigned batch_bits = 6;
+    static constexpr unsigned batch_size = 1U << batch_bits;
+    static constexpr uint64_t default_capacity = 1024;
+private:
+    std::unique_ptr<std::atomic<region*>[]> _slots;
+    uint64_t _capacity;
+    unsigned _capacity_bits;
+    std::atomic<uint64_t> _used;
+    // Popped from inside the gate, pushed to only by compaction.
+    std::atomic<region*> _free_regions;
+    // Regions allocated but not inserted, pushed to from inside the gate and
+    // moved to the free list by compaction.
+    std::atomic<region*> _spare_regions;
+    range_lock_detail::quiescence_gate _gate;
+    std::mutex _compaction_lock;
+    const uint64_t _min_capacity;
+    // Memory held by the array and by all regions allocated, as they're
+    // never returned to the heap before destruction.
+    std::atomic<uint64_t> _bytes{0};
+    std::atomic<uint64_t> _peak_bytes{0};
+#ifdef RANGE_LOCK_STATS
+    std::atomic<uint64_t> _peak_used{0};
+    std::atomic<uint64_t> _lost_insertions{0};
+#endif
+public:
+    // NOTE: Please make sure that capacity is a power of two. The table will
+    // grow beyond it if needed.
+    explicit lockfree_region_table(uint64_t capacity = default_capacity)
+        : _used(0)
+        , _free_regions(nullptr)
+        , _spare_regions(nullptr)
+        , _min_capacity(capacity) {
+        assert(capacity >= 2);
+        assert((capacity & (capacity - 1)) == 0);
+        reset_slots(capacity);
+    }
+
+    ~lockfree_region_table() {
+        for (uint64_t i = 0; i < _capacity; i++) {
+            delete _slots[i].load(std::memory_order_relaxed);
+        }
+        delete_regions(_free_regions.load(std::memory_order_relaxed));
+        delete_regions(_spare_regions.load(std::memory_order_relaxed));
+    }
+private:
+    static void delete_regions(region* r) {
+        while (r) {
+            region* next = r->next_free;
+            delete r;
+            r = next;
+        }
+    }
+
+    static void push_region(std::atomic<region*>& list, region* r) {
+        r->next_free = list.load(std::memory_order_relaxed);
+        while (!list.compare_exchange_weak(r->next_free, r, std::memory_order_release)) {
+        }
+    }
+
+    // Must be called from inside the gate.
+    region* allocate_region(uint64_t region_id) {
+        region* r = _free_regions.load(std::memory_order_acquire);
+        while (r && !_free_regions.compare_exchange_weak(r, r->next_free, std::memory_order_acquire)) {
+        }
+        if (!r) {
+            add_bytes(sizeof(region));
+            return new region(region_id);
+        }
+        r->id = region_id;
+        r->refcount.store(1, std::memory_order_relaxed);
+        return r;
+    }
+
+    void add_bytes(uint64_t delta) {
+        range_lock_detail::update_peak(_peak_bytes, _bytes.fetch_add(delta, std::memory_order_relaxed) + delta);
+    }
+
+    void reset_slots(uint64_t capacity) {
+        if (!_slots || capacity != _capacity) {
+            // Wraps around when the array shrinks.
+            add_bytes((capacity - (_slots ? _capacity : 0)) * sizeof(std::atomic<region*>));
+            _slots.reset(new std::atomic<region*>[capacity]);
+        }
+        for (uint64_t i = 0; i < capacity; i++) {
+            _slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+        _capacity = capacity;
+        _capacity_bits = range_lock_detail::log2_of(capacity);
+    }
+
+    // Must be called from inside the gate. Returns nullptr if the array is full.
+    region* acquire(uint64_t region_id, region*& spare) {
+        uint64_t mask = _capacity - 1;
+        uint64_t i = range_lock_detail::hash_of(region_id, _capacity_bits);
+        for (uint64_t probes = 0; probes < _capacity; probes++, i = (i + 1) & mask) {
+            region* r = _slots[i].load(std::memory_order_acquire);
+            if (!r) {
+                if (!spare) {
+                    spare = allocate_region(region_id);
+                }
+                spare->id = region_id;
+                if (_slots[i].compare_exchange_strong(r, spare, std::memory_order_acq_rel)) {
+#ifdef RANGE_LOCK_STATS
+                    range_lock_detail::update_peak(_peak_used, _used.fetch_add(1, std::memory_order_relaxed) + 1);
+#else
+                    _used.fetch_add(1, std::memory_order_relaxed);
+#endif
+                    region* inserted = spare;
+                    spare = nullptr;
+                    return inserted;
+                }
+#ifdef RANGE_LOCK_STATS
+                _lost_insertions.fetch_add(1, std::memory_order_relaxed);
+#endif
+                // r now points to the region which won the slot.
+            }
+            if (r->id == region_id) {
+                r->refcount.fetch_add(1, std::memory_order_relaxed);
+                return r;
+            }
+        }
+        return nullptr;
+    }
+
+    // Must be called from inside the gate.
+    region* find(uint64_t region_id) const {
+        uint64_t mask = _capacity - 1;
+        uint64_t i = range_lock_detail::hash_of(region_id, _capacity_bits);
+        for (uint64_t probes = 0; probes < _capacity; probes++, i = (i + 1) & mask) {
+            region* r = _slots[i].load(std::memory_order_acquire);
+            if (!r) {
+                break;
+            }
+            if (r->id == region_id) {
+                return r;
+            }
+        }
+        return nullptr;
+    }
+
+    bool needs_compaction() const {
+        return _used.load(std::memory_order_relaxed) > _capacity / 4 * 3;
+    }
+
+    // Free unreferenced regions, and resize the array so that live regions
+    // take up to a quarter of it. Must be called from outside the gate.
+    void compact() {
+        std::lock_guard<std::mutex> lock(_compaction_lock);
+        if (!needs_compaction()) {
+            return;
+        }
+        _gate.close();
+        // Live regions are linked through next_free while the array is rebuilt.
+        region* live = nullptr;
+        uint64_t live_count = 0;
+        region* free_regions = _free_regions.load(std::memory_order_relaxed);
+        for (uint64_t i = 0; i < _capacity; i++) {
+            region* r = _slots[i].load(std::memory_order_relaxed);
+            if (!r) {
+                continue;
+            }
+            if (r->refcount.load(std::memory_order_relaxed) > 0) {
+                r->next_free = live;
+                live = r;
+                live_count++;
+            } else {
+                r->next_free = free_regions;
+                free_regions = r;
+            }
+        }
+        region* spare = _spare_regions.exchange(nullptr, std::memory_order_relaxed);
+        while (spare) {
+            region* next = spare->next_free;
+            spare->next_free = free_regions;
+            free_regions = spare;
+            spare = next;
+        }
+        _free_regions.store(free_regions, std::memory_order_relaxed);
+        uint64_t capacity = _min_capacity;
+        while (capacity < live_count * 4) {
+            capacity <<= 1;
+        }
+        reset_slots(capacity);
+        while (live) {
+            region* r = live;
+            live = r->next_free;
+            r->next_free = nullptr;
+            uint64_t i = range_lock_detail::hash_of(r->id, _capacity_bits);
+            while (_slots[i].load(std::memory_order_relaxed)) {
+                i = (i + 1) & (_capacity - 1);
+            }
+            _slots[i].store(r, std::memory_order_relaxed);
+        }
+        _used.store(live_count, std::memory_order_relaxed);
+        _gate.open();
+    }
+public:
+#ifdef RANGE_LOCK_STATS
+    // Regions stay in the array until compaction, so live_regions counts
+    // unreferenced regions not freed yet too. contended_table_locks counts
+    // the insertions which lost the race for a slot.
+    region_table_stats stats() const {
+        region_table_stats st;
+        st.live_regions = _used.load(std::memory_order_relaxed);
+        st.peak_live_regions = _peak_used.load(std::memory_order_relaxed);
+        st.contended_table_locks = _lost_insertions.load(std::memory_order_relaxed);
+        return st;
+    }
+
+    void reset_stats() {
+        _peak_used.store(_used.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        _lost_insertions.store(0, std::memory_order_relaxed);
+    }
+#endif
+
+    // Same as stats(), live_regions counts unreferenced regions not freed
+    // yet. Freed regions are kept for reuse, so bytes never shrink below the
+    // most regions allocated at once.
+    region_table_footprint footprint() const {
+        region_table_footprint fp;
+        fp.live_regions = _used.load(std::memory_order_relaxed);
+        fp.bytes = _bytes.load(std::memory_order_relaxed);
+        fp.peak_bytes = _peak_bytes.load(std::memory_order_relaxed);
+        return fp;
+    }
+
+    // Take a reference on each region of [first_id, first_id+count), creating
+    // the ones that don't exist yet. Regions are stored into regions[].
+    void pin(uint64_t first_id, unsigned count, region** regions) {
+        assert(count > 0 && count <= batch_size);
+        region* spare = nullptr;
+        unsigned pinned = 0;
+        while (pinned < count) {
+            _gate.enter();
+            for (; pinned < count; pinned++) {
+                regions[pinned] = acquire(first_id + pinned, spare);
+                if (!regions[pinned]) {
+                    break;
+                }
+            }
+            if (spare) {
+                push_region(_spare_regions, spare);
+                spare = nullptr;
+            }
+            bool compaction_needed = needs_compaction() || pinned < count;
+            _gate.exit();
+            if (compaction_needed) {
+                compact();
+            }
+        }
+    }
+
+    // Store into regions[] each region of [first_id, first_id+count), which
+    // must be pinned, without taking a reference. Pinned regions are never
+    // freed, so they can be used after leaving the gate.
+    void find_pinned(uint64_t first_id, unsigned count, region** regions) {
+        assert(count > 0 && count <= batch_size);
+        _gate.enter();
+        for (unsigned i = 0; i < count; i++) {
+            regions[i] = find(first_id + i);
+            assert(regions[i]); // assert region exists
+            assert(regions[i]->refcount.load(std::memory_order_relaxed) > 0); // assert region is pinned
+        }
+        _gate.exit();
+    }
+
+    // Call f on each region of [first_id, first_id+count), which must be
+    // pinned, and drop its reference afterwards.
+    template <typename Func>
+    void unpin(uint64_t first_id, unsigned count, Func&& f) {
+        assert(count > 0 && count <= batch_size);
+        _gate.enter();
+        for (unsigned i = 0; i < count; i++) {
+            region* r = find(first_id + i);
+            assert(r); // assert region exists
+            assert(r->refcount.load(std::memory_order_relaxed) > 0); // assert region is pinned
+            f(*r);
+            r->refcount.fetch_sub(1, std::memory_order_release);
+        }
+        _gate.exit();
+    }
+
+    // Same as unpin(), for regions stored into regions[] by pin(). Pinned
+    // regions are never freed, so neither the array nor the gate is needed.
+    template <typename Func>
+    void unpin_pinned(uint64_t, unsigned count, region** regions, Func&& f) {
+        assert(count > 0 && count <= batch_size);
+        for (unsigned i = 0; i < count; i++) {
+            assert(regions[i]->refcount.load(std::memory_order_relaxed) > 0); // assert region is pinned
+            f(*regions[i]);
+            regions[i]->refcount.fetch_sub(1, std::memory_order_release);
+        }
+    }
+};
+
+/// \brief Dense region table
+///
+/// Table for resources of a known, bounded size, like preallocated files and
+/// buffers. The state of every region lives in a flat array allocated up
+/// front and indexed directly by region id, so there's no hashing, no
+/// reference counting and no table mutex. The price is the memory of all
+/// regions being kept alive for the lifetime of the table, see
+/// create_dense_range_lock().
+///
+/// The array is aligned to a cache line. Regions are packed by default, so
+/// the regions of a request share cache lines; pad_regions gives each one its
+/// own cache line instead, which avoids false sharing when neighbouring
+/// regions are locked by different threads.
+template <typename Mutex = compact_region_mutex>
+class dense_region_table {
+public:
+    struct region {
+        Mutex mutex;
+    };
+    static constexpr unsigned batch_bits = 6;
+    static constexpr unsigned batch_size = 1U << batch_bits;
+    static constexpr size_t cache_line_size = 64;
+private:
+    std::unique_ptr<char[]> _storage;
+    char* _regions;
+    uint64_t _region_count;
+    size_t _stride;
+public:
+    explicit dense_region_table(uint64_t region_count, bool pad_regions = false)
+        : _region_count(region_count)
+        , _stride(pad_regions ? (sizeof(region) + cache_line_size - 1) & ~(cache_line_size - 1) : sizeof(region)) {
+        assert(region_count > 0);
+        _storage.reset(new char[region_count * _stride + cache_line_size - 1]);
+        uintptr_t base = reinterpret_cast<uintptr_t>(_storage.get());
+        _regions = _storage.get() + (((base + cache_line_size - 1) & ~uintptr_t(cache_line_size - 1)) - base);
+        for (uint64_t i = 0; i < region_count; i++) {
+            new (_regions + i * _stride) region;
+        }
+    }
+
+    ~dense_region_table() {
+        for (uint64_t i = 0; i < _region_count; i++) {
+            get_region(i).~region();
+        }
+    }
+
+    dense_region_table(const dense_region_table&) = delete;
+    dense_region_table& operator=(const dense_region_table&) = delete;
+
+    uint64_t region_count() const { return _region_count; }
+
+    // All regions are always live, and allocated up front.
+    region_table_footprint footprint() const {
+        region_table_footprint fp;
+        fp.live_regions = _region_count;
+        fp.bytes = sizeof(*this) + _region_count * _stride + cache_line_size - 1;
+        fp.peak_bytes = fp.bytes;
+        return fp;
+    }
+
+#ifdef RANGE_LOCK_STATS
+    // All regions are always live, and there's no table mutex.
+    region_table_stats stats() const {
+        region_table_stats st;
+        st.live_regions = _region_count;
+        st.peak_live_regions = _region_count;
+        return st;
+    }
+
+    void reset_stats() {}
+#endif
+
+    region& get_region(uint64_t region_id) const {
+        assert(region_id < _region_count); // assert region is within the resource
+        return *reinterpret_cast<region*>(_regions + region_id * _stride);
+    }
+
+    void pin(uint64_t first_id, unsigned count, region** regions) {
+        for (unsigned i = 0; i < count; i++) {
+            regions[i] = &get_region(first_id + i);
+        }
+    }
+
+    void find_pinned(uint64_t first_id, unsigned count, region** regions) {
+        pin(first_id, count, regions);
+    }
+
+    template <typename Func>
+    void unpin(uint64_t first_id, unsigned count, Func&& f) {
+        for (unsigned i = 0; i < count; i++) {
+            f(get_region(first_id + i));
+        }
+    }
+
+    template <typename Func>
+    void unpin_pinned(uint64_t, unsigned count, region** regions, Func&& f) {
+        for (unsigned i = 0; i < count; i++) {
+            f(*regions[i]);
+        }
+    }
+};
+
+/// \brief Workload profile
+///
+/// Snapshot of the lock requests sampled by a range lock, see
+/// basic_range_lock::enable_sampling(). Histograms are indexed by the log2
+/// of the value, so bucket i counts requests in [2^i, 2^(i+1)).
+struct workload_profile {
+    static constexpr unsigned buckets = 64;
+    // Region size of the range lock the profile was taken from.
+    uint64_t region_size = 0;
+    uint64_t samples = 0;
+    // Sampled requests which found at least one of their regions locked.
+    uint64_t conflicts = 0;
+    uint64_t lengths[buckets] = {};
+    uint64_t lengths_in_regions[buckets] = {};
+
+    double conflict_rate() const {
+        return samples ? double(conflicts) / samples : 0.0;
+    }
+
+    // Lower bound of the histogram bucket holding the given percentile.
+    static uint64_t percentile(const uint64_t (&histogram)[buckets], double p) {
+        uint64_t total = 0;
+        for (auto count : histogram) {
+            total += count;
+        }
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < buckets; i++) {
+            seen += histogram[i];
+            if (seen && seen >= p * total) {
+                return uint64_t(1) << i;
+            }
+        }
+        return 0;
+    }
+
+    // The recommended region size is the largest power of two not greater than
+    // the median request length, so that a typical request covers one or two
+    // regions, and requests for disjoint ranges rarely share a region, which
+    // would be a false conflict. Under little contention, there's not much to
+    // gain from finer regions, so the 90th percentile is used instead, which
+    // reduces the number of regions per request.
+    // Returns zero if nothing was sampled.
+    uint64_t recommended_region_size() const {
+        if (!samples) {
+            return 0;
+        }
+        double p = conflict_rate() < 0.01 ? 0.9 : 0.5;
+        return std::max(percentile(lengths, p), uint64_t(64));
+    }
+};
+
+namespace range_lock_detail {
+
+inline unsigned log2_floor(uint64_t v) {
+    unsigned bits = 0;
+    while (v >>= 1) {
+        bits++;
+    }
+    return bits;
+}
+
+/// Workload sampler
+///
+/// Records one in every sample_period lock requests of a thread into
+/// histograms updated with relaxed atomic increments. When disabled, the
+/// cost for a lock request is a relaxed load.
+class workload_sampler {
+    std::atomic<unsigned> _period;
+    std::atomic<uint64_t> _samples;
+    std::atomic<uint64_t> _conflicts;
+    std::atomic<uint64_t> _lengths[workload_profile::buckets];
+    std::atomic<uint64_t> _lengths_in_regions[workload_profile::buckets];
+public:
+    workload_sampler() : _period(0) {
+        reset();
+    }
+
+    void reset() {
+        _samples.store(0, std::memory_order_relaxed);
+        _conflicts.store(0, std::memory_order_relaxed);
+        for (unsigned i = 0; i < workload_profile::buckets; i++) {
+            _lengths[i].store(0, std::memory_order_relaxed);
+            _lengths_in_regions[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void enable(unsigned period) {
+        assert(period > 0);
+        _period.store(period, std::memory_order_relaxed);
+    }
+
+    void disable() {
+        _period.store(0, std::memory_order_relaxed);
+    }
+
+    // Whether the calling thread's next request should be sampled.
+    bool should_sample() {
+        unsigned period = _period.load(std::memory_order_relaxed);
+        if (!period) {
+            return false;
+        }
+        static thread_local unsigned countdown = 0;
+        if (countdown > 0 && countdown < period) {
+            countdown--;
+            return false;
+        }
+        countdown = period - 1;
+        return true;
+    }
+
+    void record(uint64_t length, uint64_t regions, bool conflict) {
+        _samples.fetch_add(1, std::memory_order_relaxed);
+        if (conflict) {
+            _conflicts.fetch_add(1, std::memory_order_relaxed);
+        }
+        _lengths[log2_floor(length)].fetch_add(1, std::memory_order_relaxed);
+        _lengths_in_regions[log2_floor(regions)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    workload_profile snapshot(uint64_t region_size) const {
+        workload_profile p;
+        p.region_size = region_size;
+        p.samples = _samples.load(std::memory_order_relaxed);
+        p.conflicts = _conflicts.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < workload_profile::buckets; i++) {
+            p.lengths[i] = _lengths[i].load(std::memory_order_relaxed);
+            p.lengths_in_regions[i] = _lengths_in_regions[i].load(std::memory_order_relaxed);
+        }
+        return p;
+    }
+};
+
+/// Sequence stripes
+///
+/// Version counters of regions for optimistic reads, see
+/// basic_range_lock::read_begin(). Regions are hashed into stripes of a
+/// 64-bit word each, holding the number of writers of its regions in the low
+/// bits and a version above them, so regions sharing a stripe can be written
+/// concurrently. Beginning and ending a write both increase the word, so if
+/// the words covering a range add up to the same before and after a read,
+/// no write began or ended in between.
+/// Writers are counted per region, so the low half of the word counts up to
+/// 2^32 - 1 regions written at once in a stripe, far more than a table holds
+/// live, and the version wraps after 2^32 writes.
+class sequence_stripes {
+    struct stripe {
+        std::atomic<uint64_t> word;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    std::unique_ptr<stripe[]> _stripes;
+    unsigned _bits;
+public:
+    static constexpr uint64_t writers_mask = 0xffffffff;
+    static constexpr uint64_t version_unit = writers_mask + 1;
+
+    // NOTE: Please make sure that count is a power of two.
+    explicit sequence_stripes(unsigned count)
+        : _stripes(new stripe[count])
+        , _bits(log2_of(count)) {
+        assert(count > 0 && (count & (count - 1)) == 0);
+        for (unsigned i = 0; i < count; i++) {
+            _stripes[i].word.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<uint64_t>& of(uint64_t region_id) const {
+        return _stripes[hash_of(region_id, _bits)].word;
+    }
+
+    // Called once regions [first_id, last_id] are locked for exclusive
+    // ownership, before they're written to.
+    void begin_write(uint64_t first_id, uint64_t last_id) {
+        assert(last_id - first_id < writers_mask); // assert writers can't carry into the version
+        for (uint64_t id = first_id; id <= last_id; id++) {
+            of(id).fetch_add(version_unit + 1, std::memory_order_relaxed);
+        }
+        // Orders the words before the writes to the regions.
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // Called before regions [first_id, last_id] are released from exclusive
+    // ownership.
+    void end_write(uint64_t first_id, uint64_t last_id) {
+        for (uint64_t id = first_id; id <= last_id; id++) {
+            of(id).fetch_add(version_unit - 1, std::memory_order_release);
+        }
+    }
+
+    // Sum of the words of regions [first_id, last_id], or false if any of
+    // them is being written.
+    bool read_begin(uint64_t first_id, uint64_t last_id, uint64_t& sum) const {
+        sum = 0;
+        for (uint64_t id = first_id; id <= last_id; id++) {
+            uint64_t word = of(id).load(std::memory_order_acquire);
+            if (word & writers_mask) {
+                return false;
+            }
+            sum += word;
+        }
+        return true;
+    }
+
+    bool read_validate(uint64_t first_id, uint64_t last_id, uint64_t sum) const {
+        // Orders the reads from the regions before the words.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t current = 0;
+        for (uint64_t id = first_id; id <= last_id; id++) {
+            current += of(id).load(std::memory_order_relaxed);
+        }
+        return current == sum;
+    }
+};
+
+/// Resource gate
+///
+/// Lets a thread lock the whole resource of a range lock in O(1), see
+/// basic_range_lock::lock_all(). Every other locker passes the gate first,
+/// adding the regions it locks, as a reader or not, to its thread's stripe,
+/// and whole-resource lockers take the gate's word, like a region mutex, and
+/// then wait for the counts they conflict with to drain. The word keeps out
+/// new lockers meanwhile: all of them for exclusive ownership of the
+/// resource, and all but readers for shared ownership.
+///
+/// Regions are counted rather than lockers, as a range may be released in
+/// parts. Threads sharing a stripe add to the same counts, so only the sum
+/// of the stripes means anything. Lockers which already hold regions pass the
+/// gate even when it's closed, such as when extending a range, otherwise
+/// they'd deadlock with the drain. So do threads holding regions of the gate
+/// while it's draining, like a thread locking a second range, and they're
+/// drained along. Those are told apart by a count of the regions each thread
+/// holds, kept in the thread per gate, which requires ranges to be released
+/// by the thread which locked them. Once the stripes drained, the draining
+/// flag is cleared, and lockers which got in meanwhile are drained again.
+class resource_gate {
+    static constexpr unsigned stripes = 64;
+    static constexpr uint32_t writer = 1U << 31;
+    static constexpr uint32_t parked = 1U << 30;
+    static constexpr uint32_t draining = 1U << 29;
+    static constexpr uint32_t readers = draining - 1;
+
+    struct stripe {
+        // Regions held by lockers other than readers, and by readers.
+        std::atomic<uint64_t> regions[2];
+        // Requests of the threads of the stripe, see count_request().
+        std::atomic<uint32_t> requests;
+        char padding[64 - 2 * sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<uint32_t>)];
+    };
+    stripe _stripes[stripes];
+    // Whether a thread was seen locking a range while holding another.
+    std::atomic<bool> _nested;
+    // Owners of the whole resource: the writer bit, or the number of readers.
+    std::atomic<uint32_t> _word;
+    // Whole-resource lockers waiting for the stripes to drain, and a counter
+    // they park on, bumped by lockers leaving meanwhile.
+    std::atomic<uint32_t> _drainers;
+    std::atomic<uint32_t> _drained;
+    // Bumped when the whole resource is locked and unlocked for exclusive
+    // ownership, so it's odd meanwhile, see basic_range_lock::read_begin().
+    std::atomic<uint64_t> _epoch;
+    // Key of the gate into the regions held by each thread, as addresses of
+    // destroyed gates are reused.
+    const uint64_t _id;
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id(0);
+        return id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Regions held by the calling thread, per gate id. Entries are dropped
+    // once back to zero, so a thread only keeps the gates it holds regions of.
+    typedef std::vector<std::pair<uint64_t, uint64_t>> thread_regions;
+
+    static thread_regions& regions_of_thread() {
+        static thread_local thread_regions regions;
+        return regions;
+    }
+
+    thread_regions::iterator find_thread_regions(thread_regions& regions) const {
+        return std::find_if(regions.begin(), regions.end(), [this] (const std::pair<uint64_t, uint64_t>& e) {
+            return e.first == this->_id;
+        });
+    }
+
+    bool held_by_thread() const {
+        auto& regions = regions_of_thread();
+        return find_thread_regions(regions) != regions.end();
+    }
+
+    void add_to_thread(uint64_t count) {
+        auto& regions = regions_of_thread();
+        auto it = find_thread_regions(regions);
+        if (it == regions.end()) {
+            regions.emplace_back(_id, count);
+        } else {
+            it->second += count;
+        }
+    }
+
+    void remove_from_thread(uint64_t count) {
+        auto& regions = regions_of_thread();
+        auto it = find_thread_regions(regions);
+        assert(it != regions.end() && it->second >= count); // assert range is released by the thread which locked it
+        if (it == regions.end()) {
+            return;
+        }
+        it->second -= std::min(it->second, count);
+        if (!it->second) {
+            *it = regions.back();
+            regions.pop_back();
+        }
+    }
+
+    static bool closed_to(uint32_t s, bool reader) {
+        return s & (reader ? writer : writer | readers);
+    }
+
+    std::atomic<uint64_t>& count_of(bool reader) {
+        return _stripes[thread_stripe(stripes)].regions[reader];
+    }
+
+    // Set the parked flag, unless the word changed from s already.
+    bool prepare_wait(uint32_t& s) {
+        if (!(s & parked) && !_word.compare_exchange_strong(s, s | parked, std::memory_order_relaxed)) {
+            return false;
+        }
+        s |= parked;
+        return true;
+    }
+
+    // Enter once the gate is open to reader, calling wait(s) whenever it's
+    // closed, until it returns false.
+    template <typename Wait>
+    bool generic_enter(bool reader, uint64_t regions, Wait&& wait) {
+        while (!try_enter(reader, regions)) {
+            uint32_t s = _word.load(std::memory_order_relaxed);
+            if (closed_to(s, reader) && prepare_wait(s) && !wait(s)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t held_regions(bool reader) const {
+        uint64_t sum = 0;
+        for (auto& s : _stripes) {
+            sum += s.regions[reader].load(std::memory_order_seq_cst);
+        }
+        return sum;
+    }
+
+    bool drained(bool shared) const {
+        return !held_regions(false) && (shared || !held_regions(true));
+    }
+
+    void wait_drained(bool shared) {
+        for (;;) {
+            uint32_t d = _drained.load(std::memory_order_seq_cst);
+            if (drained(shared)) {
+                break;
+            }
+            park(_drained, d);
+        }
+    }
+
+    // Wait for the regions conflicting with the whole resource locked for
+    // shared ownership, or exclusive ownership otherwise, to be released.
+    // Then stop letting threads holding regions in, and wait for the ones
+    // which got in meanwhile.
+    void drain(bool shared) {
+        _drainers.fetch_add(1, std::memory_order_seq_cst);
+        wait_drained(shared);
+        _word.fetch_and(~draining, std::memory_order_seq_cst);
+        wait_drained(shared);
+        _drainers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void leave(bool reader, uint64_t regions) {
+        count_of(reader).fetch_sub(regions, std::memory_order_seq_cst);
+        if (_drainers.load(std::memory_order_seq_cst)) {
+            _drained.fetch_add(1, std::memory_order_seq_cst);
+            unpark_all(_drained);
+        }
+    }
+
+    void wake_waiters(uint32_t s) {
+        if (s & parked) {
+            unpark_all(_word);
+        }
+    }
+public:
+    resource_gate() : _nested(false), _word(0), _drainers(0), _drained(0), _epoch(0), _id(next_id()) {
+        for (auto& s : _stripes) {
+            s.regions[0].store(0, std::memory_order_relaxed);
+            s.regions[1].store(0, std::memory_order_relaxed);
+            s.requests.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Whether the gate is closed to new lockers, readers or not. Only reads
+    // the word, so it can be checked within a hardware transaction.
+    bool closed_to(bool reader) const {
+        return closed_to(_word.load(std::memory_order_relaxed), reader);
+    }
+
+    bool try_enter(bool reader, uint64_t regions) {
+        auto& count = count_of(reader);
+        count.fetch_add(regions, std::memory_order_seq_cst);
+        uint32_t s = _word.load(std::memory_order_seq_cst);
+        bool nested = held_by_thread();
+        if (!closed_to(s, reader) || ((s & draining) && nested)) {
+            if (nested && !_nested.load(std::memory_order_relaxed)) {
+                _nested.store(true, std::memory_order_relaxed);
+            }
+            add_to_thread(regions);
+            return true;
+        }
+        leave(reader, regions);
+        return false;
+    }
+
+    bool nesting_seen() const {
+        return _nested.load(std::memory_order_relaxed);
+    }
+
+    // Count a request of the calling thread, and return how many its stripe
+    // counted, so one request out of many can be picked without a shared
+    // counter. Threads sharing a stripe may lose a count of each other.
+    uint32_t count_request() {
+        auto& requests = _stripes[thread_stripe(stripes)].requests;
+        uint32_t n = requests.load(std::memory_order_relaxed) + 1;
+        requests.store(n, std::memory_order_relaxed);
+        return n;
+    }
+
+    void enter(bool reader, uint64_t regions) {
+        generic_enter(reader, regions, [this] (uint32_t s) {
+            park(this->_word, s);
+            return true;
+        });
+    }
+
+    template <typename Clock, typename Duration>
+    bool enter_until(bool reader, uint64_t regions, const std::chrono::time_point<Clock, Duration>& deadline) {
+        return generic_enter(reader, regions, [this, &deadline] (uint32_t s) {
+            auto now = Clock::now();
+            if (now >= deadline) {
+                return false;
+            }
+            auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+            park_for(this->_word, s, std::max(timeout, std::chrono::nanoseconds(1)));
+            return true;
+        });
+    }
+
+    // Enter even if the gate is closed, for lockers already holding regions.
+    void pass(bool reader, uint64_t regions) {
+        count_of(reader).fetch_add(regions, std::memory_order_seq_cst);
+        add_to_thread(regions);
+    }
+
+    uint64_t epoch() const {
+        return _epoch.load(std::memory_order_acquire);
+    }
+
+    // Like sequence_stripes::begin_write() and end_write().
+    void begin_write() {
+        _epoch.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void end_write() {
+        _epoch.fetch_add(1, std::memory_order_release);
+    }
+
+    void exit(bool reader, uint64_t regions) {
+        remove_from_thread(regions);
+        leave(reader, regions);
+    }
+
+    void lock() {
+        uint32_t s = 0;
+        while (!_word.compare_exchange_weak(s, s | writer | draining, std::memory_order_acquire, std::memory_order_relaxed)) {
+            if (s & (writer | readers)) {
+                if (prepare_wait(s)) {
+                    park(_word, s);
+                }
+                s = _word.load(std::memory_order_relaxed) & parked;
+            }
+        }
+        drain(false);
+        begin_write();
+    }
+
+    bool try_lock() {
+        uint32_t s = _word.load(std::memory_order_relaxed);
+        do {
+            if (s & (writer | readers)) {
+                return false;
+            }
+        } while (!_word.compare_exchange_weak(s, s | writer, std::memory_order_acquire, std::memory_order_relaxed));
+        if (!drained(false)) {
+            wake_waiters(_word.exchange(0, std::memory_order_release));
+            return false;
+        }
+        begin_write();
+        return true;
+    }
+
+    void unlock() {
+        end_write();
+        wake_waiters(_word.exchange(0, std::memory_order_release));
+    }
+
+    // Only the reader closing the gate sets the draining flag, as the gate
+    // must not let anyone in once the readers before it drained.
+    void lock_shared() {
+        uint32_t s = 0;
+        while (!_word.compare_exchange_weak(s, (s & readers) ? s + 1 : (s + 1) | draining,
+                std::memory_order_acquire, std::memory_order_relaxed)) {
+            if (s & writer) {
+                if (prepare_wait(s)) {
+                    park(_word, s);
+                }
+                s = _word.load(std::memory_order_relaxed) & ~writer;
+            }
+        }
+        drain(true);
+    }
+
+    bool try_lock_shared() {
+        uint32_t s = _word.load(std::memory_order_relaxed);
+        do {
+            if (s & writer) {
+                return false;
+            }
+        } while (!_word.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed));
+        if (!drained(true)) {
+            unlock_shared();
+            return false;
+        }
+        return true;
+    }
+
+    // The last reader clears the parked flag and wakes waiters up, unless
+    // the word changed in between.
+    void unlock_shared() {
+        uint32_t s = _word.fetch_sub(1, std::memory_order_release) - 1;
+        if ((s & parked) && !(s & readers) && _word.compare_exchange_strong(s, s & ~parked, std::memory_order_relaxed)) {
+            unpark_all(_word);
+        }
+    }
+};
+
+}
+
+/// Counters of the elided critical sections of a range lock, see
+/// basic_range_lock::enable_lock_elision().
+struct lock_elision_stats {
+    // Transactions started, and how many of them committed or aborted.
+    uint64_t attempts = 0;
+    uint64_t commits = 0;
+    uint64_t aborts = 0;
+    // Times elision was suspended for aborting too often.
+    uint64_t suspensions = 0;
+};
+
+namespace range_lock_detail {
+
+/// Hardware lock elision
+///
+/// Runs critical sections within RTM transactions, instead of locking their
+/// regions: the transaction reads the words of the region mutexes, which
+/// must be free, so a thread locking any of them aborts it, and otherwise
+/// commits along with the critical section, as if the regions were locked.
+/// A transaction may abort for other reasons, like a conflict with another
+/// transaction, a critical section too big for the CPU's buffers or a
+/// system call, and the section is then run with the regions locked.
+///
+/// Aborts are counted over windows of window_size attempts. Elision is
+/// suspended for the next backoff sections of a window in which most
+/// attempts aborted, and backoff doubles each time, up to max_backoff, until
+/// a window mostly commits again. Counters, windows and backoff are kept per
+/// thread stripe, so threads eliding disjoint sections don't write to a
+/// shared cache line, and stats() adds the stripes up.
+///
+/// Support for RTM is checked at runtime with CPUID, and the instructions
+/// are encoded by hand, so no compiler flag is required.
+class lock_elision {
+    static constexpr unsigned max_retries = 3;
+    static constexpr uint32_t window_size = 256;
+    static constexpr uint32_t min_backoff = 1024;
+    static constexpr uint32_t max_backoff = 1U << 20;
+    // Code of explicit aborts, when the regions are busy or func() throws.
+    static constexpr unsigned char busy_code = 0xff;
+
+    static constexpr unsigned stripes = 64;
+
+    // Only written by the threads of the stripe, and read by stats().
+    struct stripe {
+        std::atomic<uint64_t> attempts{0};
+        std::atomic<uint64_t> commits{0};
+        std::atomic<uint64_t> suspensions{0};
+        std::atomic<uint32_t> window_attempts{0};
+        std::atomic<uint32_t> window_aborts{0};
+        std::atomic<uint32_t> skipped{0};
+        std::atomic<uint32_t> backoff{min_backoff};
+        char padding[64 - 3 * sizeof(std::atomic<uint64_t>) - 4 * sizeof(std::atomic<uint32_t>)];
+    };
+    unsigned _max_regions;
+    stripe _stripes[stripes];
+
+#if defined(__x86_64__) || defined(__i386__)
+    static constexpr unsigned started = ~0U;
+    static constexpr unsigned explicit_abort = 1U << 0;
+    static constexpr unsigned may_retry = 1U << 1;
+
+    static unsigned xbegin() {
+        unsigned status = started;
+        asm volatile(".byte 0xc7,0xf8 ; .long 0" : "+a" (status) :: "memory");
+        return status;
+    }
+
+    static void xend() {
+        asm volatile(".byte 0x0f,0x01,0xd5" ::: "memory");
+    }
+
+    static void xabort_busy() {
+        asm volatile(".byte 0xc6,0xf8,%P0" :: "i" (busy_code) : "memory");
+    }
+#endif
+
+    // Windows and backoff are updated with plain loads and stores, so
+    // threads sharing a stripe may lose an update of each other, which only
+    // shifts a window a little.
+    static bool suspended(stripe& s) {
+        uint32_t skipped = s.skipped.load(std::memory_order_relaxed);
+        if (!skipped) {
+            return false;
+        }
+        s.skipped.store(skipped - 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    static void record(stripe& s, bool committed) {
+        s.attempts.fetch_add(1, std::memory_order_relaxed);
+        uint32_t aborts = s.window_aborts.load(std::memory_order_relaxed);
+        if (committed) {
+            s.commits.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            s.window_aborts.store(++aborts, std::memory_order_relaxed);
+        }
+        uint32_t attempts = s.window_attempts.load(std::memory_order_relaxed) + 1;
+        if (attempts < window_size) {
+            s.window_attempts.store(attempts, std::memory_order_relaxed);
+            return;
+        }
+        s.window_attempts.store(0, std::memory_order_relaxed);
+        s.window_aborts.store(0, std::memory_order_relaxed);
+        if (aborts * 2 <= window_size) {
+            s.backoff.store(min_backoff, std::memory_order_relaxed);
+            return;
+        }
+        uint32_t backoff = s.backoff.load(std::memory_order_relaxed);
+        s.skipped.store(backoff, std::memory_order_relaxed);
+        s.backoff.store(std::min(backoff * 2, max_backoff), std::memory_order_relaxed);
+        s.suspensions.fetch_add(1, std::memory_order_relaxed);
+    }
+public:
+    explicit lock_elision(unsigned max_regions) : _max_regions(max_regions) {
+        assert(max_regions > 0);
+    }
+
+    // Whether the CPU supports RTM, which most recent ones have disabled.
+    static bool supported() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx) || eax < 7) {
+            return false;
+        }
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return ebx & (1U << 11);
+#else
+        return false;
+#endif
+    }
+
+    // Longest range, in regions, whose critical sections are elided.
+    unsigned max_regions() const { return _max_regions; }
+
+    // Run func() within a transaction, once regions_free() returns true in it.
+    // Returns false, with no effect of func() left, if no transaction
+    // committed, and func() must then run with the regions locked.
+    template <typename RegionsFree, typename Func>
+    bool run(RegionsFree&& regions_free, Func& func) {
+#if defined(__x86_64__) || defined(__i386__)
+        stripe& s = _stripes[thread_stripe(stripes)];
+        if (suspended(s)) {
+            return false;
+        }
+        for (unsigned i = 0; i < max_retries; i++) {
+            unsigned status = xbegin();
+            if (status == started) {
+                if (!regions_free()) {
+                    xabort_busy();
+                }
+                // Unwinding out of the transaction would leave it open, so
+                // a throwing func() is aborted, and throws again locked.
+                try {
+                    func();
+                } catch (...) {
+                    xabort_busy();
+                }
+                xend();
+                record(s, true);
+                return true;
+            }
+            record(s, false);
+            if ((status & explicit_abort) || !(status & may_retry)) {
+                break;
+            }
+        }
+#else
+        (void)regions_free;
+        (void)func;
+#endif
+        return false;
+    }
+
+    lock_elision_stats stats() const {
+        lock_elision_stats st;
+        for (auto& s : _stripes) {
+            st.attempts += s.attempts.load(std::memory_order_relaxed);
+            st.commits += s.commits.load(std::memory_order_relaxed);
+            st.suspensions += s.suspensions.load(std::memory_order_relaxed);
+        }
+        st.aborts = st.attempts - st.commits;
+        return st;
+    }
+};
+
+// Whether the regions of Table can be found, and their mutexes checked,
+// without writing anything, as lock elision requires.
+template <typename Table, typename = void>
+struct supports_lock_elision : std::false_type {};
+
+template <typename Table>
+struct supports_lock_elision<Table,
+        decltype(void(std::declval<Table&>().get_region(0).mutex.would_block(true)))> : std::true_type {};
+
+// Whether the memory of Table follows its live regions, and can be given
+// back once they're fewer, as a footprint target requires.
+template <typename Table, typename = void>
+struct supports_footprint_target : std::false_type {};
+
+template <typename Table>
+struct supports_footprint_target<Table,
+        decltype(void(std::declval<Table&>().footprint()), void(std::declval<Table&>().trim()))> : std::true_type {};
+
+}
+
+#ifdef RANGE_LOCK_STATS
+/// \brief Range lock statistics
+///
+/// Snapshot of the contention and hold time counters of a range lock, see
+/// basic_range_lock::stats(). Only available when compiled with
+/// RANGE_LOCK_STATS defined; otherwise no counter is kept at all.
+/// Time histograms are in nanoseconds, indexed by the log2 of the value, so
+/// bucket i counts requests in [2^i, 2^(i+1)).
+struct range_lock_stats {
+    static constexpr unsigned buckets = 64;
+
+    struct mode_stats {
+        uint64_t acquisitions = 0;
+        // Failed try_lock() and timed out try_lock_for()/try_lock_until().
+        uint64_t try_lock_failures = 0;
+        // Time from the request to the acquisition of its whole range.
+        uint64_t wait_ns[buckets] = {};
+        // Time from the acquisition of a range to its release, for ranges
+        // released by the thread which acquired them.
+        uint64_t hold_ns[buckets] = {};
+    };
+
+    struct hot_region {
+        uint64_t region_id;
+        // Approximate number of acquisitions which found the region busy.
+        uint64_t contended_acquisitions;
+    };
+
+    mode_stats exclusive;
+    mode_stats shared;
+    region_table_stats table;
+    // Most contended regions, hottest first.
+    std::vector<hot_region> hottest_regions;
+};
+
+namespace range_lock_detail {
+
+/// Top regions by contention, tracked with the Misra-Gries heavy hitters
+/// algorithm, so memory is bounded by capacity however many regions contend.
+/// Only contended acquisitions are recorded, which are about to wait anyway,
+/// so a mutex is fine.
+class hot_region_tracker {
+    static constexpr size_t capacity = 256;
+    mutable std::mutex _lock;
+    std::unordered_map<uint64_t, uint64_t> _counts;
+public:
+    void record(uint64_t region_id) {
+        std::lock_guard<std::mutex> lock(_lock);
+        auto it = _counts.find(region_id);
+        if (it != _counts.end()) {
+            it->second++;
+        } else if (_counts.size() < capacity) {
+            _counts.emplace(region_id, 1);
+        } else {
+            for (auto i = _counts.begin(); i != _counts.end();) {
+                i = --i->second ? std::next(i) : _counts.erase(i);
+            }
+        }
+    }
+
+    std::vector<range_lock_stats::hot_region> top(size_t n) const {
+        std::vector<range_lock_stats::hot_region> regions;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            for (auto& e : _counts) {
+                regions.push_back(range_lock_stats::hot_region{e.first, e.second});
+            }
+        }
+        std::sort(regions.begin(), regions.end(), [] (const range_lock_stats::hot_region& a,
+                const range_lock_stats::hot_region& b) {
+            return a.contended_acquisitions > b.contended_acquisitions
+                || (a.contended_acquisitions == b.contended_acquisitions && a.region_id < b.region_id);
+        });
+        if (regions.size() > n) {
+            regions.resize(n);
+        }
+        return regions;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(_lock);
+        _counts.clear();
+    }
+};
+
+/// Counters behind range_lock_stats, updated with relaxed atomic increments.
+/// Hold times are measured by remembering, per thread, when each range held
+/// by the thread was acquired.
+class lock_stats {
+    typedef std::chrono::steady_clock clock;
+
+    struct mode_counters {
+        std::atomic<uint64_t> acquisitions;
+        std::atomic<uint64_t> try_lock_failures;
+        std::atomic<uint64_t> wait_ns[range_lock_stats::buckets];
+        std::atomic<uint64_t> hold_ns[range_lock_stats::buckets];
+
+        void reset() {
+            acquisitions.store(0, std::memory_order_relaxed);
+            try_lock_failures.store(0, std::memory_order_relaxed);
+            for (unsigned i = 0; i < range_lock_stats::buckets; i++) {
+                wait_ns[i].store(0, std::memory_order_relaxed);
+                hold_ns[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void snapshot(range_lock_stats::mode_stats& st) const {
+            st.acquisitions = acquisitions.load(std::memory_order_relaxed);
+            st.try_lock_failures = try_lock_failures.load(std::memory_order_relaxed);
+            for (unsigned i = 0; i < range_lock_stats::buckets; i++) {
+                st.wait_ns[i] = wait_ns[i].load(std::memory_order_relaxed);
+                st.hold_ns[i] = hold_ns[i].load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    struct held_range {
+        const lock_stats* owner;
+        uint64_t offset;
+        uint64_t length;
+        bool shared;
+        clock::time_point since;
+    };
+    // Ranges released by another thread are never matched, so the oldest
+    // entries are dropped beyond this.
+    static constexpr size_t max_held_ranges = 256;
+
+    mode_counters _modes[2];
+    hot_region_tracker _hot_regions;
+
+    static std::vector<held_range>& local_held_ranges() {
+        static thread_local std::vector<held_range> ranges;
+        return ranges;
+    }
+
+    static void record_time(std::atomic<uint64_t> (&histogram)[range_lock_stats::buckets], clock::duration d) {
+        uint64_t ns = uint64_t(std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(),
+            std::chrono::nanoseconds::rep(1)));
+        histogram[log2_floor(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+public:
+    lock_stats() {
+        reset();
+    }
+
+    void reset() {
+        _modes[0].reset();
+        _modes[1].reset();
+        _hot_regions.reset();
+    }
+
+    static clock::time_point now() {
+        return clock::now();
+    }
+
+    void record_contention(uint64_t region_id) {
+        _hot_regions.record(region_id);
+    }
+
+    void record_try_lock_failure(bool shared) {
+        _modes[shared].try_lock_failures.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Records the acquisition of [offset, offset+length), requested at start.
+    void record_acquisition(uint64_t offset, uint64_t length, bool shared, clock::time_point start) {
+        clock::time_point t = now();
+        mode_counters& m = _modes[shared];
+        m.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        record_time(m.wait_ns, t - start);
+        std::vector<held_range>& held = local_held_ranges();
+        if (held.size() == max_held_ranges) {
+            held.erase(held.begin());
+        }
+        held.push_back(held_range{this, offset, length, shared, t});
+    }
+
+    void record_release(uint64_t offset, uint64_t length, bool shared) {
+        std::vector<held_range>& held = local_held_ranges();
+        for (size_t i = held.size(); i-- > 0;) {
+            held_range& h = held[i];
+            if (h.owner == this && h.offset == offset && h.length == length && h.shared == shared) {
+                record_time(_modes[shared].hold_ns, now() - h.since);
+                held.erase(held.begin() + i);
+                return;
+            }
+        }
+    }
+
+    // Ownership of a held range changed in place, so it's released in the new
+    // mode; the hold time keeps running.
+    void record_transition(uint64_t offset, uint64_t length, bool shared, bool new_shared) {
+        std::vector<held_range>& held = local_held_ranges();
+        for (size_t i = held.size(); i-- > 0;) {
+            held_range& h = held[i];
+            if (h.owner == this && h.offset == offset && h.length == length && h.shared == shared) {
+                h.shared = new_shared;
+                return;
+            }
+        }
+    }
+
+    // A held range grew in place; the hold time keeps running.
+    void record_extension(uint64_t offset, uint64_t length, bool shared, uint64_t new_length) {
+        std::vector<held_range>& held = local_held_ranges();
+        for (size_t i = held.size(); i-- > 0;) {
+            held_range& h = held[i];
+            if (h.owner == this && h.offset == offset && h.length == length && h.shared == shared) {
+                h.length = new_length;
+                return;
+            }
+        }
+    }
+
+    // Part of a held range was released. What's left of it, before or after
+    // the part, keeps the time the range was acquired at.
+    void record_part_release(uint64_t offset, uint64_t length, bool shared,
+            uint64_t part_offset, uint64_t part_length) {
+        std::vector<held_range>& held = local_held_ranges();
+        for (size_t i = held.size(); i-- > 0;) {
+            held_range& h = held[i];
+            if (h.owner == this && h.offset == offset && h.length == length && h.shared == shared) {
+                uint64_t tail_offset = part_offset + part_length;
+                uint64_t tail_length = offset + length - tail_offset;
+                clock::time_point since = h.since;
+                if (part_offset > offset) {
+                    h.length = part_offset - offset;
+                } else if (tail_length) {
+                    h.offset = tail_offset;
+                    h.length = tail_length;
+                    return;
+                } else {
+                    record_time(_modes[shared].hold_ns, now() - since);
+                    held.erase(held.begin() + i);
+                    return;
+                }
+                if (tail_length && held.size() < max_held_ranges) {
+                    held.push_back(held_range{this, tail_offset, tail_length, shared, since});
+                }
+                return;
+            }
+        }
+    }
+
+    void snapshot(range_lock_stats& st, size_t top_regions) const {
+        _modes[0].snapshot(st.exclusive);
+        _modes[1].snapshot(st.shared);
+        st.hottest_regions = _hot_regions.top(top_regions);
+    }
+};
+
+}
+#endif
+
+/// Range [offset, offset+length) of a shared resource, as given to the
+/// vectored lock functions, like basic_range_lock::lock_ranges().
+struct byte_range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/// \brief Range lock class
+///
+/// Utility created to control access to specific regions of a shared resource,
+/// such as a buffer or a file. Think of it as byte-range locking mechanism.
+///
+/// This implementation works by virtually dividing the shared resource into N
+/// regions of the same size, and associating an id with each region.
+/// A region is the unit to be individually protected from concurrent access.
+///
+/// Choosing an optimal region size:
+/// The smaller the region size, the more regions exists.
+/// The more regions exists, the finer grained the locking is.
+/// If in doubt, use range_lock::create_range_lock(). It will choose a region
+/// size for you.
+///
+/// How locking does work with range_lock?
+/// A lock request may cover more than one region, so there is a need to wait
+/// for each covered region to be available. Deadlock is avoided by always
+/// locking regions in sequential order.
+/// Covered regions are looked up in batches of consecutive ids, so the table
+/// is only visited once per batch; release is done the same way.
+/// A held range can be grown with extend() and partly released with
+/// unlock_part(), which only lock or release the regions that change.
+/// Several ranges can be locked together with lock_ranges(), which merges
+/// the regions they cover, so they're still locked in sequential order.
+/// lock_guarded() and lock_shared_guarded() return a guard releasing the
+/// range, which keeps the regions found when locking, so release doesn't
+/// look them up again.
+///
+/// Optimistic reads:
+/// Once enable_optimistic_reads() is called, short ranges can also be read
+/// without locking them, seqlock style, see read_begin().
+///
+/// Whole-resource locks:
+/// Once enable_whole_resource_locks() is called, lock_all() and
+/// lock_all_shared() lock the whole resource at once, waiting for the ranges
+/// in flight to be released, rather than every region covering it.
+///
+/// Memory footprint:
+/// footprint() reports the live regions and the memory held by the table.
+/// With set_footprint_target(), the granularity is made coarser whenever the
+/// table outgrows the target and no range is held, so that fewer, bigger
+/// regions cover the resource, see region_size(). The target isn't a bound:
+/// the table outgrows it as long as ranges are held.
+///
+/// This implementation is resource efficient because it will only keep alive
+/// data for the regions being used at the moment. That's done with a simple
+/// reference count management.
+///
+/// Live regions are kept by a region table, which is a template parameter:
+/// sharded_region_table is the default one, see range_lock below, and
+/// lockfree_region_table is an alternative in which uncontended locking
+/// doesn't take any mutex other than the regions' own. For resources of a
+/// bounded size, dense_region_table keeps all regions in a flat array, see
+/// dense_range_lock below.
+/// Tables are parameterized by the mutex of a region, compact_region_mutex
+/// by default, std_region_mutex for std::shared_timed_mutex, or
+/// fair_region_mutex to grant each region in arrival order, so that writers
+/// aren't starved by readers, see fair_range_lock below.
+///
+/// Instrumentation:
+/// When compiled with RANGE_LOCK_STATS defined, acquisitions, try_lock
+/// failures, wait and hold times per mode, table statistics and the most
+/// contended regions are counted, see stats(). Otherwise nothing is counted
+/// and stats() doesn't exist.
+///
+/// Auto-tuning the region size:
+/// enable_sampling() records the length of lock requests, and whether they
+/// conflicted, into a workload_profile, which recommends a region size for
+/// the observed workload. A new range lock can be created from it with
+/// create_range_lock(resource_size, profile).
+template <typename Table>
+class basic_range_lock {
+private:
+    typedef typename Table::region region;
+    static constexpr unsigned region_batch_bits = Table::batch_bits;
+    static constexpr unsigned region_batch_size = Table::batch_size;
+
+    Table _table;
+    const uint64_t _region_size;
+    range_lock_detail::workload_sampler _sampler;
+    std::unique_ptr<range_lock_detail::sequence_stripes> _sequences;
+    std::unique_ptr<range_lock_detail::lock_elision> _elision;
+    std::unique_ptr<range_lock_detail::resource_gate> _gate;
+    // Low bits dropped from region ids once the footprint target was hit, so
+    // that 2^_coarsening regions make a super-region, see
+    // set_footprint_target(). Only changed with the whole resource locked.
+    std::atomic<unsigned> _coarsening{0};
+    uint64_t _footprint_target = 0;
+    // Footprint left by the last coarsening, which the table must outgrow to
+    // be coarsened again.
+    std::atomic<uint64_t> _coarsened_bytes{0};
+#ifdef RANGE_LOCK_STATS
+    range_lock_detail::lock_stats _stats;
+#endif
+public:
+    basic_range_lock() = delete;
+    basic_range_lock& operator=(const basic_range_lock&) = delete;
+    basic_range_lock(const basic_range_lock&) = delete;
+    basic_range_lock(basic_range_lock&&) = default;
+
+    // NOTE: Please make sure that region_size is greater than zero and power
+    // of two. Use std::pow(2, exp) to generate a proper region size.
+    // Any other argument is forwarded to the constructor of the region table.
+    template <typename... TableArgs>
+    explicit basic_range_lock(uint64_t region_size, TableArgs&&... table_args)
+        : _table(std::forward<TableArgs>(table_args)...)
+        , _region_size(region_size) {
+        assert(region_size > 0);
+        assert((region_size & (region_size - 1)) == 0);
+    }
+
+    // Create a range_lock with a region size, which is calculated based on the
+    // size of resource to be protected.
+    // For example, if you want to protect a file, call create_range_lock()
+    // with the size of that file.
+    static std::unique_ptr<basic_range_lock> create_range_lock(uint64_t resource_size) {
+        uint64_t region_size = region_size_for(resource_size);
+        return static_cast<std::unique_ptr<basic_range_lock>>(new basic_range_lock(region_size));
+    }
+
+    // Create a range_lock with the region size recommended by a profile of the
+    // workload, usually taken from another range_lock protecting the same kind
+    // of resource. Falls back to create_range_lock(resource_size) if the profile
+    // is empty.
+    static std::unique_ptr<basic_range_lock> create_range_lock(uint64_t resource_size,
+            const workload_profile& profile) {
+        uint64_t region_size = profile.recommended_region_size();
+        if (!region_size) {
+            return create_range_lock(resource_size);
+        }
+        return static_cast<std::unique_ptr<basic_range_lock>>(new basic_range_lock(region_size));
+    }
+
+    // Region size chosen by create_range_lock() for a resource of the given size.
+    static uint64_t region_size_for(uint64_t resource_size) {
+        auto res = std::ceil(std::log2(resource_size) * 0.5);
+        auto exp = std::max(uint64_t(res), uint64_t(10));
+        return uint64_t(std::pow(2, exp));
+    }
+private:
+    inline uint64_t get_region_id(uint64_t offset) const {
+        return (offset / _region_size) >> _coarsening.load(std::memory_order_relaxed);
+    }
+
+    // Regions are merged coarsening_step bits at a time, checked on one
+    // request of each thread out of footprint_check_interval.
+    static constexpr unsigned coarsening_step = 6;
+    static constexpr unsigned footprint_check_interval = 256;
+
+    enum class stop_iteration { no, yes };
+
+    // Ownership modes, so the per-region loops below are specialized for each
+    // mode at compile time.
+    struct exclusive_ownership {
+        static constexpr bool shared = false;
+        static void lock(region& r) { r.mutex.lock(); }
+        static bool try_lock(region& r) { return r.mutex.try_lock(); }
+        template <typename TimePoint>
+        static bool try_lock_until(region& r, const TimePoint& deadline) { return r.mutex.try_lock_until(deadline); }
+        static void unlock(region& r) { r.mutex.unlock(); }
+    };
+    struct shared_ownership {
+        static constexpr bool shared = true;
+        static void lock(region& r) { r.mutex.lock_shared(); }
+        static bool try_lock(region& r) { return r.mutex.try_lock_shared(); }
+        template <typename TimePoint>
+        static bool try_lock_until(region& r, const TimePoint& deadline) { return r.mutex.try_lock_shared_until(deadline); }
+        static void unlock(region& r) { r.mutex.unlock_shared(); }
+    };
+    // Counted as shared ownership by statistics.
+    struct upgradeable_ownership {
+        static constexpr bool shared = true;
+        static void lock(region& r) { r.mutex.lock_upgrade(); }
+        static bool try_lock(region& r) { return r.mutex.try_lock_upgrade(); }
+        static void unlock(region& r) { r.mutex.unlock_upgrade(); }
+    };
+
+    // Movable owner of a range locked in Mode, which is released on
+    // destruction, see lock_guarded(). The regions resolved when locking are
+    // kept, in place for small ranges, so that release doesn't look them up
+    // again. Ranges of more than max_cached_regions are released by id.
+    template <typename Mode>
+    class basic_guard {
+        static constexpr uint64_t inline_regions = 8;
+        static constexpr uint64_t max_cached_regions = 4096;
+
+        basic_range_lock* _lock = nullptr;
+        uint64_t _offset = 0;
+        uint64_t _length = 0;
+        uint64_t _region_count = 0;
+        region** _regions = nullptr;
+        region* _inline_regions[inline_regions];
+        std::unique_ptr<region*[]> _heap_regions;
+
+        friend class basic_range_lock;
+
+        // Storage for the regions of a range about to be locked.
+        basic_guard(uint64_t offset, uint64_t length, uint64_t region_count)
+            : _offset(offset)
+            , _length(length)
+            , _region_count(region_count) {
+            if (region_count <= inline_regions) {
+                _regions = _inline_regions;
+            } else if (region_count <= max_cached_regions) {
+                _heap_regions.reset(new region*[region_count]);
+                _regions = _heap_regions.get();
+            }
+        }
+
+        void move_from(basic_guard& other) {
+            _lock = other._lock;
+            _offset = other._offset;
+            _length = other._length;
+            _region_count = other._region_count;
+            if (other._regions == other._inline_regions) {
+                std::copy(other._inline_regions, other._inline_regions + _region_count, _inline_regions);
+                _regions = _inline_regions;
+            } else {
+                _heap_regions = std::move(other._heap_regions);
+                _regions = _heap_regions.get();
+            }
+            other._lock = nullptr;
+            other._regions = nullptr;
+        }
+    public:
+        basic_guard() = default;
+
+        basic_guard(basic_guard&& other) noexcept {
+            move_from(other);
+        }
+
+        basic_guard& operator=(basic_guard&& other) noexcept {
+            if (this != &other) {
+                unlock();
+                move_from(other);
+            }
+            return *this;
+        }
+
+        ~basic_guard() {
+            unlock();
+        }
+
+        bool owns_lock() const { return _lock != nullptr; }
+        explicit operator bool() const { return owns_lock(); }
+        uint64_t offset() const { return _offset; }
+        uint64_t length() const { return _length; }
+
+        // Release the range before the guard is destroyed, if still owned.
+        void unlock() {
+            if (_lock) {
+                _lock->release_guarded<Mode>(_offset, _length, _regions);
+                _lock = nullptr;
+            }
+        }
+    };
+
+    // Call f for each batch of regions in [first_id, last_id], in ascending
+    // order of region id.
+    template <typename Func>
+    void for_each_batch(uint64_t first_id, uint64_t last_id, Func&& f) {
+        for (uint64_t id = first_id;;) {
+            uint64_t batch_last_id = id | (region_batch_size - 1);
+            unsigned count = unsigned(std::min(batch_last_id, last_id) - id + 1);
+            stop_iteration stop = f(id, count);
+            if (stop == stop_iteration::yes || id + count - 1 == last_id) {
+                return;
+            }
+            id += count;
+        }
+    }
+
+    // Call f for each batch of regions covered by range [offset, offset+length),
+    // in ascending order of region id.
+    template <typename Func>
+    void for_each_region_batch(uint64_t offset, uint64_t length, Func&& f) {
+        for_each_batch(get_region_id(offset), get_region_id(offset + length - 1), std::forward<Func>(f));
+    }
+
+    static inline void validate_parameters(uint64_t offset, uint64_t length) {
+        assert(length > 0);
+        assert(offset < (offset + length)); // check for overflow
+    }
+
+    // Lock regions [first_id, last_id] in Mode, pinning each batch of regions
+    // with a single table pass, and then waiting for the regions' mutexes in
+    // order. If pinned isn't null, regions are stored into it, see
+    // basic_guard.
+    template <typename Mode>
+    void lock_regions(uint64_t first_id, uint64_t last_id, region** pinned = nullptr) {
+        for_each_batch(first_id, last_id, [this, first_id, pinned] (uint64_t batch_first_id, unsigned count) {
+            region* batch[region_batch_size];
+            region** regions = pinned ? pinned + (batch_first_id - first_id) : batch;
+            this->_table.pin(batch_first_id, count, regions);
+            for (unsigned i = 0; i < count; i++) {
+                this->lock_region<Mode>(*regions[i], batch_first_id + i);
+            }
+            return stop_iteration::no;
+        });
+    }
+
+    // Tries to lock regions [first_id, last_id] in ascending order, calling
+    // try_lock on each one. On failure, the regions locked so far are
+    // released, and the id of the failed one is stored in failed_region_id.
+    template <typename Mode, typename TryLock>
+    bool try_lock_regions(uint64_t first_id, uint64_t last_id, TryLock&& try_lock, uint64_t& failed_region_id,
+            region** pinned = nullptr) {
+        bool failed_to_lock_region = false;
+        for_each_batch(first_id, last_id, [&] (uint64_t batch_first_id, unsigned count) {
+            region* batch[region_batch_size];
+            region** regions = pinned ? pinned + (batch_first_id - first_id) : batch;
+            this->_table.pin(batch_first_id, count, regions);
+            for (unsigned i = 0; i < count; i++) {
+                if (!try_lock(*regions[i])) {
+                    failed_to_lock_region = true;
+                    failed_region_id = batch_first_id + i;
+                    this->_table.unpin(batch_first_id + i, count - i, [] (region&) {});
+                    return stop_iteration::yes;
+                }
+            }
+            return stop_iteration::no;
+        });
+        if (failed_to_lock_region && failed_region_id > first_id) {
+            unlock_regions<Mode>(first_id, failed_region_id - 1);
+        }
+        return !failed_to_lock_region;
+    }
+
+    // Release regions [first_id, last_id] which are locked in Mode.
+    template <typename Mode>
+    void unlock_regions(uint64_t first_id, uint64_t last_id) {
+        for_each_batch(first_id, last_id, [this] (uint64_t batch_first_id, unsigned count) {
+            this->_table.unpin(batch_first_id, count, Mode::unlock);
+            return stop_iteration::no;
+        });
+    }
+
+    void sample(uint64_t offset, uint64_t length, bool conflict) {
+        uint64_t regions = get_region_id(offset + length - 1) - get_region_id(offset) + 1;
+        _sampler.record(length, regions, conflict);
+    }
+
+    // Optimistic readers are told about writes to regions locked for
+    // exclusive ownership, if enabled, see enable_optimistic_reads().
+    template <typename Mode>
+    void begin_write(uint64_t first_id, uint64_t last_id) {
+        if (!Mode::shared && _sequences) {
+            _sequences->begin_write(first_id, last_id);
+        }
+    }
+
+    template <typename Mode>
+    void end_write(uint64_t first_id, uint64_t last_id) {
+        if (!Mode::shared && _sequences) {
+            _sequences->end_write(first_id, last_id);
+        }
+    }
+
+    // Passing the resource gate, if whole-resource locks are enabled, see
+    // enable_whole_resource_locks(). Only readers are let in by a lock of the
+    // whole resource for shared ownership, and upgradeable owners aren't
+    // readers, since they're upgraded in place.
+    template <typename Mode>
+    static constexpr bool gate_reader() {
+        return std::is_same<Mode, shared_ownership>::value;
+    }
+
+    struct no_deadline {};
+
+    uint64_t region_count(uint64_t offset, uint64_t length) const {
+        return get_region_id(offset + length - 1) - get_region_id(offset) + 1;
+    }
+
+    // Enter the gate with enter(regions), for the regions counted by count(),
+    // unless enter() returns false. Region ids only stay the same inside the
+    // gate, so regions are counted again if the granularity changed before
+    // getting in, see set_footprint_target().
+    template <typename Mode, typename Count, typename Enter>
+    bool enter_gate_with(Count& count, Enter&& enter) {
+        for (;;) {
+            unsigned coarsening = _coarsening.load(std::memory_order_relaxed);
+            uint64_t regions = count();
+            check_footprint(regions);
+            if (!enter(regions)) {
+                return false;
+            }
+            if (_coarsening.load(std::memory_order_relaxed) == coarsening) {
+                return true;
+            }
+            _gate->exit(gate_reader<Mode>(), regions);
+        }
+    }
+
+    template <typename Mode, typename Count>
+    void enter_gate(Count&& count) {
+        if (_gate) {
+            enter_gate_with<Mode>(count, [this] (uint64_t regions) {
+                this->_gate->enter(gate_reader<Mode>(), regions);
+                return true;
+            });
+        }
+    }
+
+    template <typename Mode, typename Count>
+    bool try_enter_gate(Count&& count, no_deadline) {
+        return !_gate || enter_gate_with<Mode>(count, [this] (uint64_t regions) {
+            return this->_gate->try_enter(gate_reader<Mode>(), regions);
+        });
+    }
+
+    template <typename Mode, typename Count, typename Clock, typename Duration>
+    bool try_enter_gate(Count&& count, const std::chrono::time_point<Clock, Duration>& deadline) {
+        return !_gate || enter_gate_with<Mode>(count, [this, &deadline] (uint64_t regions) {
+            return this->_gate->enter_until(gate_reader<Mode>(), regions, deadline);
+        });
+    }
+
+    // Whether a table holding bytes would hold more than target with regions
+    // more.
+    static bool over_target(uint64_t bytes, uint64_t regions, uint64_t target) {
+        return bytes > target || regions > (target - bytes) / sizeof(region);
+    }
+
+    // Coarsen the granularity if the table holds more than the footprint
+    // target, or would with a request of regions more, see
+    // set_footprint_target(). Requests of many regions are always checked.
+    void check_footprint(uint64_t regions) {
+        check_footprint(regions, range_lock_detail::supports_footprint_target<Table>());
+    }
+
+    void check_footprint(uint64_t, std::false_type) {}
+
+    void check_footprint(uint64_t regions, std::true_type) {
+        if (!_footprint_target) {
+            return;
+        }
+        if (regions < _footprint_target / sizeof(region) / footprint_check_interval
+                && _gate->count_request() % footprint_check_interval) {
+            return;
+        }
+        uint64_t target = std::max(_footprint_target, _coarsened_bytes.load(std::memory_order_relaxed));
+        if (over_target(_table.footprint().bytes, regions, target)) {
+            coarsen(regions);
+        }
+    }
+
+    // Give back the memory of the regions, and merge them into super-regions,
+    // coarsening_step bits at a time, until a request of regions would fit
+    // the footprint target. That's done with the whole resource locked, so
+    // it's given up on if any range is held, like one of the calling thread.
+    // It's never done once a thread was seen holding two ranges at once,
+    // which could come to share a super-region.
+    void coarsen(uint64_t regions) {
+        if (_gate->nesting_seen() || !_gate->try_lock()) {
+            return;
+        }
+        unsigned coarsening = _coarsening.load(std::memory_order_relaxed);
+        unsigned max_coarsening = 63 - range_lock_detail::log2_of(_region_size);
+        _table.trim();
+        uint64_t bytes = _table.footprint().bytes;
+        while (coarsening < max_coarsening) {
+            coarsening = std::min(coarsening + coarsening_step, max_coarsening);
+            regions = (regions >> coarsening_step) + 1;
+            if (!over_target(bytes, regions, _footprint_target)) {
+                break;
+            }
+        }
+        _coarsened_bytes.store(bytes, std::memory_order_relaxed);
+        _coarsening.store(coarsening, std::memory_order_relaxed);
+        _gate->unlock();
+    }
+
+    // For regions locked by a range already holding others.
+    template <typename Mode>
+    void pass_gate(uint64_t regions) {
+        if (_gate) {
+            _gate->pass(gate_reader<Mode>(), regions);
+        }
+    }
+
+    template <typename Mode>
+    void exit_gate(uint64_t regions) {
+        if (_gate) {
+            _gate->exit(gate_reader<Mode>(), regions);
+        }
+    }
+
+    // Run func() in Mode with its range elided, if enabled, see
+    // enable_lock_elision(). Elided writes don't bump the versions of
+    // optimistic reads, so nothing is elided while they're enabled.
+    template <typename Mode, typename Func>
+    bool elide(uint64_t offset, uint64_t length, Func& func) {
+        return elide<Mode>(offset, length, func, range_lock_detail::supports_lock_elision<Table>());
+    }
+
+    template <typename Mode, typename Func>
+    bool elide(uint64_t, uint64_t, Func&, std::false_type) {
+        return false;
+    }
+
+    template <typename Mode, typename Func>
+    bool elide(uint64_t offset, uint64_t length, Func& func, std::true_type) {
+        if (!_elision || _sequences) {
+            return false;
+        }
+        validate_parameters(offset, length);
+        unsigned coarsening = _coarsening.load(std::memory_order_relaxed);
+        uint64_t first_id = get_region_id(offset);
+        uint64_t last_id = get_region_id(offset + length - 1);
+        if (last_id - first_id >= _elision->max_regions()) {
+            return false;
+        }
+        return _elision->run([this, coarsening, first_id, last_id] {
+            if (this->_gate && (this->_gate->closed_to(gate_reader<Mode>())
+                    || this->_coarsening.load(std::memory_order_relaxed) != coarsening)) {
+                return false;
+            }
+            for (uint64_t id = first_id; id <= last_id; id++) {
+                if (this->_table.get_region(id).mutex.would_block(Mode::shared)) {
+                    return false;
+                }
+            }
+            return true;
+        }, func);
+    }
+
+    // Regions are locked in ascending order, so on failure the regions locked
+    // so far are the contiguous range that precedes the failed one.
+    // try_lock is called on each region, and the request is given up on as
+    // soon as it returns false.
+    // The resource gate is waited for until deadline, if given.
+    template <typename Mode, typename TryLock, typename Deadline = no_deadline>
+    bool generic_try_lock(uint64_t offset, uint64_t length, TryLock&& try_lock, region** pinned = nullptr,
+            const Deadline& deadline = Deadline()) {
+        uint64_t failed_region_id = 0;
+
+        validate_parameters(offset, length);
+#ifdef RANGE_LOCK_STATS
+        auto start = _stats.now();
+#endif
+        auto count = [this, offset, length] { return this->region_count(offset, length); };
+        if (!try_enter_gate<Mode>(count, deadline)) {
+#ifdef RANGE_LOCK_STATS
+            _stats.record_try_lock_failure(Mode::shared);
+#endif
+            return false;
+        }
+        bool sampled = _sampler.should_sample();
+        bool failed_to_lock_region = !try_lock_regions<Mode>(get_region_id(offset),
+            get_region_id(offset + length - 1), try_lock, failed_region_id, pinned);
+        if (!failed_to_lock_region) {
+            begin_write<Mode>(get_region_id(offset), get_region_id(offset + length - 1));
+        } else {
+            exit_gate<Mode>(region_count(offset, length));
+        }
+        if (sampled) {
+            sample(offset, length, failed_to_lock_region);
+        }
+#ifdef RANGE_LOCK_STATS
+        if (failed_to_lock_region) {
+            _stats.record_contention(failed_region_id);
+            _stats.record_try_lock_failure(Mode::shared);
+        } else {
+            _stats.record_acquisition(offset, length, Mode::shared, start);
+        }
 #endif
+        return !failed_to_lock_region;
+    }
 
-/// \brief Range lock class
-///
-/// Utility created to control access to specific regions of a shared resource,
-/// such as a buffer or a file. Think of it as byte-range locking mechanism.
-///
-/// This implementation works by virtually dividing the shared resource into N
-/// regions of the same size, and associating an id with each region.
-/// A region is the unit to be individually protected from concurrent access.
-///
-/// Choosing an optimal region size:
-/// The smaller the region size, the more regions exists.
-/// The more regions exists, the finer grained the locking is.
-/// If in doubt, use range_lock::create_range_lock(). It will choose a region
-/// size for you.
-///
-/// How locking does work with range_lock?
-/// A lock request may cover more than one region, so there is a need to wait
-/// for each covered region to be available. Deadlock is avoided by always
-/// locking regions in sequential order.
-///
-/// This implementation is resource efficient because it will only keep alive
-/// data for the regions being used at the moment. That's done with a simple
-/// reference count management.
-struct range_lock {
-private:
-    struct region {
-        uint64_t refcount = 0;
-#if (__cplusplus >= 201402L)
-        std::shared_timed_mutex mutex;
+    template <typename Mode>
+    void generic_lock(uint64_t offset, uint64_t length, region** pinned = nullptr) {
+        validate_parameters(offset, length);
+#ifdef RANGE_LOCK_STATS
+        auto start = _stats.now();
+#endif
+        enter_gate<Mode>([this, offset, length] { return this->region_count(offset, length); });
+        if (_sampler.should_sample()) {
+            sampled_lock<Mode>(offset, length, pinned);
+        } else {
+            lock_regions<Mode>(get_region_id(offset), get_region_id(offset + length - 1), pinned);
+        }
+        begin_write<Mode>(get_region_id(offset), get_region_id(offset + length - 1));
+#ifdef RANGE_LOCK_STATS
+        _stats.record_acquisition(offset, length, Mode::shared, start);
+#endif
+    }
+
+    // Contention is only counted with RANGE_LOCK_STATS, by trying the region
+    // first.
+    template <typename Mode>
+    void lock_region(region& r, uint64_t region_id) {
+#ifdef RANGE_LOCK_STATS
+        if (Mode::try_lock(r)) {
+            return;
+        }
+        _stats.record_contention(region_id);
 #else
-        std::mutex mutex;
+        (void)region_id;
 #endif
-    };
-    std::unordered_map<uint64_t, std::unique_ptr<region>> _regions;
-    std::mutex _regions_lock;
-    const uint64_t _region_size;
-public:
-    range_lock() = delete;
-    range_lock& operator=(const range_lock&) = delete;
-    range_lock(const range_lock&) = delete;
-    range_lock(range_lock&&) = default;
+        Mode::lock(r);
+    }
 
-    // NOTE: Please make sure that region_size is greater than zero and power
-    // of two. Use std::pow(2, exp) to generate a proper region size.
-    range_lock(uint64_t region_size) : _region_size(region_size) {
-        assert(region_size > 0);
-        assert((region_size & (region_size - 1)) == 0);
+    // Same as generic_lock(), but tries each region first to find out whether
+    // the request conflicts with another.
+    template <typename Mode>
+    void sampled_lock(uint64_t offset, uint64_t length, region** pinned) {
+        bool conflict = false;
+        uint64_t range_first_id = get_region_id(offset);
+        for_each_region_batch(offset, length, [&] (uint64_t first_id, unsigned count) {
+            region* batch[region_batch_size];
+            region** regions = pinned ? pinned + (first_id - range_first_id) : batch;
+            this->_table.pin(first_id, count, regions);
+            for (unsigned i = 0; i < count; i++) {
+                if (!Mode::try_lock(*regions[i])) {
+                    conflict = true;
+#ifdef RANGE_LOCK_STATS
+                    this->_stats.record_contention(first_id + i);
+#endif
+                    Mode::lock(*regions[i]);
+                }
+            }
+            return stop_iteration::no;
+        });
+        sample(offset, length, conflict);
     }
 
-    // Create a range_lock with a region size, which is calculated based on the
-    // size of resource to be protected.
-    // For example, if you want to protect a file, call create_range_lock()
-    // with the size of that file.
-    static std::unique_ptr<range_lock> create_range_lock(uint64_t resource_size) {
-        auto res = std::ceil(std::log2(resource_size) * 0.5);
-        auto exp = std::max(uint64_t(res), uint64_t(10));
-        uint64_t region_size = uint64_t(std::pow(2, exp));
-        return static_cast<std::unique_ptr<range_lock>>(new range_lock(region_size));
+    template <typename Mode>
+    void generic_unlock(uint64_t offset, uint64_t length) {
+        validate_parameters(offset, length);
+#ifdef RANGE_LOCK_STATS
+        _stats.record_release(offset, length, Mode::shared);
+#endif
+        end_write<Mode>(get_region_id(offset), get_region_id(offset + length - 1));
+        unlock_regions<Mode>(get_region_id(offset), get_region_id(offset + length - 1));
+        exit_gate<Mode>(region_count(offset, length));
     }
-private:
-    region& get_locked_region(uint64_t region_id) {
-        std::lock_guard<std::mutex> lock(_regions_lock);
-        auto it = _regions.find(region_id);
-        assert(it != _regions.end()); // assert region exists
-        region& r = *(it->second);
-        assert(r.refcount > 0); // assert region is locked
-        return r;
+
+    // The guard only owns the range once it's locked.
+    template <typename Mode>
+    basic_guard<Mode> generic_lock_guarded(uint64_t offset, uint64_t length) {
+        validate_parameters(offset, length);
+        basic_guard<Mode> guard(offset, length, region_count(offset, length));
+        generic_lock<Mode>(offset, length, guard._regions);
+        // Fewer regions if the granularity was coarsened meanwhile.
+        guard._region_count = region_count(offset, length);
+        guard._lock = this;
+        return guard;
+    }
+
+    template <typename Mode>
+    basic_guard<Mode> generic_try_lock_guarded(uint64_t offset, uint64_t length) {
+        validate_parameters(offset, length);
+        basic_guard<Mode> guard(offset, length, region_count(offset, length));
+        if (generic_try_lock<Mode>(offset, length, Mode::try_lock, guard._regions)) {
+            guard._region_count = region_count(offset, length);
+            guard._lock = this;
+        }
+        return guard;
     }
 
-    region& get_and_lock_region(uint64_t region_id) {
-        std::lock_guard<std::mutex> lock(_regions_lock);
-        auto it = _regions.find(region_id);
-        if (it == _regions.end()) {
-            std::unique_ptr<region> r(new region);
-            auto ret = _regions.insert(std::make_pair(region_id, std::move(r)));
-            it = ret.first;
+    // Release range [offset, offset+length), locked in Mode by a guard, from
+    // the regions it kept, or by id if it kept none.
+    template <typename Mode>
+    void release_guarded(uint64_t offset, uint64_t length, region** regions) {
+        if (!regions) {
+            generic_unlock<Mode>(offset, length);
+            return;
         }
-        region& r = *(it->second);
-        r.refcount++;
-        return r;
+#ifdef RANGE_LOCK_STATS
+        _stats.record_release(offset, length, Mode::shared);
+#endif
+        uint64_t first_id = get_region_id(offset);
+        end_write<Mode>(first_id, get_region_id(offset + length - 1));
+        for_each_region_batch(offset, length, [this, first_id, regions] (uint64_t batch_first_id, unsigned count) {
+            this->_table.unpin_pinned(batch_first_id, count, regions + (batch_first_id - first_id), Mode::unlock);
+            return stop_iteration::no;
+        });
+        exit_gate<Mode>(region_count(offset, length));
     }
 
-    void unlock_region(uint64_t region_id) {
-        std::lock_guard<std::mutex> lock(_regions_lock);
-        auto it = _regions.find(region_id);
-        assert(it != _regions.end());
-        region& r = *(it->second);
-        if (--r.refcount == 0) {
-            _regions.erase(it);
+    // Grow range [offset, offset+length), held in Mode, to [offset,
+    // offset+new_length) by locking only the regions it didn't cover yet.
+    // Those come after the held ones, so regions are still acquired in
+    // ascending order.
+    template <typename Mode>
+    void generic_extend(uint64_t offset, uint64_t length, uint64_t new_length) {
+        validate_parameters(offset, length);
+        validate_parameters(offset, new_length);
+        assert(new_length >= length);
+        uint64_t last_id = get_region_id(offset + length - 1);
+        uint64_t new_last_id = get_region_id(offset + new_length - 1);
+        if (new_last_id > last_id) {
+            pass_gate<Mode>(new_last_id - last_id);
+            lock_regions<Mode>(last_id + 1, new_last_id);
+            begin_write<Mode>(last_id + 1, new_last_id);
         }
+#ifdef RANGE_LOCK_STATS
+        _stats.record_extension(offset, length, Mode::shared, new_length);
+#endif
     }
 
-    inline uint64_t get_region_id(uint64_t offset) const {
-        return offset / _region_size;
+    // Release part [part_offset, part_offset+part_length) of range [offset,
+    // offset+length), held in Mode. Regions also covered by what's left of
+    // the range, before or after the part, are kept.
+    template <typename Mode>
+    void generic_unlock_part(uint64_t offset, uint64_t length, uint64_t part_offset, uint64_t part_length) {
+        validate_parameters(offset, length);
+        validate_parameters(part_offset, part_length);
+        uint64_t end = offset + length;
+        uint64_t part_end = part_offset + part_length;
+        assert(part_offset >= offset && part_end <= end); // assert part is held
+        uint64_t first_id = get_region_id(part_offset);
+        uint64_t last_id = get_region_id(part_end - 1);
+        unsigned keep_first = part_offset > offset && get_region_id(part_offset - 1) == first_id;
+        unsigned keep_last = part_end < end && get_region_id(part_end) == last_id;
+        // Otherwise both ranges left would hold the same region.
+        assert(!(keep_first && keep_last && first_id == last_id)); // assert part doesn't split a region
+#ifdef RANGE_LOCK_STATS
+        _stats.record_part_release(offset, length, Mode::shared, part_offset, part_length);
+#endif
+        if (last_id - first_id + 1 > keep_first + keep_last) {
+            end_write<Mode>(first_id + keep_first, last_id - keep_last);
+            unlock_regions<Mode>(first_id + keep_first, last_id - keep_last);
+            exit_gate<Mode>(last_id - first_id + 1 - keep_first - keep_last);
+        }
     }
 
-    enum class stop_iteration { no, yes };
+    struct region_span {
+        uint64_t first_id;
+        uint64_t last_id;
 
-    inline void
-    do_for_each_region(uint64_t offset, uint64_t length, std::function<stop_iteration(uint64_t)> f) {
-        auto assert_alignment = [] (uint64_t v, uint64_t alignment) {
-            assert((v & (alignment - 1)) == 0);
-        };
-        assert_alignment(offset, _region_size);
-        assert_alignment(length, _region_size);
-        auto regions = length / _region_size;
-        assert(length % _region_size == 0);
-        for (auto i = 0; i < regions; i++) {
-            auto current_offset = offset + (i * _region_size);
-            stop_iteration stop = f(get_region_id(current_offset));
-            if (stop == stop_iteration::yes) {
-                return;
+        bool operator<(const region_span& other) const {
+            return first_id < other.first_id;
+        }
+    };
+
+    // Regions covered by ranges[0..count), as spans of consecutive ids in
+    // ascending order. Overlapping and adjacent spans are merged, so a region
+    // covered by more than one range is only locked once.
+    std::vector<region_span> merged_region_spans(const byte_range* ranges, size_t count) const {
+        assert(count > 0);
+        std::vector<region_span> spans;
+        spans.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            validate_parameters(ranges[i].offset, ranges[i].length);
+            spans.push_back(region_span{ get_region_id(ranges[i].offset),
+                get_region_id(ranges[i].offset + ranges[i].length - 1) });
+        }
+        std::sort(spans.begin(), spans.end());
+        size_t last = 0;
+        for (size_t i = 1; i < spans.size(); i++) {
+            if (spans[i].first_id <= spans[last].last_id + 1) {
+                spans[last].last_id = std::max(spans[last].last_id, spans[i].last_id);
+            } else {
+                spans[++last] = spans[i];
             }
         }
+        spans.resize(last + 1);
+        return spans;
     }
 
-    void for_each_region(uint64_t offset, uint64_t length, std::function<stop_iteration(uint64_t)> f) {
-        uint64_t aligned_down_offset = offset & ~(_region_size - 1);
-        uint64_t aligned_up_length = (length + _region_size - 1) & ~(_region_size - 1);
-        do_for_each_region(aligned_down_offset, aligned_up_length, std::move(f));
+    static uint64_t region_count(const std::vector<region_span>& spans) {
+        uint64_t regions = 0;
+        for (auto& span : spans) {
+            regions += span.last_id - span.first_id + 1;
+        }
+        return regions;
     }
 
-    static inline void validate_parameters(uint64_t offset, uint64_t length) {
-        assert(length > 0);
-        assert(offset < (offset + length)); // check for overflow
+    // Counts the regions of spans, merged from ranges[0..count), for
+    // entering the gate, merging them again if the granularity changed since.
+    struct spans_counter {
+        basic_range_lock* lock;
+        std::vector<region_span>& spans;
+        const byte_range* ranges;
+        size_t count;
+        unsigned coarsening;
+
+        uint64_t operator()() {
+            unsigned current = lock->_coarsening.load(std::memory_order_relaxed);
+            if (current != coarsening) {
+                coarsening = current;
+                spans = lock->merged_region_spans(ranges, count);
+            }
+            return region_count(spans);
+        }
+    };
+
+    template <typename Mode>
+    void generic_lock_ranges(const byte_range* ranges, size_t count) {
+#ifdef RANGE_LOCK_STATS
+        auto start = _stats.now();
+#endif
+        // The gate is entered once for all spans, so that a whole-resource
+        // locker can't get in between them.
+        unsigned coarsening = _coarsening.load(std::memory_order_relaxed);
+        std::vector<region_span> spans = merged_region_spans(ranges, count);
+        enter_gate<Mode>(spans_counter{this, spans, ranges, count, coarsening});
+        for (auto& span : spans) {
+            lock_regions<Mode>(span.first_id, span.last_id);
+            begin_write<Mode>(span.first_id, span.last_id);
+        }
+#ifdef RANGE_LOCK_STATS
+        for (size_t i = 0; i < count; i++) {
+            _stats.record_acquisition(ranges[i].offset, ranges[i].length, Mode::shared, start);
+        }
+#endif
     }
 
-    bool generic_try_lock(uint64_t offset, uint64_t length,
-            std::function<bool(uint64_t)> try_lock, std::function<void(uint64_t)> unlock) {
-        std::vector<uint64_t> locked_region_ids;
-        bool failed_to_lock_region = false;
+    // Spans are tried in ascending order, so on failure every span before the
+    // failed one is released as a whole.
+    template <typename Mode>
+    bool generic_try_lock_ranges(const byte_range* ranges, size_t count) {
+#ifdef RANGE_LOCK_STATS
+        auto start = _stats.now();
+#endif
+        unsigned coarsening = _coarsening.load(std::memory_order_relaxed);
+        std::vector<region_span> spans = merged_region_spans(ranges, count);
+        if (!try_enter_gate<Mode>(spans_counter{this, spans, ranges, count, coarsening}, no_deadline())) {
+#ifdef RANGE_LOCK_STATS
+            _stats.record_try_lock_failure(Mode::shared);
+#endif
+            return false;
+        }
+        for (size_t i = 0; i < spans.size(); i++) {
+            uint64_t failed_region_id = 0;
+            if (!try_lock_regions<Mode>(spans[i].first_id, spans[i].last_id, Mode::try_lock, failed_region_id)) {
+                for (size_t j = 0; j < i; j++) {
+                    end_write<Mode>(spans[j].first_id, spans[j].last_id);
+                    unlock_regions<Mode>(spans[j].first_id, spans[j].last_id);
+                }
+                exit_gate<Mode>(region_count(spans));
+#ifdef RANGE_LOCK_STATS
+                _stats.record_contention(failed_region_id);
+                _stats.record_try_lock_failure(Mode::shared);
+#endif
+                return false;
+            }
+            begin_write<Mode>(spans[i].first_id, spans[i].last_id);
+        }
+#ifdef RANGE_LOCK_STATS
+        for (size_t i = 0; i < count; i++) {
+            _stats.record_acquisition(ranges[i].offset, ranges[i].length, Mode::shared, start);
+        }
+#endif
+        return true;
+    }
+
+    template <typename Mode>
+    void generic_unlock_ranges(const byte_range* ranges, size_t count) {
+#ifdef RANGE_LOCK_STATS
+        for (size_t i = 0; i < count; i++) {
+            _stats.record_release(ranges[i].offset, ranges[i].length, Mode::shared);
+        }
+#endif
+        std::vector<region_span> spans = merged_region_spans(ranges, count);
+        for (auto& span : spans) {
+            end_write<Mode>(span.first_id, span.last_id);
+            unlock_regions<Mode>(span.first_id, span.last_id);
+        }
+        exit_gate<Mode>(region_count(spans));
+    }
 
+    // Change the ownership of the regions covered by range [offset,
+    // offset+length) in place, by calling transition on each one, in ascending
+    // order. Regions are looked up once per batch, without taking references,
+    // as they're pinned by the ownership being changed.
+    template <typename Transition>
+    void generic_transition(uint64_t offset, uint64_t length, Transition&& transition) {
         validate_parameters(offset, length);
-        for_each_region(offset, length, [&] (uint64_t region_id) {
-            bool acquired = try_lock(region_id);
-            if (acquired) {
-                locked_region_ids.push_back(region_id);
-            } else {
-                failed_to_lock_region = true;
-                return stop_iteration::yes;
+        for_each_region_batch(offset, length, [this, &transition] (uint64_t first_id, unsigned count) {
+            region* regions[region_batch_size];
+            this->_table.find_pinned(first_id, count, regions);
+            for (unsigned i = 0; i < count; i++) {
+                transition(*regions[i]);
             }
             return stop_iteration::no;
         });
-
-        if (failed_to_lock_region) {
-            for (auto region_id : locked_region_ids) {
-                unlock(region_id);
-            }
-        }
-        return !failed_to_lock_region;
     }
 public:
-    uint64_t region_size() const { return _region_size; }
+    typedef basic_guard<exclusive_ownership> unique_guard;
+    typedef basic_guard<shared_ownership> shared_guard;
+
+    // Snapshot of the versions of a range taken by read_begin().
+    struct read_ticket {
+        uint64_t first_id;
+        uint64_t last_id;
+        uint64_t sum;
+        unsigned coarsening;
+        uint64_t gate_epoch;
+        bool valid;
+    };
+
+    // Size of the regions currently covering the resource, which only grows,
+    // once the footprint target is hit, see set_footprint_target().
+    uint64_t region_size() const { return _region_size << _coarsening.load(std::memory_order_relaxed); }
+
+#ifdef RANGE_LOCK_STATS
+    // Snapshot of the lock and table counters, with up to top_regions of the
+    // most contended regions. Only available with RANGE_LOCK_STATS defined.
+    range_lock_stats stats(size_t top_regions = 16) const {
+        range_lock_stats st;
+        _stats.snapshot(st, top_regions);
+        st.table = _table.stats();
+        return st;
+    }
+
+    void reset_stats() {
+        _stats.reset();
+        _table.reset_stats();
+    }
+#endif
+
+    // Start sampling one in every sample_period lock requests of each thread.
+    void enable_sampling(unsigned sample_period = 64) {
+        _sampler.enable(sample_period);
+    }
+
+    void disable_sampling() {
+        _sampler.disable();
+    }
+
+    // Profile of the requests sampled so far.
+    workload_profile sampled_workload() const {
+        return _sampler.snapshot(region_size());
+    }
+
+    void reset_sampled_workload() {
+        _sampler.reset();
+    }
 
     // Lock range [offset, offset+length) for exclusive ownership.
     void lock(uint64_t offset, uint64_t length) {
-        validate_parameters(offset, length);
-        for_each_region(offset, length, [this] (uint64_t region_id) {
-            region& r = this->get_and_lock_region(region_id);
-            r.mutex.lock();
-            return stop_iteration::no;
-        });
+        generic_lock<exclusive_ownership>(offset, length);
     }
 
     // Tries to lock the range [offset, offset+length) for exclusive ownership.
     // This function returns immediately.
     // On successful range acquisition returns true, otherwise returns false.
     bool try_lock(uint64_t offset, uint64_t length) {
-        auto try_lock_f = [this] (uint64_t region_id) {
-            region& r = this->get_and_lock_region(region_id);
-            return r.mutex.try_lock();
-        };
-        auto unlock_f = [this] (uint64_t region_id) {
-            region& r = this->get_locked_region(region_id);
-            r.mutex.unlock();
-            this->unlock_region(region_id);
-        };
+        return generic_try_lock<exclusive_ownership>(offset, length, exclusive_ownership::try_lock);
+    }
+
+    // Tries to lock the range [offset, offset+length) for exclusive ownership,
+    // giving up once the deadline is reached. Regions acquired until then are
+    // released, like with try_lock().
+    // On successful range acquisition returns true, otherwise returns false.
+    template <typename Clock, typename Duration>
+    bool try_lock_until(uint64_t offset, uint64_t length, const std::chrono::time_point<Clock, Duration>& deadline) {
+        return generic_try_lock<exclusive_ownership>(offset, length, [&deadline] (region& r) {
+            return exclusive_ownership::try_lock_until(r, deadline);
+        }, nullptr, deadline);
+    }
 
-        return generic_try_lock(offset, length, try_lock_f, unlock_f);
+    // Same as try_lock_until(), with a deadline relative to now.
+    template <typename Rep, typename Period>
+    bool try_lock_for(uint64_t offset, uint64_t length, const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_until(offset, length, std::chrono::steady_clock::now() + timeout);
     }
 
     // Unlock range [offset, offset+length) from exclusive ownership.
     void unlock(uint64_t offset, uint64_t length) {
-        validate_parameters(offset, length);
-        for_each_region(offset, length, [this] (uint64_t region_id) {
-            region& r = this->get_locked_region(region_id);
-            r.mutex.unlock();
-            this->unlock_region(region_id);
-            return stop_iteration::no;
-        });
+        generic_unlock<exclusive_ownership>(offset, length);
+    }
+
+    // Grow range [offset, offset+length), held for exclusive ownership, to
+    // [offset, offset+new_length), waiting only for the regions it didn't
+    // cover yet. Release the range with the new length afterwards.
+    void extend(uint64_t offset, uint64_t length, uint64_t new_length) {
+        generic_extend<exclusive_ownership>(offset, length, new_length);
+    }
+
+    // Unlock part [part_offset, part_offset+part_length) of range [offset,
+    // offset+length), held for exclusive ownership. What's left of the range
+    // stays locked, and is released like one or two separate ranges, so a
+    // part strictly inside a single region, with the range going on at both
+    // sides, cannot be unlocked.
+    void unlock_part(uint64_t offset, uint64_t length, uint64_t part_offset, uint64_t part_length) {
+        generic_unlock_part<exclusive_ownership>(offset, length, part_offset, part_length);
+    }
+
+    // Lock ranges[0..count) together for exclusive ownership. Ranges may be
+    // given in any order and overlap: the regions they cover are merged and
+    // locked in ascending order, so, unlike locking one range after another,
+    // it cannot deadlock with other requests.
+    void lock_ranges(const byte_range* ranges, size_t count) {
+        generic_lock_ranges<exclusive_ownership>(ranges, count);
+    }
+
+    // Tries to lock ranges[0..count) together for exclusive ownership. This
+    // function returns immediately.
+    // On successful acquisition of all ranges returns true, otherwise none is
+    // kept locked and returns false.
+    bool try_lock_ranges(const byte_range* ranges, size_t count) {
+        return generic_try_lock_ranges<exclusive_ownership>(ranges, count);
+    }
+
+    // Unlock ranges[0..count), locked together with lock_ranges(), from
+    // exclusive ownership.
+    void unlock_ranges(const byte_range* ranges, size_t count) {
+        generic_unlock_ranges<exclusive_ownership>(ranges, count);
+    }
+
+    // Lock range [offset, offset+length) for exclusive ownership, which is
+    // released by the returned guard.
+    unique_guard lock_guarded(uint64_t offset, uint64_t length) {
+        return generic_lock_guarded<exclusive_ownership>(offset, length);
+    }
+
+    // Same as try_lock(), but the range is released by the returned guard,
+    // which doesn't own it if acquisition failed.
+    unique_guard try_lock_guarded(uint64_t offset, uint64_t length) {
+        return generic_try_lock_guarded<exclusive_ownership>(offset, length);
     }
 
     // Execute an operation with range [offset, offset+length) locked for exclusive ownership.
+    // The range is released even if the operation throws.
+    // May be elided, see enable_lock_elision().
     template <typename Func>
     void with_lock(uint64_t offset, uint64_t length, Func&& func) {
-        lock(offset, length);
+        if (elide<exclusive_ownership>(offset, length, func)) {
+            return;
+        }
+        unique_guard guard = lock_guarded(offset, length);
         func();
-        unlock(offset, length);
     }
 
-#if (__cplusplus >= 201402L)
     // Lock range [offset, offset+length) for shared ownership.
     void lock_shared(uint64_t offset, uint64_t length) {
-        validate_parameters(offset, length);
-        for_each_region(offset, length, [this] (uint64_t region_id) {
-            region& r = this->get_and_lock_region(region_id);
-            r.mutex.lock_shared();
-            return stop_iteration::no;
-        });
+        generic_lock<shared_ownership>(offset, length);
     }
 
     // Tries to lock the range [offset, offset+length) for shared ownership.
     // This function returns immediately.
     // On successful range acquisition returns true, otherwise returns false.
     bool try_lock_shared(uint64_t offset, uint64_t length) {
-        auto try_lock_f = [this] (uint64_t region_id) {
-            region& r = this->get_and_lock_region(region_id);
-            return r.mutex.try_lock_shared();
-        };
-        auto unlock_f = [this] (uint64_t region_id) {
-            region& r = this->get_locked_region(region_id);
-            r.mutex.unlock_shared();
-            this->unlock_region(region_id);
-        };
+        return generic_try_lock<shared_ownership>(offset, length, shared_ownership::try_lock);
+    }
 
-        return generic_try_lock(offset, length, try_lock_f, unlock_f);
+    // Tries to lock the range [offset, offset+length) for shared ownership,
+    // giving up once the deadline is reached. Regions acquired until then are
+    // released, like with try_lock_shared().
+    // On successful range acquisition returns true, otherwise returns false.
+    template <typename Clock, typename Duration>
+    bool try_lock_shared_until(uint64_t offset, uint64_t length,
+            const std::chrono::time_point<Clock, Duration>& deadline) {
+        return generic_try_lock<shared_ownership>(offset, length, [&deadline] (region& r) {
+            return shared_ownership::try_lock_until(r, deadline);
+        }, nullptr, deadline);
+    }
+
+    // Same as try_lock_shared_until(), with a deadline relative to now.
+    template <typename Rep, typename Period>
+    bool try_lock_shared_for(uint64_t offset, uint64_t length, const std::chrono::duration<Rep, Period>& timeout) {
+        return try_lock_shared_until(offset, length, std::chrono::steady_clock::now() + timeout);
     }
 
     // Unlock range [offset, offset+length) from shared ownership.
     void unlock_shared(uint64_t offset, uint64_t length) {
-        validate_parameters(offset, length);
-        for_each_region(offset, length, [this] (uint64_t region_id) {
-            region& r = this->get_locked_region(region_id);
-            r.mutex.unlock_shared();
-            this->unlock_region(region_id);
-            return stop_iteration::no;
-        });
+        generic_unlock<shared_ownership>(offset, length);
+    }
+
+    // Same as extend(), for a range held for shared ownership.
+    void extend_shared(uint64_t offset, uint64_t length, uint64_t new_length) {
+        generic_extend<shared_ownership>(offset, length, new_length);
+    }
+
+    // Same as unlock_part(), for a range held for shared ownership.
+    void unlock_shared_part(uint64_t offset, uint64_t length, uint64_t part_offset, uint64_t part_length) {
+        generic_unlock_part<shared_ownership>(offset, length, part_offset, part_length);
+    }
+
+    // Same as lock_ranges(), for shared ownership.
+    void lock_shared_ranges(const byte_range* ranges, size_t count) {
+        generic_lock_ranges<shared_ownership>(ranges, count);
+    }
+
+    // Same as try_lock_ranges(), for shared ownership.
+    bool try_lock_shared_ranges(const byte_range* ranges, size_t count) {
+        return generic_try_lock_ranges<shared_ownership>(ranges, count);
+    }
+
+    // Unlock ranges[0..count), locked together with lock_shared_ranges(),
+    // from shared ownership.
+    void unlock_shared_ranges(const byte_range* ranges, size_t count) {
+        generic_unlock_ranges<shared_ownership>(ranges, count);
+    }
+
+    // Lock range [offset, offset+length) for shared ownership, which is
+    // released by the returned guard.
+    shared_guard lock_shared_guarded(uint64_t offset, uint64_t length) {
+        return generic_lock_guarded<shared_ownership>(offset, length);
+    }
+
+    // Same as try_lock_shared(), but the range is released by the returned
+    // guard, which doesn't own it if acquisition failed.
+    shared_guard try_lock_shared_guarded(uint64_t offset, uint64_t length) {
+        return generic_try_lock_guarded<shared_ownership>(offset, length);
     }
 
     // Execute an operation with range [offset, offset+length) locked for shared ownership.
+    // The range is released even if the operation throws.
+    // May be elided, see enable_lock_elision().
     template <typename Func>
     void with_lock_shared(uint64_t offset, uint64_t length, Func&& func) {
-        lock_shared(offset, length);
+        if (elide<shared_ownership>(offset, length, func)) {
+            return;
+        }
+        shared_guard guard = lock_shared_guarded(offset, length);
         func();
-        unlock_shared(offset, length);
     }
-#else
-/// If __cplusplus < 201402L, lock functions for shared ownership will call
-/// corresponding lock functions for exclusive ownership.
-/// That's because std::shared_timed_mutex is only available from C++14 on.
-/// This decision is also important to not break compilation of programs (when
-/// __cplusplus < 201402L) that use these functions.
 
-#warning __cplusplus < 201402L, so lock for shared ownership will lock a range \
-for exclusive ownership instead. That can be changed by using the -std=c++14 \
-or -std=gnu++14 compiler options.
+    // Run the critical sections of with_lock() and with_lock_shared() on
+    // ranges of up to max_regions regions within hardware transactions, which
+    // only read the regions' mutexes, so sections that don't conflict run
+    // concurrently without writing to any region. Sections are run again with
+    // their range locked when transactions abort, and elision suspends itself
+    // when most of them do, see range_lock_detail::lock_elision. Meant for
+    // short sections without system calls, which would always abort.
+    // Returns false, and changes nothing, unless the CPU supports RTM and the
+    // table finds regions without writing to it, like dense_region_table with
+    // compact_region_mutex. Elided sections aren't counted by stats(), see
+    // elision_stats().
+    // NOTE: Must not be called concurrently with any other function of the
+    // range lock.
+    bool enable_lock_elision(unsigned max_regions = 4) {
+        if (!range_lock_detail::supports_lock_elision<Table>::value || !range_lock_detail::lock_elision::supported()) {
+            return false;
+        }
+        _elision.reset(new range_lock_detail::lock_elision(max_regions));
+        return true;
+    }
+
+    bool lock_elision_enabled() const { return _elision != nullptr; }
 
-    void lock_shared(uint64_t offset, uint64_t length) {
-        lock(offset, length);
+    // Counters of elided sections, all zero unless elision is enabled.
+    lock_elision_stats elision_stats() const {
+        return _elision ? _elision->stats() : lock_elision_stats();
     }
 
-    bool try_lock_shared(uint64_t offset, uint64_t length) {
-        return try_lock(offset, length);
+    // Let lock_all() and lock_all_shared() lock the whole resource in O(1),
+    // for operations like truncation, snapshots or compaction, instead of
+    // locking every region of a huge range. Every other locker then passes a
+    // gate, see range_lock_detail::resource_gate, which costs an atomic
+    // operation on a stripe of the calling thread, and an update of a count
+    // kept in the thread, when locking, and as much when unlocking. Threads
+    // holding a range may lock more while a whole-resource lock waits for
+    // them.
+    // NOTE: Ranges must then be released by the thread which locked them,
+    // guards included, which is asserted. Must not be called while a range is
+    // locked, nor concurrently with any other function of the range lock.
+    void enable_whole_resource_locks() {
+        if (!_gate) {
+            _gate.reset(new range_lock_detail::resource_gate);
+        }
     }
 
-    void unlock_shared(uint64_t offset, uint64_t length) {
-        unlock(offset, length);
+    bool whole_resource_locks_enabled() const { return _gate != nullptr; }
+
+    // Lock the whole resource for exclusive ownership: new lockers are kept
+    // out, but for threads holding a range already, and the ranges locked are
+    // waited for.
+    // NOTE: The calling thread must not hold any range, which would never be
+    // released.
+    void lock_all() {
+        assert(_gate); // assert whole-resource locks are enabled
+        _gate->lock();
+    }
+
+    // Tries to lock the whole resource for exclusive ownership, which fails
+    // if any range is locked. This function returns immediately.
+    bool try_lock_all() {
+        assert(_gate); // assert whole-resource locks are enabled
+        return _gate->try_lock();
+    }
+
+    void unlock_all() {
+        assert(_gate); // assert whole-resource locks are enabled
+        _gate->unlock();
+    }
+
+    // Lock the whole resource for shared ownership: ranges may still be
+    // locked for shared ownership, but not for exclusive or upgradeable
+    // ownership, whose owners are waited for.
+    void lock_all_shared() {
+        assert(_gate); // assert whole-resource locks are enabled
+        _gate->lock_shared();
+    }
+
+    // Same as lock_all_shared(), but fails right away if a range is locked
+    // for exclusive or upgradeable ownership.
+    bool try_lock_all_shared() {
+        assert(_gate); // assert whole-resource locks are enabled
+        return _gate->try_lock_shared();
+    }
+
+    void unlock_all_shared() {
+        assert(_gate); // assert whole-resource locks are enabled
+        _gate->unlock_shared();
+    }
+
+    // Number of live regions and memory held by the region table. Requires a
+    // table reporting it, like the ones above.
+    region_table_footprint footprint() const {
+        return _table.footprint();
+    }
+
+    // Try to keep the memory held by the region table under target bytes, or
+    // stop trying if zero. This is best effort, not a bound: once the table
+    // goes over the target, or a request would make it, the memory of
+    // unreferenced regions is given back and the granularity is made coarser,
+    // merging 64 regions into a super-region, or more for a request to fit.
+    // That's done with the whole resource locked, so whole-resource locks are
+    // enabled, which costs every later lock and unlock, see
+    // enable_whole_resource_locks(). Coarsening is put off while any range is
+    // held, meanwhile the table grows past the target as much as the held
+    // ranges need. The granularity is never made finer again.
+    // Disjoint ranges held together by a thread could come to share a
+    // super-region, so coarsening stops for good once a thread is seen
+    // locking a range while holding another.
+    // Returns false, and changes nothing, unless the table gives memory back,
+    // like sharded_region_table.
+    // NOTE: A thread first doing so after a coarsening may still find both
+    // ranges in a super-region, and deadlock.
+    // Must not be called while a range is locked, nor concurrently with any
+    // other function of the range lock.
+    bool set_footprint_target(uint64_t target) {
+        if (!range_lock_detail::supports_footprint_target<Table>::value) {
+            return false;
+        }
+        enable_whole_resource_locks();
+        _footprint_target = target;
+        _coarsened_bytes.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t footprint_target() const { return _footprint_target; }
+
+    // Start keeping a version per region, bumped whenever it's locked and
+    // unlocked for exclusive ownership, so ranges can be read optimistically,
+    // see read_begin(). Regions are hashed into stripes versions, a power of
+    // two, so a write may needlessly fail reads of a few other regions.
+    // NOTE: Must not be called while a range is locked for exclusive
+    // ownership, nor concurrently with any other function of the range lock.
+    void enable_optimistic_reads(unsigned stripes = 1024) {
+        _sequences.reset(new range_lock_detail::sequence_stripes(stripes));
+    }
+
+    // Begin an optimistic read of range [offset, offset+length), which takes
+    // no lock and writes nothing shared: read the range, then check with
+    // read_validate() that no writer overlapped the read, and retry or fall
+    // back to lock_shared() otherwise. Reads may see torn data, so they must
+    // use relaxed atomics or copy the data out, and only use it once
+    // validated. Meant for short ranges, as every region is checked.
+    read_ticket read_begin(uint64_t offset, uint64_t length) const {
+        validate_parameters(offset, length);
+        assert(_sequences); // assert optimistic reads are enabled
+        read_ticket ticket;
+        ticket.coarsening = _coarsening.load(std::memory_order_relaxed);
+        ticket.gate_epoch = _gate ? _gate->epoch() : 0;
+        ticket.first_id = get_region_id(offset);
+        ticket.last_id = get_region_id(offset + length - 1);
+        ticket.valid = !(ticket.gate_epoch & 1)
+            && _sequences->read_begin(ticket.first_id, ticket.last_id, ticket.sum);
+        return ticket;
     }
 
+    // Returns true if no writer overlapped the read started with ticket,
+    // which fails right away if a writer held the range by then. Writers
+    // include lock_all() owners. Reads which overlapped a change of
+    // granularity fail too, as writers then bump the versions of other
+    // regions.
+    bool read_validate(const read_ticket& ticket) const {
+        return ticket.valid && _sequences->read_validate(ticket.first_id, ticket.last_id, ticket.sum)
+            && _coarsening.load(std::memory_order_relaxed) == ticket.coarsening
+            && (!_gate || _gate->epoch() == ticket.gate_epoch);
+    }
+
+    // Run func on range [offset, offset+length) optimistically, up to
+    // max_attempts times until a run is validated, and then with the range
+    // locked for shared ownership. See read_begin() about what func may do;
+    // only what its last run read is valid.
     template <typename Func>
-    void with_lock_shared(uint64_t offset, uint64_t length, Func&& func) {
-        with_lock(offset, length, std::move(func));
+    void with_optimistic_read(uint64_t offset, uint64_t length, Func&& func, unsigned max_attempts = 4) {
+        for (unsigned i = 0; i < max_attempts; i++) {
+            read_ticket ticket = read_begin(offset, length);
+            if (ticket.valid) {
+                func();
+                if (read_validate(ticket)) {
+                    return;
+                }
+            }
+            range_lock_detail::cpu_relax();
+        }
+        with_lock_shared(offset, length, func);
+    }
+
+    // Lock range [offset, offset+length) for upgradeable ownership, which is
+    // shared with readers, but exclusive of writers and of other upgradeable
+    // owners, so that upgrade() cannot deadlock with another upgrade.
+    // Requires a region mutex supporting it, like compact_region_mutex.
+    void lock_upgrade(uint64_t offset, uint64_t length) {
+        generic_lock<upgradeable_ownership>(offset, length);
+    }
+
+    // Tries to lock the range [offset, offset+length) for upgradeable ownership.
+    // This function returns immediately.
+    // On successful range acquisition returns true, otherwise returns false.
+    bool try_lock_upgrade(uint64_t offset, uint64_t length) {
+        return generic_try_lock<upgradeable_ownership>(offset, length, upgradeable_ownership::try_lock);
+    }
+
+    // Unlock range [offset, offset+length) from upgradeable ownership.
+    void unlock_upgrade(uint64_t offset, uint64_t length) {
+        generic_unlock<upgradeable_ownership>(offset, length);
+    }
+
+    // Upgrade range [offset, offset+length) from upgradeable to exclusive
+    // ownership, without releasing it. New readers are kept out of each region
+    // as soon as the upgrade reaches it, and its current readers are waited
+    // for. Release the range with unlock() afterwards.
+    void upgrade(uint64_t offset, uint64_t length) {
+        generic_transition(offset, length, [] (region& r) { r.mutex.unlock_upgrade_and_lock(); });
+        begin_write<exclusive_ownership>(get_region_id(offset), get_region_id(offset + length - 1));
+#ifdef RANGE_LOCK_STATS
+        _stats.record_transition(offset, length, upgradeable_ownership::shared, exclusive_ownership::shared);
+#endif
     }
+
+    // Downgrade range [offset, offset+length) from exclusive to shared
+    // ownership, without releasing it. Release the range with unlock_shared()
+    // afterwards.
+    void downgrade(uint64_t offset, uint64_t length) {
+        end_write<exclusive_ownership>(get_region_id(offset), get_region_id(offset + length - 1));
+        pass_gate<shared_ownership>(region_count(offset, length));
+        generic_transition(offset, length, [] (region& r) { r.mutex.unlock_and_lock_shared(); });
+        exit_gate<exclusive_ownership>(region_count(offset, length));
+#ifdef RANGE_LOCK_STATS
+        _stats.record_transition(offset, length, exclusive_ownership::shared, shared_ownership::shared);
 #endif
+    }
 };
+
+typedef basic_range_lock<sharded_region_table<>> range_lock;
+
+typedef basic_range_lock<dense_region_table<>> dense_range_lock;
+
+/// Range lock granting each region in arrival order, see fair_region_mutex.
+typedef basic_range_lock<sharded_region_table<fair_region_mutex>> fair_range_lock;
+
+/// Dense range lock for read-mostly resources, whose readers don't write to
+/// the regions they lock, see reader_biased_region_mutex.
+typedef basic_range_lock<dense_region_table<reader_biased_region_mutex<>>> read_mostly_range_lock;
+
+// Create a dense_range_lock for a resource of a fixed size, with the same
+// region size create_range_lock() would choose. Only ranges within
+// [0, resource_size) can be locked.
+inline std::unique_ptr<dense_range_lock> create_dense_range_lock(uint64_t resource_size, bool pad_regions = false) {
+    uint64_t region_size = dense_range_lock::region_size_for(resource_size);
+    uint64_t region_count = (resource_size + region_size - 1) / region_size;
+    return std::unique_ptr<dense_range_lock>(new dense_range_lock(region_size, region_count, pad_regions));
+}
+
+// Create a read_mostly_range_lock for a resource of a fixed size, like
+// create_dense_range_lock().
+inline std::unique_ptr<read_mostly_range_lock> create_read_mostly_range_lock(uint64_t resource_size) {
+    uint64_t region_size = read_mostly_range_lock::region_size_for(resource_size);
+    uint64_t region_count = (resource_size + region_size - 1) / region_size;
+    return std::unique_ptr<read_mostly_range_lock>(new read_mostly_range_lock(region_size, region_count));
+}
@@ -0,0 +1,375 @@
+///
+/// Purpose of this program is to measure the throughput and latency of the
+/// range lock engines, across thread counts, range lengths, read/write mixes,
+/// access patterns and region sizes.
+///
+/// Every parameter takes a comma separated list of values, and every
+/// combination of them is run, for each engine, printing one line per run:
+///
+/// $ ./range_lock_bench --engines=sharded,dense --threads=1,4,8 --regions=1,16
+///       --reads=0,90 --patterns=disjoint,hot --region-sizes=4096 --duration-ms=500
+///
+/// Latency is measured around each lock and unlock pair, so it includes the
+/// overhead of reading the clock twice.
+///
+
+#include "range_lock.hh"
+#include "interval_range_lock.hh"
+#include "hierarchical_range_lock.hh"
+#include "async_range_lock.hh"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+struct bench_config {
+    std::string engine;
+    unsigned threads;
+    uint64_t regions;      // range length, in regions
+    unsigned read_percent;
+    std::string pattern;
+    uint64_t region_size;
+    uint64_t resource_regions;
+    std::chrono::milliseconds duration;
+};
+
+/// Latency histogram with 16 linear sub-buckets per power of two, so
+/// percentiles are precise to about 6%.
+class latency_histogram {
+    static constexpr unsigned sub_bucket_bits = 4;
+    static constexpr unsigned sub_buckets = 1U << sub_bucket_bits;
+    static constexpr unsigned buckets = 64 * sub_buckets;
+    std::vector<uint64_t> _counts;
+    uint64_t _total = 0;
+
+    static unsigned index_of(uint64_t ns) {
+        if (ns < sub_buckets) {
+            return unsigned(ns);
+        }
+        unsigned log2 = range_lock_detail::log2_floor(ns);
+        unsigned sub = unsigned(ns >> (log2 - sub_bucket_bits)) & (sub_buckets - 1);
+        return (log2 - sub_bucket_bits + 1) * sub_buckets + sub;
+    }
+
+    static uint64_t lower_bound_of(unsigned index) {
+        if (index < sub_buckets) {
+            return index;
+        }
+        unsigned log2 = index / sub_buckets + sub_bucket_bits - 1;
+        uint64_t sub = index % sub_buckets;
+        return (uint64_t(1) << log2) | (sub << (log2 - sub_bucket_bits));
+    }
+public:
+    latency_histogram() : _counts(buckets, 0) {}
+
+    void record(uint64_t ns) {
+        _counts[index_of(ns)]++;
+        _total++;
+    }
+
+    void merge(const latency_histogram& other) {
+        for (unsigned i = 0; i < buckets; i++) {
+            _counts[i] += other._counts[i];
+        }
+        _total += other._total;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < buckets; i++) {
+            seen += _counts[i];
+            if (seen && seen >= p * _total) {
+                return lower_bound_of(i);
+            }
+        }
+        return 0;
+    }
+};
+
+struct bench_result {
+    uint64_t ops = 0;
+    double seconds = 0;
+    latency_histogram latencies;
+};
+
+// Engines are adapted to a common interface taking region ids.
+template <typename RangeLock>
+struct blocking_engine {
+    RangeLock& lock;
+    uint64_t region_size;
+
+    void acquire(uint64_t first, uint64_t count, bool shared) {
+        if (shared) {
+            lock.lock_shared(first * region_size, count * region_size);
+        } else {
+            lock.lock(first * region_size, count * region_size);
+        }
+    }
+
+    void release(uint64_t first, uint64_t count, bool shared) {
+        if (shared) {
+            lock.unlock_shared(first * region_size, count * region_size);
+        } else {
+            lock.unlock(first * region_size, count * region_size);
+        }
+    }
+};
+
+struct async_engine {
+    async_range_lock& lock;
+    uint64_t region_size;
+
+    void acquire(uint64_t first, uint64_t count, bool shared) {
+        if (shared) {
+            lock.lock_shared_async(first * region_size, count * region_size).wait();
+        } else {
+            lock.lock_async(first * region_size, count * region_size).wait();
+        }
+    }
+
+    void release(uint64_t first, uint64_t count, bool shared) {
+        if (shared) {
+            lock.unlock_shared(first * region_size, count * region_size);
+        } else {
+            lock.unlock(first * region_size, count * region_size);
+        }
+    }
+};
+
+// First region of thread t's next range, for the configured access pattern:
+// - disjoint: each thread only locks ranges within its own slice.
+// - uniform: ranges are spread over the whole resource.
+// - hot: all threads lock ranges within the same few regions.
+static uint64_t pick_first_region(const bench_config& c, unsigned t, uint64_t& state) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint64_t r = state >> 16;
+    uint64_t base = 0;
+    uint64_t span = c.resource_regions;
+    if (c.pattern == "disjoint") {
+        span = c.resource_regions / c.threads;
+        base = t * span;
+    } else if (c.pattern == "hot") {
+        span = std::min(c.resource_regions, c.regions * 4);
+    }
+    return base + r % (span - c.regions + 1);
+}
+
+template <typename Engine>
+static bench_result run(Engine engine, const bench_config& c) {
+    std::vector<bench_result> results(c.threads);
+    std::vector<std::thread> ts;
+    std::atomic<unsigned> ready(0);
+    std::atomic<bool> start(false);
+    std::atomic<bool> stop(false);
+    for (unsigned t = 0; t < c.threads; t++) {
+        ts.push_back(std::thread([&, t] {
+            bench_result& res = results[t];
+            uint64_t state = t + 1;
+            ready++;
+            while (!start) {
+                std::this_thread::yield();
+            }
+            while (!stop.load(std::memory_order_relaxed)) {
+                uint64_t first = pick_first_region(c, t, state);
+                bool shared = (state >> 40) % 100 < c.read_percent;
+                auto before = std::chrono::steady_clock::now();
+                engine.acquire(first, c.regions, shared);
+                engine.release(first, c.regions, shared);
+                auto after = std::chrono::steady_clock::now();
+                res.latencies.record(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count()));
+                res.ops++;
+            }
+        }));
+    }
+    while (ready < c.threads) {
+        std::this_thread::yield();
+    }
+    auto began = std::chrono::steady_clock::now();
+    start = true;
+    std::this_thread::sleep_for(c.duration);
+    stop = true;
+    for (auto& t : ts) {
+        t.join();
+    }
+    bench_result total;
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count();
+    for (auto& res : results) {
+        total.ops += res.ops;
+        total.latencies.merge(res.latencies);
+    }
+    return total;
+}
+
+template <typename RangeLock>
+static bench_result run_blocking(RangeLock& lock, const bench_config& c) {
+    return run(blocking_engine<RangeLock>{lock, c.region_size}, c);
+}
+
+static bool run_engine(const bench_config& c, bench_result& res) {
+    uint64_t rs = c.region_size;
+    if (c.engine == "sharded") {
+        range_lock lock(rs);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "sharded-retaining") {
+        range_lock lock(rs, sharded_region_table<>::default_shard_count(), 1024);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "sharded-cached") {
+        range_lock lock(rs, sharded_region_table<>::default_shard_count(), 0, true);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "lockfree") {
+        basic_range_lock<lockfree_region_table<>> lock(rs);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "dense") {
+        dense_range_lock lock(rs, c.resource_regions);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "dense-padded") {
+        dense_range_lock lock(rs, c.resource_regions, true);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "read-mostly") {
+        read_mostly_range_lock lock(rs, c.resource_regions);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "fair") {
+        fair_range_lock lock(rs);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "std") {
+        basic_range_lock<sharded_region_table<std_region_mutex>> lock(rs);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "interval") {
+        interval_range_lock lock;
+        res = run_blocking(lock, c);
+    } else if (c.engine == "hierarchical") {
+        hierarchical_range_lock lock(rs);
+        res = run_blocking(lock, c);
+    } else if (c.engine == "async") {
+        async_range_lock lock(rs);
+        res = run(async_engine{lock, rs}, c);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static std::vector<std::string> split(const std::string& s) {
+    std::vector<std::string> values;
+    std::stringstream ss(s);
+    std::string v;
+    while (std::getline(ss, v, ',')) {
+        if (!v.empty()) {
+            values.push_back(v);
+        }
+    }
+    return values;
+}
+
+static std::vector<uint64_t> split_numbers(const std::string& s) {
+    std::vector<uint64_t> values;
+    for (auto& v : split(s)) {
+        values.push_back(std::strtoull(v.c_str(), nullptr, 0));
+    }
+    return values;
+}
+
+static void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--option=value,...]\n"
+        << "  --engines=sharded,sharded-retaining,sharded-cached,lockfree,dense,dense-padded,read-mostly,fair,std,interval,hierarchical,async\n"
+        << "  --threads=N,...          (default 1,2,4,8)\n"
+        << "  --regions=N,...          range length in regions (default 1,16)\n"
+        << "  --reads=P,...            percentage of shared requests (default 0,90)\n"
+        << "  --patterns=disjoint,uniform,hot (default disjoint,hot)\n"
+        << "  --region-sizes=N,...     (default 4096)\n"
+        << "  --resource-regions=N     regions in the resource (default 65536)\n"
+        << "  --duration-ms=N          per run (default 300)\n"
+        << "  --max-spins=N            spin bound of compact region mutexes before parking\n";
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> engines = {"sharded", "lockfree", "dense"};
+    std::vector<uint64_t> threads = {1, 2, 4, 8};
+    std::vector<uint64_t> regions = {1, 16};
+    std::vector<uint64_t> reads = {0, 90};
+    std::vector<std::string> patterns = {"disjoint", "hot"};
+    std::vector<uint64_t> region_sizes = {4096};
+    uint64_t resource_regions = 65536;
+    uint64_t duration_ms = 300;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        if (key == "engines") {
+            engines = split(value);
+        } else if (key == "threads") {
+            threads = split_numbers(value);
+        } else if (key == "regions") {
+            regions = split_numbers(value);
+        } else if (key == "reads") {
+            reads = split_numbers(value);
+        } else if (key == "patterns") {
+            patterns = split(value);
+        } else if (key == "region-sizes") {
+            region_sizes = split_numbers(value);
+        } else if (key == "resource-regions") {
+            resource_regions = std::strtoull(value.c_str(), nullptr, 0);
+        } else if (key == "duration-ms") {
+            duration_ms = std::strtoull(value.c_str(), nullptr, 0);
+        } else if (key == "max-spins") {
+            compact_region_mutex::set_max_spins(unsigned(std::strtoul(value.c_str(), nullptr, 0)));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::cout << std::left << std::setw(14) << "engine" << std::right
+        << std::setw(8) << "threads" << std::setw(8) << "regions" << std::setw(7) << "reads"
+        << std::setw(10) << "pattern" << std::setw(13) << "region_size"
+        << std::setw(12) << "Mops/s" << std::setw(10) << "p50_ns" << std::setw(10) << "p99_ns"
+        << std::setw(11) << "p99.9_ns" << "\n";
+    for (auto& engine : engines) {
+        for (auto rs : region_sizes) {
+            for (auto t : threads) {
+                for (auto len : regions) {
+                    for (auto r : reads) {
+                        for (auto& pattern : patterns) {
+                            bench_config c{engine, unsigned(t), len, unsigned(r), pattern, rs, resource_regions,
+                                std::chrono::milliseconds(duration_ms)};
+                            if (pattern != "disjoint" && pattern != "uniform" && pattern != "hot") {
+                                std::cerr << "Unknown pattern: " << pattern << "\n";
+                                usage(argv[0]);
+                                return 1;
+                            }
+                            if (!t || !len || (rs & (rs - 1)) || rs < 64 || len * t > resource_regions) {
+                                std::cerr << "Skipping invalid configuration\n";
+                                continue;
+                            }
+                            bench_result res;
+                            if (!run_engine(c, res)) {
+                                std::cerr << "Unknown engine: " << engine << "\n";
+                                usage(argv[0]);
+                                return 1;
+                            }
+                            std::cout << std::left << std::setw(14) << engine << std::right
+                                << std::setw(8) << t << std::setw(8) << len << std::setw(6) << r << "%"
+                                << std::setw(10) << pattern << std::setw(13) << rs
+                                << std::setw(12) << std::fixed << std::setprecision(3) << res.ops / res.seconds / 1e6
+                                << std::setw(10) << res.latencies.percentile(0.5)
+                                << std::setw(10) << res.latencies.percentile(0.99)
+                                << std::setw(11) << res.latencies.percentile(0.999) << std::endl;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
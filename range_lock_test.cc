@@ -8,12 +8,37 @@
 #include "range_lock.hh"
 #include <iostream>
 #include <thread>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
 #include <assert.h>
 
 #define print_test_name() \
     std::cout << "\nRunning " << __FUNCTION__ << "...\n";
 
-static void basic_range_lock_test(range_lock& range_lock) {
+template <typename Func>
+static bool from_another_thread(Func&& f) {
+    bool ret = false;
+    std::thread t([&] { ret = f(); });
+    t.join();
+    return ret;
+}
+
+template <typename RangeLock>
+static bool try_lock_from_another_thread(RangeLock& range_lock, uint64_t offset, uint64_t length) {
+    bool acquired = false;
+    std::thread t([&] {
+        acquired = range_lock.try_lock(offset, length);
+        if (acquired) {
+            range_lock.unlock(offset, length);
+        }
+    });
+    t.join();
+    return acquired;
+}
+
+template <typename RangeLock>
+static void basic_range_lock_test(RangeLock& range_lock) {
     print_test_name();
 
     auto t = std::thread([&range_lock] {
@@ -35,11 +60,11 @@ static void basic_range_lock_test(range_lock& range_lock) {
     t.join();
 }
 
-static void basic_range_lock_shared_test(range_lock& range_lock) {
-#if (__cplusplus >= 201402L)
+template <typename RangeLock>
+static void basic_range_lock_shared_test(RangeLock& range_lock) {
     print_test_name();
 
-    auto print_message = [] (auto thread_id, auto message) {
+    auto print_message = [] (int thread_id, const char* message) {
         std::cout << "[thread " << thread_id << "] " << message << std::endl;
     };
 
@@ -72,10 +97,10 @@ static void basic_range_lock_shared_test(range_lock& range_lock) {
     assert(acquired);
     range_lock.unlock(0, 8192);
     std::cout << "Succeeded\n";
-#endif
 }
 
-static void try_lock_test(range_lock& range_lock) {
+template <typename RangeLock>
+static void try_lock_test(RangeLock& range_lock) {
     print_test_name();
 
     auto t = std::thread([&range_lock] {
@@ -102,13 +127,1269 @@ static void try_lock_test(range_lock& range_lock) {
     std::cout << "Succeeded\n";
 }
 
+template <typename RangeLock>
+static void timed_lock_test(RangeLock& range_lock, bool supports_shared_ownership) {
+    print_test_name();
+    // Ranges are multiples of the region size, so that rolled back regions
+    // are distinct from the held one.
+    const uint64_t r = range_lock.region_size();
+
+    std::atomic<bool> locked(false);
+    std::atomic<bool> release(false);
+    auto t = std::thread([&] {
+        range_lock.lock(r, r);
+        locked = true;
+        while (!release) {
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        range_lock.unlock(r, r);
+    });
+    while (!locked) {
+        std::this_thread::yield();
+    }
+
+    std::cout << "Checking that the first 3 regions time out while the second one is held\n";
+    auto start = std::chrono::steady_clock::now();
+    bool acquired = range_lock.try_lock_for(0, 3 * r, std::chrono::milliseconds(100));
+    assert(!acquired);
+    assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+    if (supports_shared_ownership) {
+        acquired = range_lock.try_lock_shared_until(0, 3 * r,
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+        assert(!acquired);
+    }
+    std::cout << "Checking that the regions acquired before timing out were released\n";
+    acquired = range_lock.try_lock(0, r);
+    assert(acquired);
+    range_lock.unlock(0, r);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the first 3 regions are acquired once the second one is released\n";
+    release = true;
+    acquired = range_lock.try_lock_for(0, 3 * r, std::chrono::seconds(10));
+    assert(acquired);
+    range_lock.unlock(0, 3 * r);
+    t.join();
+    std::cout << "Succeeded\n";
+
+    if (supports_shared_ownership) {
+        std::cout << "Checking that timed shared lock requests share ownership\n";
+        acquired = range_lock.try_lock_shared_for(0, 2 * r, std::chrono::milliseconds(10));
+        assert(acquired);
+        acquired = range_lock.try_lock_shared_for(r, 2 * r, std::chrono::milliseconds(10));
+        assert(acquired);
+        acquired = range_lock.try_lock_for(r, r, std::chrono::milliseconds(10));
+        assert(!acquired);
+        range_lock.unlock_shared(0, 2 * r);
+        range_lock.unlock_shared(r, 2 * r);
+        std::cout << "Succeeded\n";
+    }
+}
+
+template <typename RangeLock>
+static void unaligned_range_test(RangeLock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+
+    std::cout << "Checking that a range crossing a region boundary locks both regions\n";
+    range_lock.lock(size - 1, 2);
+    assert(!try_lock_from_another_thread(range_lock, 0, 1));
+    assert(!try_lock_from_another_thread(range_lock, size, 1));
+    assert(try_lock_from_another_thread(range_lock, 2 * size, 1));
+    range_lock.unlock(size - 1, 2);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a range spanning many regions locks all of them\n";
+    range_lock.lock(size / 2, 200 * size);
+    assert(!try_lock_from_another_thread(range_lock, 0, 1));
+    assert(!try_lock_from_another_thread(range_lock, 100 * size, size));
+    assert(!try_lock_from_another_thread(range_lock, 200 * size, 1));
+    assert(try_lock_from_another_thread(range_lock, 201 * size, 1));
+    range_lock.unlock(size / 2, 200 * size);
+    assert(try_lock_from_another_thread(range_lock, 0, 300 * size));
+    std::cout << "Succeeded\n";
+}
+
+template <typename RangeLock>
+static void resize_test(RangeLock& range_lock, bool supports_shared_ownership) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that extend only locks the regions not yet covered\n";
+    range_lock.lock(0, size / 2);
+    assert(try_lock_from_another_thread(range_lock, size, size));
+    range_lock.extend(0, size / 2, size);
+    assert(try_lock_from_another_thread(range_lock, size, size));
+    range_lock.extend(0, size, 3 * size + 1);
+    assert(!try_lock_from_another_thread(range_lock, 3 * size, 1));
+    assert(try_lock_from_another_thread(range_lock, 4 * size, size));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that extend waits for the regions it adds\n";
+    std::atomic<bool> holding(false);
+    std::atomic<bool> released(false);
+    auto holder = std::thread([&] {
+        range_lock.lock(4 * size, size);
+        holding = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        released = true;
+        range_lock.unlock(4 * size, size);
+    });
+    while (!holding) {
+        std::this_thread::yield();
+    }
+    range_lock.extend(0, 3 * size + 1, 5 * size);
+    assert(released);
+    holder.join();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that unlock_part keeps regions still covered by the range\n";
+    // Unaligned part in the middle: regions 1 and 3 are still partly held.
+    range_lock.unlock_part(0, 5 * size, size + 1, 2 * size);
+    assert(!try_lock_from_another_thread(range_lock, size, 1));
+    assert(try_lock_from_another_thread(range_lock, 2 * size, size));
+    assert(!try_lock_from_another_thread(range_lock, 3 * size, 1));
+    // Aligned tail.
+    range_lock.unlock_part(3 * size + 1, 2 * size - 1, 4 * size, size);
+    assert(try_lock_from_another_thread(range_lock, 4 * size, size));
+    assert(!try_lock_from_another_thread(range_lock, 3 * size, 1));
+    range_lock.unlock(0, size + 1);
+    range_lock.unlock(3 * size + 1, size - 1);
+    assert(try_lock_from_another_thread(range_lock, 0, 5 * size));
+    std::cout << "Succeeded\n";
+
+    if (!supports_shared_ownership) {
+        return;
+    }
+    std::cout << "Checking that shared ranges can be extended and partly unlocked\n";
+    range_lock.lock_shared(0, size);
+    range_lock.extend_shared(0, size, 3 * size);
+    assert(!try_lock_from_another_thread(range_lock, 2 * size, size));
+    range_lock.unlock_shared_part(0, 3 * size, 0, 2 * size);
+    assert(try_lock_from_another_thread(range_lock, 0, 2 * size));
+    assert(!try_lock_from_another_thread(range_lock, 2 * size, size));
+    range_lock.unlock_shared(2 * size, size);
+    assert(try_lock_from_another_thread(range_lock, 0, 3 * size));
+    std::cout << "Succeeded\n";
+}
+
+template <typename RangeLock>
+static void vectored_lock_test(RangeLock& range_lock, bool supports_shared_ownership) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that unsorted and overlapping ranges are locked together\n";
+    std::vector<byte_range> ranges = {
+        { 10 * size, 2 * size }, { 0, 1 }, { 11 * size, size + 1 }, { 5 * size, size }, { 0, size },
+    };
+    range_lock.lock_ranges(ranges.data(), ranges.size());
+    assert(!try_lock_from_another_thread(range_lock, 0, 1));
+    assert(try_lock_from_another_thread(range_lock, size, 4 * size));
+    assert(!try_lock_from_another_thread(range_lock, 5 * size, 1));
+    assert(!try_lock_from_another_thread(range_lock, 12 * size, 1));
+    assert(try_lock_from_another_thread(range_lock, 13 * size, size));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that try_lock_ranges keeps nothing locked on failure\n";
+    std::atomic<bool> result(true);
+    // Region 2 is locked first, and then released when region 10 fails.
+    std::vector<byte_range> others = { { 30 * size, size }, { 2 * size, size }, { 10 * size, size } };
+    std::thread([&] { result = range_lock.try_lock_ranges(others.data(), others.size()); }).join();
+    assert(!result);
+    assert(try_lock_from_another_thread(range_lock, 2 * size, size));
+    range_lock.unlock_ranges(ranges.data(), ranges.size());
+    assert(try_lock_from_another_thread(range_lock, 0, 40 * size));
+    assert(range_lock.try_lock_ranges(others.data(), others.size()));
+    assert(!try_lock_from_another_thread(range_lock, 30 * size, 1));
+    range_lock.unlock_ranges(others.data(), others.size());
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that ranges given in opposite orders don't deadlock\n";
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i < 4; i++) {
+        ts.push_back(std::thread([&, i] {
+            byte_range forward[] = { { 0, size }, { 100 * size, size } };
+            byte_range backward[] = { { 100 * size, size }, { 0, size } };
+            for (unsigned j = 0; j < 20000; j++) {
+                byte_range* r = (i + j) % 2 ? forward : backward;
+                range_lock.lock_ranges(r, 2);
+                range_lock.unlock_ranges(r, 2);
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    std::cout << "Succeeded\n";
+
+    if (!supports_shared_ownership) {
+        return;
+    }
+    std::cout << "Checking that ranges can be locked together for shared ownership\n";
+    range_lock.lock_shared_ranges(ranges.data(), ranges.size());
+    std::thread([&] {
+        result = range_lock.try_lock_shared_ranges(ranges.data(), ranges.size());
+        if (result) {
+            range_lock.unlock_shared_ranges(ranges.data(), ranges.size());
+        }
+    }).join();
+    assert(result);
+    assert(!try_lock_from_another_thread(range_lock, 11 * size, 1));
+    range_lock.unlock_shared_ranges(ranges.data(), ranges.size());
+    assert(try_lock_from_another_thread(range_lock, 0, 40 * size));
+    std::cout << "Succeeded\n";
+}
+
+template <typename RangeLock>
+static void guard_test(RangeLock& range_lock, bool supports_shared_ownership) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that a guard releases its range when destroyed or moved from\n";
+    {
+        auto guard = range_lock.lock_guarded(size / 2, size);
+        assert(guard.owns_lock());
+        assert(!try_lock_from_another_thread(range_lock, 0, 1));
+        assert(!try_lock_from_another_thread(range_lock, size, 1));
+        typename RangeLock::unique_guard moved(std::move(guard));
+        assert(!guard.owns_lock() && moved.owns_lock());
+        assert(!try_lock_from_another_thread(range_lock, size, 1));
+        moved = range_lock.lock_guarded(10 * size, size);
+        assert(try_lock_from_another_thread(range_lock, 0, 2 * size));
+        assert(!try_lock_from_another_thread(range_lock, 10 * size, 1));
+    }
+    assert(try_lock_from_another_thread(range_lock, 0, 20 * size));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that guards of ranges kept out of place, or not kept, are released\n";
+    for (uint64_t regions : { 100, 5000 }) {
+        auto guard = range_lock.lock_guarded(0, regions * size);
+        assert(!try_lock_from_another_thread(range_lock, (regions - 1) * size, 1));
+        guard.unlock();
+        assert(!guard.owns_lock());
+        assert(try_lock_from_another_thread(range_lock, 0, regions * size));
+    }
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a failed try_lock_guarded doesn't own the range\n";
+    range_lock.lock(3 * size, size);
+    std::thread([&] {
+        auto guard = range_lock.try_lock_guarded(0, 4 * size);
+        assert(!guard);
+        auto other = range_lock.try_lock_guarded(0, 3 * size);
+        assert(other);
+    }).join();
+    range_lock.unlock(3 * size, size);
+    assert(try_lock_from_another_thread(range_lock, 0, 4 * size));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that with_lock releases the range if the operation throws\n";
+    bool thrown = false;
+    try {
+        range_lock.with_lock(0, size, [] { throw std::runtime_error("failure"); });
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(try_lock_from_another_thread(range_lock, 0, size));
+    std::cout << "Succeeded\n";
+
+    if (!supports_shared_ownership) {
+        return;
+    }
+    std::cout << "Checking that shared guards are shared with readers only\n";
+    {
+        auto guard = range_lock.lock_shared_guarded(0, 2 * size);
+        std::thread([&] {
+            auto other = range_lock.try_lock_shared_guarded(size, 2 * size);
+            assert(other.owns_lock());
+        }).join();
+        assert(!try_lock_from_another_thread(range_lock, size, 1));
+    }
+    assert(try_lock_from_another_thread(range_lock, 0, 3 * size));
+    std::cout << "Succeeded\n";
+}
+
+template <typename RangeLock>
+static void mutual_exclusion_test(RangeLock& range_lock) {
+    print_test_name();
+
+    const unsigned threads = 8;
+    const unsigned iterations = 5000;
+    const uint64_t regions = 4096;
+    auto size = range_lock.region_size();
+    std::vector<uint64_t> counters(regions, 0);
+    std::vector<std::thread> ts;
+    std::atomic<uint64_t> expected(0);
+    std::atomic<uint64_t> torn_reads(0);
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % regions;
+                uint64_t count = 1 + (state >> 52) % std::min(regions - first, uint64_t(100));
+                auto sum = [&] {
+                    uint64_t total = 0;
+                    for (uint64_t k = first; k < first + count; k++) {
+                        total += counters[k];
+                    }
+                    return total;
+                };
+                if (j % 4 == 0) {
+                    range_lock.with_lock_shared(first * size, count * size, [&] {
+                        uint64_t before = sum();
+                        std::this_thread::yield();
+                        if (sum() != before) {
+                            torn_reads++;
+                        }
+                    });
+                    continue;
+                }
+                range_lock.with_lock(first * size, count * size, [&] {
+                    for (uint64_t k = first; k < first + count; k++) {
+                        counters[k]++;
+                    }
+                });
+                expected += count;
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    uint64_t total = 0;
+    for (auto c : counters) {
+        total += c;
+    }
+    assert(total == expected);
+    assert(torn_reads == 0);
+    std::cout << "Checked " << total << " increments under concurrent overlapping locks\n";
+}
+
+template <typename RangeLock>
+static void writer_fairness_test(RangeLock& range_lock) {
+    print_test_name();
+
+    const unsigned readers = 4;
+    const unsigned writes = 100;
+    auto size = range_lock.region_size();
+    std::atomic<bool> stop(false);
+    std::atomic<unsigned> reads(0);
+    std::vector<std::thread> ts;
+    // Readers overlap each other, so the range is never free of readers.
+    for (unsigned i = 0; i < readers; i++) {
+        ts.push_back(std::thread([&, i] {
+            while (!stop) {
+                range_lock.with_lock_shared(i * size, 8 * size, [&] {
+                    reads++;
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                });
+            }
+        }));
+    }
+    while (reads < 100) {
+        std::this_thread::yield();
+    }
+
+    std::cout << "Checking that a writer isn't starved by a continuous flow of readers\n";
+    auto worst = std::chrono::steady_clock::duration::zero();
+    for (unsigned i = 0; i < writes; i++) {
+        auto start = std::chrono::steady_clock::now();
+        range_lock.lock(0, 12 * size);
+        worst = std::max(worst, std::chrono::steady_clock::now() - start);
+        range_lock.unlock(0, 12 * size);
+    }
+    stop = true;
+    for (auto& t : ts) {
+        t.join();
+    }
+    assert(worst < std::chrono::seconds(1));
+    std::cout << "Succeeded, worst wait was "
+        << std::chrono::duration_cast<std::chrono::microseconds>(worst).count() << "us\n";
+}
+
+static void reader_bias_test() {
+    print_test_name();
+
+    reader_biased_region_mutex<> mutex;
+    // Revocation is inhibited for a while after a writer, in proportion to
+    // the time it waited for readers.
+    auto restore_bias = [&mutex] {
+        while (!mutex.biased()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            mutex.lock_shared();
+            mutex.unlock_shared();
+        }
+    };
+    std::cout << "Checking that the first reader biases the mutex, and a writer revokes it\n";
+    assert(!mutex.biased());
+    mutex.lock_shared();
+    assert(mutex.biased());
+    mutex.unlock_shared();
+    mutex.lock();
+    assert(!mutex.biased());
+    assert(!from_another_thread([&] { return mutex.try_lock_shared(); }));
+    mutex.unlock();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that writers are kept out by readers announced in slots\n";
+    restore_bias();
+    mutex.lock_shared();
+    assert(mutex.biased());
+    assert(from_another_thread([&] {
+        bool acquired = mutex.try_lock_shared();
+        if (acquired) {
+            mutex.unlock_shared();
+        }
+        return acquired;
+    }));
+    assert(!from_another_thread([&] { return mutex.try_lock(); }));
+    assert(!from_another_thread([&] { return mutex.try_lock_for(std::chrono::milliseconds(10)); }));
+    std::atomic<bool> locked(false);
+    auto writer = std::thread([&] {
+        mutex.lock();
+        locked = true;
+        mutex.unlock();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!locked);
+    mutex.unlock_shared();
+    writer.join();
+    assert(locked);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a reader nested in a biased one releases the right way\n";
+    restore_bias();
+    mutex.lock_shared();
+    mutex.lock_shared();
+    mutex.unlock_shared();
+    mutex.unlock_shared();
+    assert(from_another_thread([&] {
+        bool acquired = mutex.try_lock();
+        if (acquired) {
+            mutex.unlock();
+        }
+        return acquired;
+    }));
+    std::cout << "Succeeded\n";
+}
+
+// Only for region mutexes supporting upgradeable ownership.
+template <typename RangeLock>
+static void upgrade_test(RangeLock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that upgradeable ownership is shared with readers only\n";
+    range_lock.lock_upgrade(0, 3 * size);
+    assert(from_another_thread([&] {
+        bool acquired = range_lock.try_lock_shared(size, size);
+        if (acquired) {
+            range_lock.unlock_shared(size, size);
+        }
+        return acquired;
+    }));
+    assert(!from_another_thread([&] { return range_lock.try_lock(size, size); }));
+    assert(!from_another_thread([&] { return range_lock.try_lock_upgrade(2 * size, size); }));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that upgrade waits for readers in place\n";
+    std::atomic<bool> reading(false);
+    std::atomic<bool> done_reading(false);
+    auto reader = std::thread([&] {
+        range_lock.lock_shared(size, size);
+        reading = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        done_reading = true;
+        range_lock.unlock_shared(size, size);
+    });
+    while (!reading) {
+        std::this_thread::yield();
+    }
+    range_lock.upgrade(0, 3 * size);
+    assert(done_reading);
+    reader.join();
+    assert(!from_another_thread([&] { return range_lock.try_lock_shared(2 * size, size); }));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that downgrade lets readers in, but not writers\n";
+    range_lock.downgrade(0, 3 * size);
+    assert(from_another_thread([&] {
+        bool acquired = range_lock.try_lock_shared(0, 3 * size);
+        if (acquired) {
+            range_lock.unlock_shared(0, 3 * size);
+        }
+        return acquired;
+    }));
+    assert(!from_another_thread([&] { return range_lock.try_lock(0, size); }));
+    range_lock.unlock_shared(0, 3 * size);
+    assert(range_lock.try_lock(0, 3 * size));
+    range_lock.unlock(0, 3 * size);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that concurrent read-modify-write through upgrades is exclusive\n";
+    const unsigned threads = 4;
+    const unsigned iterations = 2000;
+    std::vector<uint64_t> counters(64, 0);
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % 60;
+                range_lock.lock_upgrade(first * size, 4 * size);
+                uint64_t value = counters[first];
+                range_lock.upgrade(first * size, 4 * size);
+                counters[first] = value + 1;
+                range_lock.downgrade(first * size, 4 * size);
+                range_lock.unlock_shared(first * size, 4 * size);
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    uint64_t total = 0;
+    for (auto c : counters) {
+        total += c;
+    }
+    assert(total == threads * iterations);
+    std::cout << "Succeeded\n";
+}
+
+template <typename RangeLock>
+static void optimistic_read_test(RangeLock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    range_lock.enable_optimistic_reads();
+    std::cout << "Checking that reads are only validated if no writer overlapped them\n";
+    auto ticket = range_lock.read_begin(0, 2 * size);
+    assert(ticket.valid);
+    range_lock.lock_shared(0, size);
+    range_lock.unlock_shared(0, size);
+    assert(range_lock.read_validate(ticket));
+    range_lock.lock(size, size);
+    assert(!range_lock.read_validate(ticket));
+    assert(!range_lock.read_begin(size, 1).valid);
+    assert(range_lock.read_begin(0, size).valid);
+    range_lock.unlock(size, size);
+    ticket = range_lock.read_begin(0, 2 * size);
+    std::thread([&] {
+        range_lock.lock(size, 1);
+        range_lock.unlock(size, 1);
+    }).join();
+    assert(!range_lock.read_validate(ticket));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a writer of many regions sharing a stripe is seen by readers\n";
+    basic_range_lock<sharded_region_table<>> single_stripe_lock(1);
+    single_stripe_lock.enable_optimistic_reads(1);
+    auto single_stripe_ticket = single_stripe_lock.read_begin(1 << 20, 1);
+    single_stripe_lock.lock(0, 1 << 16);
+    assert(!single_stripe_lock.read_begin(1 << 20, 1).valid);
+    assert(!single_stripe_lock.read_validate(single_stripe_ticket));
+    single_stripe_lock.unlock(0, 1 << 16);
+    assert(single_stripe_lock.read_begin(1 << 20, 1).valid);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that upgrades and downgrades are seen by readers\n";
+    range_lock.lock_upgrade(0, size);
+    ticket = range_lock.read_begin(0, size);
+    assert(ticket.valid);
+    range_lock.upgrade(0, size);
+    assert(!range_lock.read_validate(ticket));
+    range_lock.downgrade(0, size);
+    ticket = range_lock.read_begin(0, size);
+    assert(ticket.valid);
+    range_lock.unlock_shared(0, size);
+    assert(range_lock.read_validate(ticket));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that validated optimistic reads are never torn\n";
+    const unsigned writers = 2;
+    const unsigned readers = 4;
+    const unsigned iterations = 20000;
+    std::atomic<uint64_t> first(0);
+    std::atomic<uint64_t> second(0);
+    std::atomic<uint64_t> torn_reads(0);
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i < writers; i++) {
+        ts.push_back(std::thread([&] {
+            for (unsigned j = 0; j < iterations; j++) {
+                range_lock.with_lock(0, 2 * size, [&] {
+                    uint64_t v = first.load(std::memory_order_relaxed) + 1;
+                    first.store(v, std::memory_order_relaxed);
+                    std::this_thread::yield();
+                    second.store(v, std::memory_order_relaxed);
+                });
+            }
+        }));
+    }
+    for (unsigned i = 0; i < readers; i++) {
+        ts.push_back(std::thread([&] {
+            for (unsigned j = 0; j < iterations; j++) {
+                uint64_t a = 0;
+                uint64_t b = 0;
+                range_lock.with_optimistic_read(size, 1, [&] {
+                    a = first.load(std::memory_order_relaxed);
+                    b = second.load(std::memory_order_relaxed);
+                });
+                if (a != b) {
+                    torn_reads++;
+                }
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    assert(torn_reads == 0);
+    assert(first == writers * iterations);
+    std::cout << "Succeeded\n";
+}
+
+static void retention_test() {
+    print_test_name();
+
+    typedef sharded_region_table<> table_type;
+    table_type::region* regions[table_type::batch_size];
+    // A single shard retaining up to 4 regions.
+    table_type table(1, 4);
+    std::cout << "Checking that a region released and pinned again was retained\n";
+    table.pin(0, 1, regions);
+    assert(!regions[0]->retained);
+    table.unpin(0, 1, [] (table_type::region&) {});
+    table.pin(0, 1, regions);
+    assert(regions[0]->retained && regions[0]->refcount == 1);
+    table.unpin(0, 1, [] (table_type::region&) {});
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that no more regions than the cap are retained\n";
+    for (uint64_t id = 0; id < 64; id++) {
+        table.pin(id, 1, regions);
+        table.unpin(id, 1, [] (table_type::region&) {});
+    }
+#ifdef RANGE_LOCK_STATS
+    table.reset_stats();
+#endif
+    table.pin(0, 64, regions);
+    unsigned retained = 0;
+    for (unsigned i = 0; i < 64; i++) {
+        retained += regions[i]->retained;
+    }
+    // The last released region is retained, and the clock leaves
+    // between three quarters of the cap and the cap.
+    assert(regions[63]->retained);
+    assert(retained >= 3 && retained <= 4);
+#ifdef RANGE_LOCK_STATS
+    assert(table.stats().live_regions == 64);
+    assert(table.stats().reused_regions == retained);
+#endif
+    table.unpin(0, 64, [] (table_type::region&) {});
+#ifdef RANGE_LOCK_STATS
+    assert(table.stats().live_regions <= 4);
+#endif
+    std::cout << "Succeeded\n";
+}
+
+static void handle_cache_test() {
+    print_test_name();
+
+    typedef sharded_region_table<> table_type;
+    table_type::region* regions[table_type::batch_size];
+    table_type table(1, 0, true);
+    std::cout << "Checking that a cached region stays pinned by the thread\n";
+    table.pin(0, 4, regions);
+    assert(regions[0]->refcount == 2);
+    table.unpin(0, 4, [] (table_type::region&) {});
+    assert(regions[0]->refcount == 1);
+    table_type::region* first = regions[0];
+#ifdef RANGE_LOCK_STATS
+    table.reset_stats();
+#endif
+    table.pin(0, 4, regions);
+    assert(regions[0] == first && regions[0]->refcount == 2);
+#ifdef RANGE_LOCK_STATS
+    assert(table.stats().cached_pins == 1);
+#endif
+    table.unpin_pinned(0, 4, regions, [] (table_type::region&) {});
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a region evicted from the cache is released\n";
+    // Region 16 maps to the handle of region 0.
+    table.pin(16, 1, regions);
+    table.unpin(16, 1, [] (table_type::region&) {});
+    table.pin(0, 1, regions);
+    assert(regions[0]->refcount == 2);
+    table.unpin(0, 1, [] (table_type::region&) {});
+#ifdef RANGE_LOCK_STATS
+    assert(table.stats().live_regions == 4);
+#endif
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that handles are dropped after a flush\n";
+    table.flush_handle_caches();
+    table.pin(32, 1, regions);
+    table.unpin(32, 1, [] (table_type::region&) {});
+#ifdef RANGE_LOCK_STATS
+    assert(table.stats().live_regions == 1);
+#endif
+    std::cout << "Checking that other threads don't see the handles of this one\n";
+    std::thread([&] {
+        table_type::region* r[table_type::batch_size];
+        table.pin(32, 1, r);
+        assert(r[0]->refcount == 3);
+        table.unpin(32, 1, [] (table_type::region&) {});
+    }).join();
+    std::cout << "Succeeded\n";
+}
+
+static void footprint_test() {
+    print_test_name();
+
+    const uint64_t size = 4096;
+    basic_range_lock<sharded_region_table<>> range_lock(size, 1);
+    std::cout << "Checking that the footprint follows the live regions\n";
+    auto empty = range_lock.footprint();
+    assert(empty.live_regions == 0 && empty.bytes > 0);
+    range_lock.lock(0, 100 * size);
+    auto locked = range_lock.footprint();
+    assert(locked.live_regions == 100);
+    assert(locked.bytes > empty.bytes && locked.peak_bytes == locked.bytes);
+    range_lock.unlock(0, 100 * size);
+    auto unlocked = range_lock.footprint();
+    // The nodes of erased regions are kept for reuse.
+    assert(unlocked.live_regions == 0 && unlocked.bytes == locked.bytes);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that only tables giving memory back take a target\n";
+    assert(!create_dense_range_lock(pow(2, 30))->set_footprint_target(1 << 20));
+    assert(!basic_range_lock<lockfree_region_table<>>::create_range_lock(pow(2, 30))->set_footprint_target(1 << 20));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a request outgrowing the target coarsens the granularity\n";
+    assert(range_lock.set_footprint_target(unlocked.bytes + 4096));
+    assert(range_lock.whole_resource_locks_enabled());
+    range_lock.lock(0, 100000 * size);
+    auto coarse_size = range_lock.region_size();
+    assert(coarse_size >= size * 64);
+    auto coarsened = range_lock.footprint();
+    assert(coarsened.live_regions <= 100000 / 64 + 1);
+    assert(coarsened.bytes < unlocked.bytes && coarsened.peak_bytes == locked.peak_bytes);
+    assert(!range_lock.try_lock(size, size));
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the target is outgrown, and the granularity kept, while a range is held\n";
+    uint64_t far = uint64_t(1) << 50;
+    assert(range_lock.try_lock(far, 100000 * coarse_size));
+    assert(range_lock.region_size() == coarse_size);
+    assert(range_lock.footprint().bytes > range_lock.footprint_target());
+    range_lock.unlock(far, 100000 * coarse_size);
+    range_lock.unlock(0, 100000 * size);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the granularity is kept once a thread held two ranges at once\n";
+    basic_range_lock<sharded_region_table<>> nesting_range_lock(size, 1);
+    assert(nesting_range_lock.set_footprint_target(nesting_range_lock.footprint().bytes + 4096));
+    nesting_range_lock.lock(0, size);
+    nesting_range_lock.lock(2 * size, size);
+    nesting_range_lock.unlock(2 * size, size);
+    nesting_range_lock.unlock(0, size);
+    nesting_range_lock.lock(0, 100000 * size);
+    assert(nesting_range_lock.region_size() == size);
+    assert(nesting_range_lock.try_lock(100000 * size, size));
+    nesting_range_lock.unlock(100000 * size, size);
+    nesting_range_lock.unlock(0, 100000 * size);
+    std::cout << "Succeeded\n";
+}
+
+template <typename RangeLock>
+static void workload_sampling_test(RangeLock& lock) {
+    print_test_name();
+
+    std::cout << "Checking that 4 KiB requests are profiled and get 4 KiB regions recommended\n";
+    lock.reset_sampled_workload();
+    lock.enable_sampling(1);
+    for (uint64_t i = 0; i < 1000; i++) {
+        lock.with_lock(i * 4096, 4096, [] {});
+    }
+    lock.disable_sampling();
+    lock.with_lock(0, 4096, [] {});
+
+    workload_profile profile = lock.sampled_workload();
+    assert(profile.samples == 1000);
+    assert(profile.conflicts == 0);
+    assert(profile.lengths[12] == 1000);
+    assert(profile.lengths_in_regions[0] == 1000);
+    assert(profile.recommended_region_size() == 4096);
+    auto tuned_range_lock = range_lock::create_range_lock(pow(2, 30), profile);
+    assert(tuned_range_lock->region_size() == 4096);
+    std::cout << "Succeeded\n";
+    lock.reset_sampled_workload();
+}
+
+#ifdef RANGE_LOCK_STATS
+template <typename RangeLock>
+static void stats_test(RangeLock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    range_lock.reset_stats();
+    std::atomic<bool> locked(false);
+    auto t = std::thread([&] {
+        range_lock.lock(2 * size, size);
+        locked = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        range_lock.unlock(2 * size, size);
+    });
+    while (!locked) {
+        std::this_thread::yield();
+    }
+    bool acquired = range_lock.try_lock(0, 4 * size);
+    assert(!acquired);
+    range_lock.lock(size, 2 * size);
+    range_lock.unlock(size, 2 * size);
+    t.join();
+    range_lock.with_lock_shared(0, size, [] {});
+
+    std::cout << "Checking acquisition, failure and contention counters\n";
+    range_lock_stats st = range_lock.stats();
+    assert(st.exclusive.acquisitions == 2);
+    assert(st.exclusive.try_lock_failures == 1);
+    assert(st.shared.acquisitions == 1);
+    assert(st.shared.try_lock_failures == 0);
+    assert(!st.hottest_regions.empty());
+    assert(st.hottest_regions[0].region_id == 2);
+    assert(st.hottest_regions[0].contended_acquisitions == 2);
+    assert(st.table.peak_live_regions >= 3);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the blocked request waited, and the holder held, for about 50ms\n";
+    auto slowest = [] (const uint64_t (&histogram)[range_lock_stats::buckets]) {
+        unsigned bucket = 0;
+        for (unsigned i = 0; i < range_lock_stats::buckets; i++) {
+            if (histogram[i]) {
+                bucket = i;
+            }
+        }
+        return uint64_t(1) << (bucket + 1);
+    };
+    assert(slowest(st.exclusive.wait_ns) > 10000000);
+    assert(slowest(st.exclusive.hold_ns) > 50000000);
+    std::cout << "Succeeded\n";
+    range_lock.reset_stats();
+}
+#endif
+
+template <typename RangeLock>
+static void run_tests(RangeLock& range_lock, bool supports_shared_ownership = true) {
+    std::cout << "Range lock granularity (a.k.a. region size): " << range_lock.region_size() << std::endl;
+
+    basic_range_lock_test(range_lock);
+    if (supports_shared_ownership) {
+        basic_range_lock_shared_test(range_lock);
+    }
+    try_lock_test(range_lock);
+    timed_lock_test(range_lock, supports_shared_ownership);
+    unaligned_range_test(range_lock);
+    resize_test(range_lock, supports_shared_ownership);
+    vectored_lock_test(range_lock, supports_shared_ownership);
+    guard_test(range_lock, supports_shared_ownership);
+    mutual_exclusion_test(range_lock);
+    workload_sampling_test(range_lock);
+#ifdef RANGE_LOCK_STATS
+    stats_test(range_lock);
+#endif
+}
+
+template <typename RangeLock>
+static void whole_resource_test(RangeLock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that the whole resource is busy while any range is locked\n";
+    range_lock.lock(0, size);
+    assert(!range_lock.try_lock_all());
+    assert(!range_lock.try_lock_all_shared());
+    range_lock.unlock(0, size);
+    range_lock.lock_shared(0, size);
+    assert(!range_lock.try_lock_all());
+    assert(range_lock.try_lock_all_shared());
+    range_lock.unlock_all_shared();
+    range_lock.unlock_shared(0, size);
+    range_lock.lock_upgrade(0, size);
+    assert(!range_lock.try_lock_all_shared());
+    range_lock.unlock_upgrade(0, size);
+    assert(range_lock.try_lock_all());
+    range_lock.unlock_all();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that extended, partly released and downgraded ranges are accounted for\n";
+    range_lock.lock(0, size);
+    range_lock.extend(0, size, 4 * size);
+    range_lock.unlock_part(0, 4 * size, 0, size);
+    assert(!range_lock.try_lock_all());
+    range_lock.unlock(size, 3 * size);
+    range_lock.lock(0, 2 * size);
+    range_lock.downgrade(0, 2 * size);
+    assert(range_lock.try_lock_all_shared());
+    range_lock.unlock_all_shared();
+    range_lock.unlock_shared(0, 2 * size);
+    byte_range ranges[] = { { 0, size }, { 8 * size, size } };
+    range_lock.lock_ranges(ranges, 2);
+    assert(!range_lock.try_lock_all());
+    range_lock.unlock_ranges(ranges, 2);
+    {
+        auto guard = range_lock.lock_guarded(0, 2 * size);
+        assert(!range_lock.try_lock_all());
+    }
+    assert(range_lock.try_lock_all());
+    range_lock.unlock_all();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the whole resource keeps lockers out\n";
+    range_lock.lock_all();
+    std::thread([&] {
+        assert(!range_lock.try_lock(1 << 20, size));
+        assert(!range_lock.try_lock_shared(1 << 20, size));
+        assert(!range_lock.try_lock_for(1 << 20, size, std::chrono::milliseconds(10)));
+    }).join();
+    range_lock.unlock_all();
+    range_lock.lock_all_shared();
+    std::thread([&] {
+        assert(range_lock.try_lock_shared(1 << 20, size));
+        range_lock.unlock_shared(1 << 20, size);
+        assert(!range_lock.try_lock(1 << 20, size));
+        assert(!range_lock.try_lock_upgrade(1 << 20, size));
+    }).join();
+    range_lock.unlock_all_shared();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that lockers in flight are drained, and new ones wait\n";
+    std::atomic<bool> held(false);
+    std::atomic<bool> released(false);
+    std::atomic<bool> locked_again(false);
+    std::thread holder([&] {
+        range_lock.lock(0, size);
+        held = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        released = true;
+        range_lock.unlock(0, size);
+    });
+    while (!held) {
+        std::this_thread::yield();
+    }
+    range_lock.lock_all();
+    assert(released);
+    std::thread waiter([&] {
+        range_lock.lock(1 << 20, size);
+        locked_again = true;
+        range_lock.unlock(1 << 20, size);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!locked_again);
+    range_lock.unlock_all();
+    holder.join();
+    waiter.join();
+    assert(locked_again);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a thread holding a range may lock another while being drained\n";
+    held = false;
+    std::atomic<bool> nested(false);
+    std::thread nester([&] {
+        range_lock.lock(0, size);
+        held = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        range_lock.lock(1 << 20, size);
+        range_lock.lock_shared(2 << 20, size);
+        nested = true;
+        range_lock.unlock_shared(2 << 20, size);
+        range_lock.unlock(1 << 20, size);
+        range_lock.unlock(0, size);
+    });
+    while (!held) {
+        std::this_thread::yield();
+    }
+    range_lock.lock_all();
+    assert(nested);
+    range_lock.unlock_all();
+    nester.join();
+    nested = false;
+    held = false;
+    nester = std::thread([&] {
+        range_lock.lock(0, size);
+        held = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        range_lock.lock(1 << 20, size);
+        nested = true;
+        range_lock.unlock(1 << 20, size);
+        range_lock.unlock(0, size);
+    });
+    while (!held) {
+        std::this_thread::yield();
+    }
+    range_lock.lock_all_shared();
+    assert(nested);
+    range_lock.unlock_all_shared();
+    nester.join();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that threads holding nothing are kept out while draining\n";
+    held = false;
+    std::atomic<bool> release(false);
+    nester = std::thread([&] {
+        range_lock.lock(0, size);
+        held = true;
+        while (!release) {
+            std::this_thread::yield();
+        }
+        range_lock.unlock(0, size);
+    });
+    while (!held) {
+        std::this_thread::yield();
+    }
+    std::thread drainer([&] {
+        range_lock.lock_all();
+        range_lock.unlock_all();
+    });
+    while (range_lock.try_lock(1 << 20, size)) {
+        range_lock.unlock(1 << 20, size);
+        std::this_thread::yield();
+    }
+    // Some of them likely share a stripe with the holder.
+    std::vector<std::thread> outsiders;
+    for (unsigned i = 0; i < 32; i++) {
+        outsiders.push_back(std::thread([&, i] {
+            assert(!range_lock.try_lock((1 << 20) + i * size, size));
+        }));
+    }
+    for (auto& t : outsiders) {
+        t.join();
+    }
+    release = true;
+    nester.join();
+    drainer.join();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the whole resource excludes concurrent writers\n";
+    const unsigned threads = 4;
+    const unsigned iterations = 5000;
+    const uint64_t regions = 64;
+    std::vector<uint64_t> counters(regions, 0);
+    std::atomic<uint64_t> expected(0);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % regions;
+                uint64_t count = 1 + (state >> 20) % std::min(regions - first, uint64_t(8));
+                range_lock.with_lock(first * size, count * size, [&] {
+                    for (uint64_t k = first; k < first + count; k++) {
+                        counters[k]++;
+                    }
+                    expected += count;
+                });
+            }
+        }));
+    }
+    ts.push_back(std::thread([&] {
+        while (!stop) {
+            // With the whole resource held, the counters add up to expected.
+            range_lock.lock_all();
+            uint64_t total = 0;
+            for (auto c : counters) {
+                total += c;
+            }
+            assert(total == expected);
+            range_lock.unlock_all();
+            std::this_thread::yield();
+        }
+    }));
+    for (unsigned i = 0; i < threads; i++) {
+        ts[i].join();
+    }
+    stop = true;
+    ts.back().join();
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that optimistic reads are failed by the whole resource held\n";
+    range_lock.enable_optimistic_reads();
+    auto ticket = range_lock.read_begin(0, size);
+    assert(ticket.valid);
+    range_lock.lock_all();
+    assert(!range_lock.read_begin(0, size).valid);
+    range_lock.unlock_all();
+    assert(!range_lock.read_validate(ticket));
+    ticket = range_lock.read_begin(0, size);
+    range_lock.lock_all_shared();
+    assert(range_lock.read_begin(0, size).valid);
+    range_lock.unlock_all_shared();
+    assert(range_lock.read_validate(ticket));
+    std::cout << "Succeeded\n";
+}
+
+static void lock_elision_test() {
+    print_test_name();
+
+    auto dense = create_dense_range_lock(pow(2, 30));
+    auto size = dense->region_size();
+    std::cout << "Checking that elision is only enabled where it's supported\n";
+    bool enabled = dense->enable_lock_elision();
+    assert(enabled == range_lock_detail::lock_elision::supported());
+    assert(dense->lock_elision_enabled() == enabled);
+    assert(!range_lock::create_range_lock(pow(2, 30))->enable_lock_elision());
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a throwing section releases its range\n";
+    bool thrown = false;
+    try {
+        dense->with_lock(0, size, [] { throw std::runtime_error("section"); });
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(dense->try_lock(0, size));
+    dense->unlock(0, size);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that elided and locked sections exclude each other\n";
+    const unsigned threads = 4;
+    const unsigned iterations = 20000;
+    const uint64_t regions = 16;
+    std::vector<uint64_t> counters(regions, 0);
+    std::atomic<uint64_t> expected(0);
+    std::atomic<uint64_t> torn_reads(0);
+    std::vector<std::thread> ts;
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % (regions - 4);
+                uint64_t count = 1 + (state >> 20) % 4;
+                auto increment = [&] {
+                    for (uint64_t k = first; k < first + count; k++) {
+                        counters[k]++;
+                    }
+                };
+                switch (j % 3) {
+                case 0:
+                    dense->with_lock(first * size, count * size, increment);
+                    expected += count;
+                    break;
+                case 1:
+                    // Sections too long to be elided, and explicit locks.
+                    dense->lock(first * size, count * size);
+                    increment();
+                    dense->unlock(first * size, count * size);
+                    expected += count;
+                    break;
+                default:
+                    // No system call, which would abort the transaction.
+                    dense->with_lock_shared(first * size, 2 * size, [&] {
+                        uint64_t before = counters[first] + counters[first + 1];
+                        std::atomic_signal_fence(std::memory_order_seq_cst);
+                        if (counters[first] + counters[first + 1] != before) {
+                            torn_reads++;
+                        }
+                    });
+                }
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    uint64_t total = 0;
+    for (auto c : counters) {
+        total += c;
+    }
+    assert(total == expected);
+    assert(torn_reads == 0);
+    auto st = dense->elision_stats();
+    assert(st.attempts == st.commits + st.aborts);
+    assert(enabled || st.attempts == 0);
+    std::cout << "Elided " << st.commits << " sections, with " << st.aborts << " aborts and "
+        << st.suspensions << " suspensions\n";
+}
+
 int main(void) {
     auto range_lock = range_lock::create_range_lock(pow(2, 30));
-    std::cout << "Range lock granularity (a.k.a. region size): " << range_lock->region_size() << std::endl;
+    run_tests(*range_lock);
+    upgrade_test(*range_lock);
+    optimistic_read_test(*range_lock);
+
+    std::cout << "\nTesting range lock with whole-resource locks\n";
+    auto gated_range_lock = range_lock::create_range_lock(pow(2, 30));
+    gated_range_lock->enable_whole_resource_locks();
+    run_tests(*gated_range_lock);
+    upgrade_test(*gated_range_lock);
+    whole_resource_test(*gated_range_lock);
+
+    std::cout << "\nTesting range lock with lock-free region table\n";
+    auto lockfree_range_lock = basic_range_lock<lockfree_region_table<>>::create_range_lock(pow(2, 30));
+    run_tests(*lockfree_range_lock);
+    upgrade_test(*lockfree_range_lock);
+
+    std::cout << "\nTesting range lock with dense region table\n";
+    auto dense_range_lock = create_dense_range_lock(pow(2, 30));
+    run_tests(*dense_range_lock);
+    upgrade_test(*dense_range_lock);
+    optimistic_read_test(*dense_range_lock);
+    lock_elision_test();
+
+    std::cout << "\nTesting range lock retaining unreferenced regions\n";
+    basic_range_lock<sharded_region_table<>> retaining_range_lock(4096,
+        sharded_region_table<>::default_shard_count(), 1024);
+    run_tests(retaining_range_lock);
+    retention_test();
+
+    std::cout << "\nTesting range lock with handle caches\n";
+    basic_range_lock<sharded_region_table<>> caching_range_lock(4096,
+        sharded_region_table<>::default_shard_count(), 0, true);
+    run_tests(caching_range_lock);
+    handle_cache_test();
+
+    std::cout << "\nTesting range lock with a footprint target\n";
+    footprint_test();
+    basic_range_lock<sharded_region_table<>> coarsening_range_lock(4096);
+    coarsening_range_lock.set_footprint_target(coarsening_range_lock.footprint().bytes + 16384);
+    mutual_exclusion_test(coarsening_range_lock);
+    std::cout << "Region size grew to " << coarsening_range_lock.region_size() << "\n";
+
+    std::cout << "\nTesting range lock with standard region mutexes\n";
+    auto std_range_lock = basic_range_lock<sharded_region_table<std_region_mutex>>::create_range_lock(pow(2, 30));
+    // std::shared_timed_mutex is only available from C++14 on.
+    run_tests(*std_range_lock, __cplusplus >= 201402L);
+
+    // Spinning is off by default on single CPU machines.
+    std::cout << "\nTesting range lock with spinning forced on, then off\n";
+    unsigned default_max_spins = range_lock_detail::adaptive_spin::max_spins();
+    compact_region_mutex::set_max_spins(1000);
+    mutual_exclusion_test(*range_lock);
+    timed_lock_test(*range_lock, true);
+    compact_region_mutex::set_max_spins(0);
+    mutual_exclusion_test(*range_lock);
+    compact_region_mutex::set_max_spins(default_max_spins);
+
+    std::cout << "\nTesting range lock with fair region mutexes\n";
+    auto fair_range_lock = fair_range_lock::create_range_lock(pow(2, 30));
+    run_tests(*fair_range_lock);
+    writer_fairness_test(*fair_range_lock);
 
-    basic_range_lock_test(*range_lock);
-    basic_range_lock_shared_test(*range_lock);
-    try_lock_test(*range_lock);
+    std::cout << "\nTesting range lock with reader-biased region mutexes\n";
+    auto read_mostly_range_lock = create_read_mostly_range_lock(pow(2, 30));
+    run_tests(*read_mostly_range_lock);
+    reader_bias_test();
 
     return 0;
 }
@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#if !defined(__linux__)
+#error "range_locked_file.hh requires Linux"
+#endif
+
+#include "range_lock.hh"
+#include <mutex>
+#include <vector>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+
+namespace range_lock_detail {
+
+/// Minimal io_uring instance, set up with raw syscalls: a submission ring
+/// filled by a single thread and a completion ring reaped by that same
+/// thread. valid() is false if the kernel doesn't provide io_uring, or
+/// forbids it.
+class io_ring {
+    int _fd = -1;
+    unsigned _entries = 0;
+    void* _sq_ring = MAP_FAILED;
+    size_t _sq_ring_size = 0;
+    void* _cq_ring = MAP_FAILED;
+    size_t _cq_ring_size = 0;
+    io_uring_sqe* _sqes = nullptr;
+    size_t _sqes_size = 0;
+    std::atomic<unsigned>* _sq_head = nullptr;
+    std::atomic<unsigned>* _sq_tail = nullptr;
+    unsigned _sq_mask = 0;
+    unsigned* _sq_array = nullptr;
+    std::atomic<unsigned>* _cq_head = nullptr;
+    std::atomic<unsigned>* _cq_tail = nullptr;
+    unsigned _cq_mask = 0;
+    io_uring_cqe* _cqes = nullptr;
+    // Entries queued since the last submission.
+    unsigned _queued = 0;
+
+    static_assert(sizeof(std::atomic<unsigned>) == sizeof(unsigned), "ring indexes are shared with the kernel");
+
+    template <typename T>
+    T* at(void* ring, uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+    }
+
+    void release() {
+        if (_sqes) {
+            ::munmap(_sqes, _sqes_size);
+        }
+        if (_cq_ring != MAP_FAILED) {
+            ::munmap(_cq_ring, _cq_ring_size);
+        }
+        if (_sq_ring != MAP_FAILED) {
+            ::munmap(_sq_ring, _sq_ring_size);
+        }
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+        _sqes = nullptr;
+        _cq_ring = _sq_ring = MAP_FAILED;
+        _fd = -1;
+    }
+
+    // Whether the kernel knows the operation, IORING_OP_READ and
+    // IORING_OP_WRITE appeared in Linux 5.6 along with the probe.
+    bool supports(unsigned op) {
+        const unsigned ops = IORING_OP_WRITE + 1;
+        alignas(io_uring_probe) char buf[sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)] = {};
+        auto probe = reinterpret_cast<io_uring_probe*>(buf);
+        if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, ops) < 0 || op > probe->last_op) {
+            return false;
+        }
+        return probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+    }
+
+    void* map(size_t size, off_t offset) {
+        return ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, offset);
+    }
+public:
+    explicit io_ring(unsigned entries) {
+        io_uring_params p = {};
+        _fd = int(syscall(__NR_io_uring_setup, entries, &p));
+        if (_fd < 0) {
+            _fd = -1;
+            return;
+        }
+        _entries = p.sq_entries;
+        _sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        _cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        _sq_ring = map(_sq_ring_size, IORING_OFF_SQ_RING);
+        _cq_ring = map(_cq_ring_size, IORING_OFF_CQ_RING);
+        void* sqes = map(_sqes_size, IORING_OFF_SQES);
+        if (_sq_ring == MAP_FAILED || _cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) {
+                ::munmap(sqes, _sqes_size);
+            }
+            release();
+            return;
+        }
+        _sqes = static_cast<io_uring_sqe*>(sqes);
+        _sq_head = at<std::atomic<unsigned>>(_sq_ring, p.sq_off.head);
+        _sq_tail = at<std::atomic<unsigned>>(_sq_ring, p.sq_off.tail);
+        _sq_mask = *at<unsigned>(_sq_ring, p.sq_off.ring_mask);
+        _sq_array = at<unsigned>(_sq_ring, p.sq_off.array);
+        _cq_head = at<std::atomic<unsigned>>(_cq_ring, p.cq_off.head);
+        _cq_tail = at<std::atomic<unsigned>>(_cq_ring, p.cq_off.tail);
+        _cq_mask = *at<unsigned>(_cq_ring, p.cq_off.ring_mask);
+        _cqes = at<io_uring_cqe>(_cq_ring, p.cq_off.cqes);
+        if (!supports(IORING_OP_READ) || !supports(IORING_OP_WRITE)) {
+            release();
+        }
+    }
+
+    ~io_ring() {
+        release();
+    }
+
+    io_ring(const io_ring&) = delete;
+    io_ring& operator=(const io_ring&) = delete;
+
+    bool valid() const { return _fd >= 0; }
+    unsigned entries() const { return _entries; }
+    unsigned queued() const { return _queued; }
+
+    // Queue a read (or a write) of length bytes at offset of fd, completed
+    // with user_data. The caller must have no more than entries() requests
+    // in flight.
+    void queue(int fd, bool write, uint64_t offset, void* buf, uint32_t length, uint64_t user_data) {
+        unsigned tail = _sq_tail->load(std::memory_order_relaxed);
+        assert(tail - _sq_head->load(std::memory_order_acquire) < _entries); // assert ring isn't full
+        unsigned index = tail & _sq_mask;
+        io_uring_sqe& sqe = _sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.off = offset;
+        sqe.addr = reinterpret_cast<uint64_t>(buf);
+        sqe.len = length;
+        sqe.user_data = user_data;
+        _sq_array[index] = index;
+        _sq_tail->store(tail + 1, std::memory_order_release);
+        _queued++;
+    }
+
+    // Submit the queued requests, and wait for at least min_complete
+    // completions.
+    void submit(unsigned min_complete) {
+        for (;;) {
+            unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+            long ret = syscall(__NR_io_uring_enter, _fd, _queued, min_complete, flags, nullptr, 0);
+            if (ret >= 0) {
+                _queued -= std::min(_queued, unsigned(ret));
+                if (!_queued || min_complete) {
+                    return;
+                }
+                continue;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+    }
+
+    // Wait for at least min_complete completions to be available, without
+    // submitting anything. Never throws, as callers rely on it to know when
+    // the kernel is done with their buffers, and polls the completion queue
+    // if waiting in the kernel fails.
+    void wait(unsigned min_complete) {
+        while (_cq_tail->load(std::memory_order_acquire) - _cq_head->load(std::memory_order_relaxed) < min_complete) {
+            long ret = syscall(__NR_io_uring_enter, _fd, 0, min_complete, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && errno != EINTR) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+
+    // Call f(user_data, res) for each completion available, and return
+    // how many there were.
+    template <typename Func>
+    unsigned reap(Func&& f) {
+        unsigned head = _cq_head->load(std::memory_order_relaxed);
+        unsigned tail = _cq_tail->load(std::memory_order_acquire);
+        for (unsigned i = head; i != tail; i++) {
+            const io_uring_cqe& cqe = _cqes[i & _cq_mask];
+            f(cqe.user_data, cqe.res);
+        }
+        _cq_head->store(tail, std::memory_order_release);
+        return tail - head;
+    }
+};
+
+}
+
+/// \brief Range locked file
+///
+/// Reads and writes to a file, each holding exactly the regions it touches:
+/// reads for shared ownership, writes for exclusive ownership. So concurrent
+/// readers and writers of the file never see torn data, while accesses to
+/// different regions proceed in parallel.
+///
+/// submit() runs a batch of accesses through io_uring: each access is
+/// locked and queued in turn, queued accesses are submitted to the kernel
+/// while the following ones are being locked, and each range is released
+/// once its access completes. An access meeting a busy range, like one
+/// still held by an earlier access of the batch, waits for completions of
+/// the batch first, and only blocks once nothing is left in flight, so no
+/// range is held while waiting for another one. Accesses overlapping in a
+/// batch are thus done in the order given. Without io_uring (Linux < 5.6, or
+/// a seccomp policy forbidding it), batches are run with pread() and pwrite().
+class range_locked_file {
+public:
+    struct io_request {
+        bool write;
+        uint64_t offset;
+        void* buf;
+        size_t length;
+        // Same as the return value of pread() or pwrite(), -errno on failure.
+        int64_t result;
+    };
+private:
+    static constexpr unsigned ring_entries = 64;
+    static constexpr unsigned submit_batch = 16;
+
+    // An access in flight, and the range it holds.
+    struct inflight {
+        size_t request;
+        range_lock::unique_guard exclusive;
+        range_lock::shared_guard shared;
+    };
+
+    int _fd;
+    std::unique_ptr<range_lock> _lock;
+    // Rings are owned by one batch at a time, and kept for the next ones.
+    std::mutex _rings_lock;
+    std::vector<std::unique_ptr<range_lock_detail::io_ring>> _idle_rings;
+    bool _io_uring = true;
+
+    static int64_t transfer(int fd, bool write, uint64_t offset, void* buf, size_t length) {
+        size_t done = 0;
+        while (done < length) {
+            char* p = static_cast<char*>(buf) + done;
+            ssize_t ret = write ? ::pwrite(fd, p, length - done, off_t(offset + done))
+                : ::pread(fd, p, length - done, off_t(offset + done));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return done ? int64_t(done) : -int64_t(errno);
+            }
+            if (!ret) {
+                break;
+            }
+            done += size_t(ret);
+        }
+        return int64_t(done);
+    }
+
+    static std::system_error transfer_error(int64_t result, const char* what) {
+        return std::system_error(int(-result), std::generic_category(), what);
+    }
+
+    std::unique_ptr<range_lock_detail::io_ring> get_ring() {
+        {
+            std::lock_guard<std::mutex> lock(_rings_lock);
+            if (!_io_uring) {
+                return nullptr;
+            }
+            if (!_idle_rings.empty()) {
+                auto ring = std::move(_idle_rings.back());
+                _idle_rings.pop_back();
+                return ring;
+            }
+        }
+        std::unique_ptr<range_lock_detail::io_ring> ring(new range_lock_detail::io_ring(ring_entries));
+        if (!ring->valid()) {
+            std::lock_guard<std::mutex> lock(_rings_lock);
+            _io_uring = false;
+            return nullptr;
+        }
+        return ring;
+    }
+
+    void put_ring(std::unique_ptr<range_lock_detail::io_ring> ring) {
+        std::lock_guard<std::mutex> lock(_rings_lock);
+        _idle_rings.push_back(std::move(ring));
+    }
+
+    // Lock the range of req into slot, blocking only if block is set.
+    bool lock_request(const io_request& req, inflight& slot, bool block) {
+        if (req.write) {
+            slot.exclusive = block ? _lock->lock_guarded(req.offset, req.length)
+                : _lock->try_lock_guarded(req.offset, req.length);
+            return slot.exclusive.owns_lock();
+        }
+        slot.shared = block ? _lock->lock_shared_guarded(req.offset, req.length)
+            : _lock->try_lock_shared_guarded(req.offset, req.length);
+        return slot.shared.owns_lock();
+    }
+
+    void run_batch(range_lock_detail::io_ring& ring, io_request* requests, size_t count) {
+        std::vector<inflight> slots(ring.entries());
+        std::vector<unsigned> free_slots;
+        for (unsigned i = ring.entries(); i > 0; i--) {
+            free_slots.push_back(i - 1);
+        }
+        auto complete = [&] (uint64_t user_data, int32_t res) {
+            inflight& slot = slots[user_data];
+            requests[slot.request].result = res;
+            slot.exclusive.unlock();
+            slot.shared.unlock();
+            free_slots.push_back(unsigned(user_data));
+        };
+        // Submit what's queued, wait for min_complete completions, and
+        // release the ranges of the completed accesses.
+        auto progress = [&] (unsigned min_complete) {
+            ring.submit(min_complete);
+            ring.reap(complete);
+        };
+        auto in_flight = [&] {
+            return free_slots.size() < slots.size();
+        };
+
+        try {
+            for (size_t next = 0; next < count;) {
+                io_request& req = requests[next];
+                if (!req.length) {
+                    req.result = 0;
+                    next++;
+                    continue;
+                }
+                if (free_slots.empty()) {
+                    progress(1);
+                    continue;
+                }
+                inflight& slot = slots[free_slots.back()];
+                if (!lock_request(req, slot, false)) {
+                    if (in_flight()) {
+                        progress(1);
+                        continue;
+                    }
+                    lock_request(req, slot, true);
+                }
+                slot.request = next++;
+                // Accesses of 4GB or more are transferred partially, as pread() may.
+                uint32_t length = uint32_t(std::min(req.length, size_t(UINT32_MAX)));
+                ring.queue(_fd, req.write, req.offset, req.buf, length, free_slots.back());
+                free_slots.pop_back();
+                if (ring.queued() >= submit_batch) {
+                    progress(0);
+                }
+            }
+            while (in_flight()) {
+                progress(1);
+            }
+        } catch (...) {
+            // The kernel may still be reading or writing the buffers of the
+            // submitted accesses, so their ranges are only released, and the
+            // ring only closed, once they completed. Queued accesses are
+            // never submitted.
+            while (slots.size() - free_slots.size() > ring.queued()) {
+                ring.wait(1);
+                ring.reap(complete);
+            }
+            throw;
+        }
+    }
+public:
+    range_locked_file(const range_locked_file&) = delete;
+    range_locked_file& operator=(const range_locked_file&) = delete;
+
+    // Access the file open as fd, which must stay open for the lifetime of
+    // this object, with a range lock created for a file of resource_size
+    // bytes, see range_lock::create_range_lock().
+    range_locked_file(int fd, uint64_t resource_size)
+        : _fd(fd)
+        , _lock(range_lock::create_range_lock(resource_size)) {
+        assert(fd >= 0);
+    }
+
+    int fd() const { return _fd; }
+
+    // The range lock, so other accesses to the file can be serialized with
+    // the ones done here.
+    range_lock& locks() { return *_lock; }
+
+    // Whether batches are submitted through io_uring. Becomes false once
+    // setting up a ring failed.
+    bool uses_io_uring() {
+        std::lock_guard<std::mutex> lock(_rings_lock);
+        return _io_uring;
+    }
+
+    // Read up to length bytes at offset into buf, holding the range for
+    // shared ownership. Returns the number of bytes read, short only at the
+    // end of the file, and throws std::system_error on failure.
+    size_t read(uint64_t offset, void* buf, size_t length) {
+        if (!length) {
+            return 0;
+        }
+        range_lock::shared_guard guard = _lock->lock_shared_guarded(offset, length);
+        int64_t ret = transfer(_fd, false, offset, buf, length);
+        if (ret < 0) {
+            throw transfer_error(ret, "pread");
+        }
+        return size_t(ret);
+    }
+
+    // Write length bytes from buf at offset, holding the range for exclusive
+    // ownership. Throws std::system_error on failure.
+    size_t write(uint64_t offset, const void* buf, size_t length) {
+        if (!length) {
+            return 0;
+        }
+        range_lock::unique_guard guard = _lock->lock_guarded(offset, length);
+        int64_t ret = transfer(_fd, true, offset, const_cast<void*>(buf), length);
+        if (ret < 0) {
+            throw transfer_error(ret, "pwrite");
+        }
+        return size_t(ret);
+    }
+
+    // Run a batch of accesses, and return once all of them completed, with
+    // their result set. Unlike read() and write(), failures are reported in
+    // the results, and transfers may be short like with pread() and pwrite().
+    void submit(io_request* requests, size_t count) {
+        auto ring = get_ring();
+        if (!ring) {
+            for (size_t i = 0; i < count; i++) {
+                io_request& req = requests[i];
+                if (!req.length) {
+                    req.result = 0;
+                } else if (req.write) {
+                    range_lock::unique_guard guard = _lock->lock_guarded(req.offset, req.length);
+                    req.result = transfer(_fd, true, req.offset, req.buf, req.length);
+                } else {
+                    range_lock::shared_guard guard = _lock->lock_shared_guarded(req.offset, req.length);
+                    req.result = transfer(_fd, false, req.offset, req.buf, req.length);
+                }
+            }
+            return;
+        }
+        run_batch(*ring, requests, count);
+        put_ring(std::move(ring));
+    }
+
+    // Run batches with pread() and pwrite() from now on, mostly for testing.
+    void disable_io_uring() {
+        std::lock_guard<std::mutex> lock(_rings_lock);
+        _io_uring = false;
+        _idle_rings.clear();
+    }
+};
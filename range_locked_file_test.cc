@@ -0,0 +1,168 @@
+///
+/// Purpose of this program is to test range_locked_file implementation.
+///
+
+#include "range_locked_file.hh"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <assert.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define print_test_name() \
+    std::cout << "\nRunning " << __FUNCTION__ << "...\n";
+
+static const uint64_t resource_size = uint64_t(1) << 24;
+
+static void read_write_test(range_locked_file& file) {
+    print_test_name();
+
+    std::cout << "Checking that written data is read back\n";
+    std::vector<char> out(10000, 'a');
+    std::vector<char> in(10000, 0);
+    assert(file.write(12345, out.data(), out.size()) == out.size());
+    assert(file.read(12345, in.data(), in.size()) == in.size());
+    assert(in == out);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that reads are short only at the end of the file\n";
+    struct stat st;
+    fstat(file.fd(), &st);
+    assert(file.read(uint64_t(st.st_size) - 10, in.data(), in.size()) == 10);
+    assert(file.read(uint64_t(st.st_size), in.data(), in.size()) == 0);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the regions are released after each access\n";
+    assert(file.locks().try_lock(0, resource_size));
+    file.locks().unlock(0, resource_size);
+    std::cout << "Succeeded\n";
+}
+
+static void batch_test(range_locked_file& file) {
+    print_test_name();
+
+    const size_t count = 1000;
+    const size_t block = 512;
+    std::vector<char> data(count * block);
+    std::vector<range_locked_file::io_request> requests(count);
+    std::cout << "Checking that a batch bigger than the ring completes\n";
+    for (size_t i = 0; i < count; i++) {
+        std::fill(data.begin() + i * block, data.begin() + (i + 1) * block, char('0' + i % 64));
+        requests[i] = range_locked_file::io_request{true, i * block, &data[i * block], block, -1};
+    }
+    file.submit(requests.data(), count);
+    for (auto& req : requests) {
+        assert(req.result == int64_t(block));
+    }
+    std::vector<char> in(data.size());
+    assert(file.read(0, in.data(), in.size()) == in.size());
+    assert(in == data);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that overlapping accesses of a batch are done in order\n";
+    // Each block is written, read back, then written again.
+    std::vector<char> first(block, 'x');
+    std::vector<char> second(block, 'y');
+    std::vector<std::vector<char>> reads(64, std::vector<char>(block));
+    requests.clear();
+    for (size_t i = 0; i < 64; i++) {
+        requests.push_back(range_locked_file::io_request{true, i * block, first.data(), block, -1});
+        requests.push_back(range_locked_file::io_request{false, i * block, reads[i].data(), block, -1});
+        requests.push_back(range_locked_file::io_request{true, i * block, second.data(), block, -1});
+    }
+    file.submit(requests.data(), requests.size());
+    for (size_t i = 0; i < 64; i++) {
+        assert(reads[i] == first);
+        assert(file.read(i * block, in.data(), block) == block);
+        assert(std::equal(second.begin(), second.end(), in.begin()));
+    }
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that failures are reported in the results\n";
+    int fd = open("/dev/null", O_WRONLY);
+    range_locked_file write_only(fd, resource_size);
+    if (!file.uses_io_uring()) {
+        write_only.disable_io_uring();
+    }
+    range_locked_file::io_request req{false, 0, in.data(), block, 0};
+    write_only.submit(&req, 1);
+    assert(req.result == -EBADF);
+    close(fd);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that the regions are released once the batch completes\n";
+    assert(file.locks().try_lock(0, resource_size));
+    file.locks().unlock(0, resource_size);
+    std::cout << "Succeeded\n";
+}
+
+static void concurrency_test(range_locked_file& file) {
+    print_test_name();
+
+    const unsigned threads = 4;
+    const unsigned iterations = 300;
+    const size_t block = 4096;
+    const uint64_t blocks = 32;
+    // Away from the blocks written by the other tests.
+    const uint64_t base = resource_size / 2;
+    std::atomic<uint64_t> torn_reads(0);
+    std::vector<std::thread> ts;
+    std::cout << "Checking that batched writes and reads of overlapping ranges never tear\n";
+    for (unsigned i = 0; i < threads; i++) {
+        ts.push_back(std::thread([&, i] {
+            uint64_t state = i + 1;
+            std::vector<char> buf(4 * block);
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % (blocks - 4);
+                size_t length = block * (1 + (state >> 20) % 4);
+                range_locked_file::io_request req{j % 2 == 0, base + first * block, buf.data(), length, -1};
+                if (req.write) {
+                    std::fill(buf.begin(), buf.begin() + length, char(state));
+                }
+                file.submit(&req, 1);
+                assert(req.result == int64_t(length));
+                if (!req.write && !std::all_of(buf.begin(), buf.begin() + block, [&] (char c) {
+                        return c == buf[0];
+                    })) {
+                    torn_reads++;
+                }
+            }
+        }));
+    }
+    for (auto& t : ts) {
+        t.join();
+    }
+    assert(torn_reads == 0);
+    std::cout << "Succeeded\n";
+}
+
+static void run_tests(range_locked_file& file) {
+    read_write_test(file);
+    batch_test(file);
+    concurrency_test(file);
+}
+
+int main(void) {
+    char path[] = "/tmp/range_locked_file_test.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    int ret = ftruncate(fd, off_t(resource_size));
+    assert(ret == 0);
+    (void)ret;
+    range_locked_file file(fd, resource_size);
+    std::cout << "Range lock granularity (a.k.a. region size): " << file.locks().region_size() << std::endl;
+
+    run_tests(file);
+    std::cout << "\nBatches went through io_uring: " << (file.uses_io_uring() ? "yes" : "no") << "\n";
+    file.disable_io_uring();
+    run_tests(file);
+
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#if !defined(__linux__)
+#error "shm_range_lock.hh requires Linux futexes"
+#endif
+
+#include "range_lock.hh"
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "lock words shared between processes must be lock-free");
+
+namespace range_lock_detail {
+
+// Same as park_for() and unpark_all(), for words shared between processes:
+// futexes are keyed by the word's physical page instead of its address.
+inline void park_shared_for(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout) {
+    struct timespec ts;
+    ts.tv_sec = time_t(timeout.count() / 1000000000);
+    ts.tv_nsec = long(timeout.count() % 1000000000);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+inline void unpark_shared_all(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+inline std::atomic<pid_t>& cached_pid() {
+    static std::atomic<pid_t> pid(0);
+    return pid;
+}
+
+// Process id of the caller. glibc doesn't cache it anymore, so it's cached
+// here, and refreshed in the child after fork().
+inline pid_t current_pid() {
+    static int registered = pthread_atfork(nullptr, nullptr, [] {
+        cached_pid().store(::getpid(), std::memory_order_relaxed);
+    });
+    (void)registered;
+    pid_t pid = cached_pid().load(std::memory_order_relaxed);
+    if (!pid) {
+        pid = ::getpid();
+        cached_pid().store(pid, std::memory_order_relaxed);
+    }
+    return pid;
+}
+
+// A zombie still counts as alive until it's reaped.
+inline bool process_is_dead(pid_t pid) {
+    return ::kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+}
+
+/// \brief Shared memory region mutex
+///
+/// Region mutex of shm_range_lock, a single 32-bit word shared between
+/// processes: a parked flag, a shared mode flag, and either the process id
+/// of the exclusive owner or the reader count. Like compact_region_mutex,
+/// uncontended acquisitions are a single CAS, and contended ones spin before
+/// parking on a futex, which isn't private to the process.
+///
+/// Robustness: waiters park for at most owner_check_interval() at a time,
+/// after which, if the word still names the same exclusive owner and that
+/// process is dead, ownership is taken away from it and the region is
+/// released, see recovered_regions(). Whatever the dead owner was writing
+/// may be left inconsistent. Readers aren't recorded individually, so a
+/// process dying while holding regions for shared ownership keeps them
+/// locked. Process ids must come from the same pid namespace, and a dead
+/// owner whose id was reused in the meantime isn't detected.
+class shm_region_mutex {
+    static constexpr uint32_t parked = 1U << 31;
+    static constexpr uint32_t shared_mode = 1U << 30;
+    static constexpr uint32_t holder = shared_mode - 1;
+
+    std::atomic<uint32_t> _word;
+
+    static std::atomic<uint64_t>& recovered() {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+    static bool busy(uint32_t s, bool shared) {
+        uint32_t h = s & ~parked;
+        return h && !(shared && (h & shared_mode));
+    }
+
+    static uint32_t acquired(uint32_t s, bool shared) {
+        if (s & ~parked) {
+            return s + 1; // one more reader
+        }
+        return (s & parked) | (shared ? shared_mode | 1 : uint32_t(range_lock_detail::current_pid()));
+    }
+
+    // Release the region from its dead exclusive owner, if the word still
+    // holds s.
+    void recover(uint32_t s) {
+        uint32_t owner = s & holder;
+        if ((s & shared_mode) || !owner || !range_lock_detail::process_is_dead(pid_t(owner))) {
+            return;
+        }
+        if (_word.compare_exchange_strong(s, 0, std::memory_order_acquire, std::memory_order_relaxed)) {
+            recovered().fetch_add(1, std::memory_order_relaxed);
+            range_lock_detail::unpark_shared_all(_word);
+        }
+    }
+
+    // Park until the word changes from s, for at most timeout, and check the
+    // owner is alive if it didn't.
+    void wait_for(uint32_t s, std::chrono::nanoseconds timeout) {
+        if (!(s & parked)) {
+            if (!_word.compare_exchange_strong(s, s | parked, std::memory_order_relaxed)) {
+                return;
+            }
+            s |= parked;
+        }
+        range_lock_detail::park_shared_for(_word, s, timeout);
+        if (_word.load(std::memory_order_relaxed) == s) {
+            recover(s);
+        }
+    }
+
+    // Acquire the word once it isn't busy, calling wait(s) whenever it is,
+    // until it returns false.
+    template <typename Wait>
+    bool acquire(bool shared, Wait&& wait) {
+        uint32_t s = _word.load(std::memory_order_relaxed);
+        for (;;) {
+            if (!busy(s, shared)) {
+                if (_word.compare_exchange_weak(s, acquired(s, shared), std::memory_order_acquire,
+                        std::memory_order_relaxed)) {
+                    return true;
+                }
+                continue;
+            }
+            if (range_lock_detail::adaptive_spin::spin_until([this, &s, shared] {
+                    s = this->_word.load(std::memory_order_relaxed);
+                    return !busy(s, shared);
+                })) {
+                continue;
+            }
+            if (!wait(s)) {
+                return false;
+            }
+            s = _word.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_acquire(bool shared) {
+        uint32_t s = _word.load(std::memory_order_relaxed);
+        while (!busy(s, shared)) {
+            if (_word.compare_exchange_weak(s, acquired(s, shared), std::memory_order_acquire,
+                    std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename Clock, typename Duration>
+    bool acquire_until(bool shared, const std::chrono::time_point<Clock, Duration>& deadline) {
+        return acquire(shared, [this, &deadline] (uint32_t s) {
+            auto now = Clock::now();
+            if (now >= deadline) {
+                return false;
+            }
+            auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+            this->wait_for(s, std::max(std::min(timeout, owner_check_interval()), std::chrono::nanoseconds(1)));
+            return true;
+        });
+    }
+public:
+    shm_region_mutex() : _word(0) {}
+    shm_region_mutex(const shm_region_mutex&) = delete;
+    shm_region_mutex& operator=(const shm_region_mutex&) = delete;
+
+    // Longest time a waiter parks before checking that the exclusive owner is
+    // still alive.
+    static std::chrono::nanoseconds owner_check_interval() {
+        return std::chrono::milliseconds(100);
+    }
+
+    // Number of regions this process took away from dead owners.
+    static uint64_t recovered_regions() {
+        return recovered().load(std::memory_order_relaxed);
+    }
+
+    bool try_lock() {
+        return try_acquire(false);
+    }
+
+    void lock() {
+        acquire(false, [this] (uint32_t s) {
+            this->wait_for(s, owner_check_interval());
+            return true;
+        });
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        return acquire_until(false, deadline);
+    }
+
+    void unlock() {
+        uint32_t s = _word.exchange(0, std::memory_order_release);
+        assert(!(s & shared_mode) && (s & holder)); // assert mutex is held for exclusive ownership
+        if (s & parked) {
+            range_lock_detail::unpark_shared_all(_word);
+        }
+    }
+
+    bool try_lock_shared() {
+        return try_acquire(true);
+    }
+
+    void lock_shared() {
+        acquire(true, [this] (uint32_t s) {
+            this->wait_for(s, owner_check_interval());
+            return true;
+        });
+    }
+
+    template <typename Clock, typename Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+        return acquire_until(true, deadline);
+    }
+
+    // The last reader clears the word, and the parked flag with it.
+    void unlock_shared() {
+        uint32_t s = _word.load(std::memory_order_relaxed);
+        for (;;) {
+            assert((s & shared_mode) && (s & holder)); // assert mutex is held for shared ownership
+            uint32_t next = (s & holder) == 1 ? 0 : s - 1;
+            if (_word.compare_exchange_weak(s, next, std::memory_order_release, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        if ((s & holder) == 1 && (s & parked)) {
+            range_lock_detail::unpark_shared_all(_word);
+        }
+    }
+};
+
+/// \brief Shared memory region table
+///
+/// Region table of shm_range_lock. Like dense_region_table, every region of
+/// a resource of a fixed size is kept in a flat array indexed by region id,
+/// with no hashing or reference counting, but the array lives in memory
+/// shared between processes, after a small header describing it.
+///
+/// The memory is either given by the caller, usually a MAP_SHARED mapping of
+/// a file or of anonymous memory shared with forked children, or a POSIX
+/// shared memory object opened by name. In both cases, the first process to
+/// attach initializes the segment, and the others wait for it and check
+/// that they agree on the region size and count. The initializing process
+/// is named in the header, so that if it dies before it's done, a waiting
+/// process takes initialization over.
+class shm_region_table {
+public:
+    struct region {
+        shm_region_mutex mutex;
+    };
+    static constexpr unsigned batch_bits = 6;
+    static constexpr unsigned batch_size = 1U << batch_bits;
+private:
+    struct segment_header {
+        uint64_t magic;
+        uint64_t region_size;
+        uint64_t region_count;
+        std::atomic<uint32_t> state;
+        char padding[64 - 3 * sizeof(uint64_t) - sizeof(std::atomic<uint32_t>)];
+    };
+    static constexpr uint64_t segment_magic = UINT64_C(0x314b434f4c474e52); // "RNGLOCK1"
+    // While initializing, the state holds the flag and the initializer's
+    // pid.
+    enum : uint32_t { uninitialized = 0, ready = 1, initializing = 1U << 31 };
+
+    void* _mapping = nullptr;
+    size_t _mapping_size = 0;
+    segment_header* _header = nullptr;
+    region* _regions = nullptr;
+    uint64_t _region_count = 0;
+
+    void attach(void* memory, size_t size, uint64_t region_size, uint64_t region_count) {
+        assert(region_count > 0);
+        assert(size >= segment_size(region_count));
+        _header = static_cast<segment_header*>(memory);
+        _regions = reinterpret_cast<region*>(_header + 1);
+        _region_count = region_count;
+        uint32_t state = _header->state.load(std::memory_order_acquire);
+        while (state != ready) {
+            bool orphaned = (state & initializing)
+                && range_lock_detail::process_is_dead(pid_t(state & ~initializing));
+            if (state != uninitialized && !orphaned) {
+                range_lock_detail::park_shared_for(_header->state, state, std::chrono::milliseconds(10));
+                state = _header->state.load(std::memory_order_acquire);
+                continue;
+            }
+            uint32_t initializer = initializing | uint32_t(range_lock_detail::current_pid());
+            if (!_header->state.compare_exchange_strong(state, initializer, std::memory_order_acquire)) {
+                continue;
+            }
+            _header->magic = segment_magic;
+            _header->region_size = region_size;
+            _header->region_count = region_count;
+            for (uint64_t i = 0; i < region_count; i++) {
+                new (&_regions[i]) region;
+            }
+            _header->state.store(ready, std::memory_order_release);
+            range_lock_detail::unpark_shared_all(_header->state);
+            return;
+        }
+        if (_header->magic != segment_magic || _header->region_size != region_size
+                || _header->region_count != region_count) {
+            throw std::invalid_argument("shm_region_table: segment was initialized with another layout");
+        }
+    }
+
+    static std::system_error system_error(const char* what) {
+        return std::system_error(errno, std::generic_category(), what);
+    }
+public:
+    // Bytes of shared memory needed for region_count regions.
+    static size_t segment_size(uint64_t region_count) {
+        return sizeof(segment_header) + region_count * sizeof(region);
+    }
+
+    // Attach to memory shared with other processes, of at least
+    // segment_size(region_count) bytes, which must be zeroed or initialized
+    // by another table with the same region size and count.
+    shm_region_table(void* memory, size_t size, uint64_t region_size, uint64_t region_count) {
+        attach(memory, size, region_size, region_count);
+    }
+
+    // Attach to the POSIX shared memory object name, see shm_open(), creating
+    // it if it doesn't exist. It's mapped until the table is destroyed, and
+    // lives until remove() is called.
+    shm_region_table(const char* name, uint64_t region_size, uint64_t region_count) {
+        size_t size = segment_size(region_count);
+        int fd = ::shm_open(name, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            throw system_error("shm_open");
+        }
+        struct stat st;
+        if (::fstat(fd, &st) < 0 || (size_t(st.st_size) < size && ::ftruncate(fd, off_t(size)) < 0)) {
+            std::system_error e = system_error("shm_region_table");
+            ::close(fd);
+            throw e;
+        }
+        void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            throw system_error("mmap");
+        }
+        _mapping = memory;
+        _mapping_size = size;
+        try {
+            attach(memory, size, region_size, region_count);
+        } catch (...) {
+            ::munmap(_mapping, _mapping_size);
+            throw;
+        }
+    }
+
+    ~shm_region_table() {
+        if (_mapping) {
+            ::munmap(_mapping, _mapping_size);
+        }
+    }
+
+    shm_region_table(const shm_region_table&) = delete;
+    shm_region_table& operator=(const shm_region_table&) = delete;
+
+    // Remove the POSIX shared memory object name. Processes attached to it
+    // keep using it.
+    static void remove(const char* name) {
+        ::shm_unlink(name);
+    }
+
+    uint64_t region_count() const { return _region_count; }
+
+#ifdef RANGE_LOCK_STATS
+    // All regions are always live, and there's no table mutex.
+    region_table_stats stats() const {
+        region_table_stats st;
+        st.live_regions = _region_count;
+        st.peak_live_regions = _region_count;
+        return st;
+    }
+
+    void reset_stats() {}
+#endif
+
+    region& get_region(uint64_t region_id) const {
+        assert(region_id < _region_count); // assert region is within the resource
+        return _regions[region_id];
+    }
+
+    void pin(uint64_t first_id, unsigned count, region** regions) {
+        for (unsigned i = 0; i < count; i++) {
+            regions[i] = &get_region(first_id + i);
+        }
+    }
+
+    void find_pinned(uint64_t first_id, unsigned count, region** regions) {
+        pin(first_id, count, regions);
+    }
+
+    template <typename Func>
+    void unpin(uint64_t first_id, unsigned count, Func&& f) {
+        for (unsigned i = 0; i < count; i++) {
+            f(get_region(first_id + i));
+        }
+    }
+
+    template <typename Func>
+    void unpin_pinned(uint64_t, unsigned count, region** regions, Func&& f) {
+        for (unsigned i = 0; i < count; i++) {
+            f(*regions[i]);
+        }
+    }
+};
+
+/// Range lock shared between processes, whose regions live in shared memory,
+/// see shm_region_table, so processes mapping the same data can lock ranges
+/// of it without a syscall per acquisition.
+/// Sampling, statistics, optimistic reads and whole-resource locks are kept
+/// per process, so they only see the requests of the calling process: a
+/// lock_all() only excludes the ranges locked by the calling process.
+typedef basic_range_lock<shm_region_table> shm_range_lock;
+
+// Bytes of shared memory needed by a shm_range_lock for a resource of the
+// given size, with the region size create_range_lock() would choose.
+inline size_t shm_range_lock_segment_size(uint64_t resource_size) {
+    uint64_t region_size = shm_range_lock::region_size_for(resource_size);
+    return shm_region_table::segment_size((resource_size + region_size - 1) / region_size);
+}
+
+// Create a shm_range_lock in memory shared with other processes, of at least
+// shm_range_lock_segment_size(resource_size) bytes, for a resource of a fixed
+// size. Only ranges within [0, resource_size) can be locked.
+inline std::unique_ptr<shm_range_lock> create_shm_range_lock(void* memory, size_t size, uint64_t resource_size) {
+    uint64_t region_size = shm_range_lock::region_size_for(resource_size);
+    uint64_t region_count = (resource_size + region_size - 1) / region_size;
+    return std::unique_ptr<shm_range_lock>(new shm_range_lock(region_size, memory, size, region_size, region_count));
+}
+
+// Same as above, in the POSIX shared memory object name, created if needed,
+// so that every process passing the same name and resource size shares it.
+inline std::unique_ptr<shm_range_lock> create_shm_range_lock(const char* name, uint64_t resource_size) {
+    uint64_t region_size = shm_range_lock::region_size_for(resource_size);
+    uint64_t region_count = (resource_size + region_size - 1) / region_size;
+    return std::unique_ptr<shm_range_lock>(new shm_range_lock(region_size, name, region_size, region_count));
+}
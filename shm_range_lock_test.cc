@@ -0,0 +1,220 @@
+///
+/// Purpose of this program is to test shm_range_lock implementation.
+///
+
+#include "shm_range_lock.hh"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <assert.h>
+#include <sys/wait.h>
+
+#define print_test_name() \
+    std::cout << "\nRunning " << __FUNCTION__ << "...\n";
+
+static const uint64_t resource_size = uint64_t(1) << 30;
+
+// Run f in a child process, and return its exit status.
+template <typename Func>
+static int run_in_child(Func&& f) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        _exit(f());
+    }
+    int status = 0;
+    pid_t waited = waitpid(pid, &status, 0);
+    assert(waited == pid);
+    (void)waited;
+    assert(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+static void exclusion_test(shm_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that a range held by this process is busy in another one\n";
+    range_lock.lock(0, 2 * size);
+    assert(run_in_child([&] { return range_lock.try_lock(size, 2 * size) ? 1 : 0; }) == 0);
+    assert(run_in_child([&] { return range_lock.try_lock_shared(size, size) ? 1 : 0; }) == 0);
+    assert(run_in_child([&] {
+        if (!range_lock.try_lock(2 * size, size)) {
+            return 1;
+        }
+        range_lock.unlock(2 * size, size);
+        return 0;
+    }) == 0);
+    range_lock.unlock(0, 2 * size);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that readers in different processes share a range\n";
+    range_lock.lock_shared(0, 2 * size);
+    assert(run_in_child([&] {
+        if (!range_lock.try_lock_shared(0, size)) {
+            return 1;
+        }
+        range_lock.unlock_shared(0, size);
+        return range_lock.try_lock(0, size) ? 1 : 0;
+    }) == 0);
+    range_lock.unlock_shared(0, 2 * size);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a range left locked by an exited process can be taken\n";
+    assert(run_in_child([&] { range_lock.lock(0, size); return 0; }) == 0);
+    // The child exited holding the range, so only the recovery can release it.
+    auto recovered = shm_region_mutex::recovered_regions();
+    range_lock.lock(0, size);
+    assert(shm_region_mutex::recovered_regions() == recovered + 1);
+    range_lock.unlock(0, size);
+    std::cout << "Succeeded\n";
+}
+
+static void recovery_test(shm_range_lock& range_lock) {
+    print_test_name();
+
+    auto size = range_lock.region_size();
+    std::cout << "Checking that a process waiting on a range held by a dead one recovers it\n";
+    assert(run_in_child([&] {
+        pid_t holder = fork();
+        if (holder == 0) {
+            range_lock.lock(0, 4 * size);
+            _exit(0);
+        }
+        waitpid(holder, nullptr, 0);
+        auto recovered = shm_region_mutex::recovered_regions();
+        if (!range_lock.try_lock_for(0, 4 * size, std::chrono::seconds(5))) {
+            return 1;
+        }
+        range_lock.unlock(0, 4 * size);
+        return shm_region_mutex::recovered_regions() == recovered + 4 ? 0 : 1;
+    }) == 0);
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that a range held by a live process isn't recovered\n";
+    range_lock.lock(0, size);
+    assert(run_in_child([&] {
+        auto timeout = 2 * shm_region_mutex::owner_check_interval();
+        return range_lock.try_lock_for(0, size, timeout) ? 1 : 0;
+    }) == 0);
+    range_lock.unlock(0, size);
+    std::cout << "Succeeded\n";
+}
+
+static void mutual_exclusion_test(shm_range_lock& range_lock, uint64_t* counters) {
+    print_test_name();
+
+    const unsigned processes = 4;
+    const unsigned iterations = 20000;
+    const uint64_t regions = 64;
+    auto size = range_lock.region_size();
+    std::cout << "Checking that processes incrementing overlapping ranges don't lose updates\n";
+    std::vector<pid_t> children;
+    for (unsigned i = 0; i < processes; i++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            uint64_t state = i + 1;
+            for (unsigned j = 0; j < iterations; j++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t first = (state >> 33) % regions;
+                uint64_t count = 1 + (state >> 20) % std::min(regions - first, uint64_t(8));
+                range_lock.with_lock(first * size, count * size, [&] {
+                    for (uint64_t k = first; k < first + count; k++) {
+                        counters[k]++;
+                    }
+                    counters[regions] += count;
+                });
+            }
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    for (auto pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    uint64_t total = 0;
+    for (uint64_t k = 0; k < regions; k++) {
+        total += counters[k];
+    }
+    assert(total == counters[regions]);
+    std::cout << "Checked " << total << " increments from " << processes << " processes\n";
+}
+
+static void crashed_initializer_test() {
+    print_test_name();
+
+    size_t segment_size = shm_range_lock_segment_size(resource_size);
+    void* memory = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    std::cout << "Checking that a segment left initializing by a dead process is taken over\n";
+    // The state word follows the magic, region size and region count of the
+    // header, and names the initializer while it's initializing.
+    auto state = reinterpret_cast<std::atomic<uint32_t>*>(static_cast<char*>(memory) + 3 * sizeof(uint64_t));
+    assert(run_in_child([&] {
+        state->store((1U << 31) | uint32_t(getpid()));
+        return 0;
+    }) == 0);
+    auto range_lock = create_shm_range_lock(memory, segment_size, resource_size);
+    auto size = range_lock->region_size();
+    range_lock->lock(0, size);
+    assert(run_in_child([&] { return range_lock->try_lock(0, size) ? 1 : 0; }) == 0);
+    range_lock->unlock(0, size);
+    range_lock.reset();
+    munmap(memory, segment_size);
+    std::cout << "Succeeded\n";
+}
+
+static void named_segment_test() {
+    print_test_name();
+
+    std::string name = "/shm_range_lock_test." + std::to_string(getpid());
+    std::cout << "Checking that processes opening the same name share the lock\n";
+    {
+        auto range_lock = create_shm_range_lock(name.c_str(), resource_size);
+        auto size = range_lock->region_size();
+        range_lock->lock(size, size);
+        assert(run_in_child([&] {
+            auto other = create_shm_range_lock(name.c_str(), resource_size);
+            if (other->try_lock(0, 2 * size)) {
+                return 1;
+            }
+            return other->try_lock(0, size) ? 0 : 1;
+        }) == 0);
+        range_lock->unlock(size, size);
+    }
+    std::cout << "Succeeded\n";
+
+    std::cout << "Checking that opening a segment with another layout fails\n";
+    bool thrown = false;
+    try {
+        create_shm_range_lock(name.c_str(), resource_size * 4);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+    shm_region_table::remove(name.c_str());
+    std::cout << "Succeeded\n";
+}
+
+int main(void) {
+    size_t segment_size = shm_range_lock_segment_size(resource_size);
+    size_t size = segment_size + 65 * sizeof(uint64_t);
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    auto range_lock = create_shm_range_lock(memory, segment_size, resource_size);
+    auto counters = reinterpret_cast<uint64_t*>(static_cast<char*>(memory) + segment_size);
+    std::cout << "Range lock granularity (a.k.a. region size): " << range_lock->region_size() << std::endl;
+
+    exclusion_test(*range_lock);
+    recovery_test(*range_lock);
+    mutual_exclusion_test(*range_lock, counters);
+    crashed_initializer_test();
+    named_segment_test();
+
+    range_lock.reset();
+    munmap(memory, size);
+    return 0;
+}